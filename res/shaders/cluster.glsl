@@ -0,0 +1,112 @@
+// Clustered light lists, LightGrid in light.h
+#include "shadow.glsl"
+
+#define LIGHT_DIRECTIONAL 0
+#define LIGHT_POINT 1
+#define LIGHT_SPOT 2
+
+#define CLUSTER_LIGHT_MAX 255
+#define CLUSTER_STRIDE (CLUSTER_LIGHT_MAX + 1)
+
+struct Light {
+	uint type;
+	float radius;
+	vec4 positionConstant;
+	vec4 directionLinear;
+	vec4 ambientQuadratic;
+	vec4 diffuseCutOff;
+	vec4 specularOuterCutOff;
+};
+
+// LightGridParams in light.h
+layout (std140, binding = 2) uniform LightGrid {
+	uvec3 u_clusterCount;
+	uint u_lightCount;
+	vec2 u_tileSize;
+	float u_sliceScale;
+	float u_sliceBias;
+	float u_near;
+	float u_far;
+	uint u_directionalCount;
+};
+
+// Directional lights first, then the lights binned into clusters
+layout (std430, binding = 8) readonly buffer Lights {
+	Light b_lights[];
+};
+
+// Per cluster: light count then up to CLUSTER_LIGHT_MAX indices into b_lights
+layout (std430, binding = 9) buffer Clusters {
+	uint b_clusters[];
+};
+
+uint clusterIndex(uvec3 cell) {
+	return (cell.z * u_clusterCount.y + cell.y) * u_clusterCount.x + cell.x;
+}
+
+// Cluster containing a fragment at the given positive view depth
+uint clusterAt(vec2 fragCoord, float viewDepth) {
+	uvec2 tile = min(uvec2(fragCoord / u_tileSize), u_clusterCount.xy - 1u);
+	uint slice = uint(clamp(log(viewDepth) * u_sliceScale + u_sliceBias, 0.0, float(u_clusterCount.z - 1u)));
+	return clusterIndex(uvec3(tile, slice));
+}
+
+// Depth of the near boundary of a slice, slices are spaced exponentially
+float sliceDepth(uint slice) {
+	return u_near * pow(u_far / u_near, float(slice) / float(u_clusterCount.z));
+}
+
+// shadow scales the direct terms, ambient stays
+vec3 lighting(Light light, vec3 position, vec3 normal, vec3 viewDirection, vec3 diffuseColor, vec3 specularColor, float shininess, float shadow) {
+	vec3 ambient = light.ambientQuadratic.rgb * diffuseColor;
+
+	vec3 lightDirection = (light.type == LIGHT_DIRECTIONAL) ? 
+		normalize(-light.directionLinear.xyz) :
+		normalize(light.positionConstant.xyz - position);
+
+	float diffuseFactor = max(dot(normal, lightDirection), 0.0);
+	vec3 diffuse = light.diffuseCutOff.rgb * diffuseFactor * diffuseColor;
+	
+	vec3 halfwayDirection = normalize(lightDirection + viewDirection);
+	float specularFactor = pow(max(dot(normal, halfwayDirection), 0.0), shininess);
+	vec3 specular = light.specularOuterCutOff.rgb * specularFactor * specularColor;
+
+	if (light.type == LIGHT_SPOT) {
+		float theta = dot(lightDirection, normalize(-(light.directionLinear.xyz)));
+		float epsilon = (light.diffuseCutOff.w - light.specularOuterCutOff.w);
+		float intensity = clamp((theta - light.specularOuterCutOff.w) / epsilon, 0.0, 1.0);
+		diffuse *= intensity;
+		specular *= intensity;
+	}
+
+	if (light.type > LIGHT_DIRECTIONAL) {
+		float d = length(light.positionConstant.xyz - position);
+		float attenuation = 1.0 / (
+			light.positionConstant.w +
+			light.directionLinear.w * d +
+			light.ambientQuadratic.w * (d * d)
+		);
+		ambient *= attenuation;
+		diffuse *= attenuation;
+		specular *= attenuation;
+	}
+
+	return (ambient + (diffuse + specular) * shadow);
+}
+
+// Directional lights plus the lights binned into the cluster under fragCoord, expects the Camera block.
+// Only the first directional light casts shadows
+vec3 shadeClustered(vec3 position, vec2 fragCoord, vec3 normal, vec3 diffuseColor, vec3 specularColor, float shininess) {
+	vec3 viewDirection = normalize(u_position - position);
+	vec3 result = vec3(0);
+	for (uint i = 0; i < u_directionalCount; i++) {
+		float shadow = i == 0u ? shadowFactor(position, normal) : 1.0;
+		result += lighting(b_lights[i], position, normal, viewDirection, diffuseColor, specularColor, shininess, shadow);
+	}
+	uint base = clusterAt(fragCoord, -(u_view * vec4(position, 1.0)).z) * CLUSTER_STRIDE;
+	uint clusterCount = b_clusters[base];
+	for (uint i = 0; i < clusterCount; i++) {
+		result += lighting(b_lights[b_clusters[base + 1u + i]], position, normal, viewDirection, diffuseColor, specularColor, shininess, 1.0);
+	}
+	return result;
+}
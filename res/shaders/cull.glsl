@@ -0,0 +1,17 @@
+// View of the current culling pass, CullView in scene.h
+layout (std140, binding = 4) uniform CullView {
+	mat4 u_cullViewProjection;
+	vec4 u_cullPlanes[6];
+	vec4 u_cullDepthPlane;
+	uint u_cullRegion;
+	uint u_cullCommandCount;
+	uint u_cullSlotCount;
+	uint u_cullBuckets;
+	float u_cullBucketScale;
+	float u_cullBucketBias;
+};
+
+// Surviving instances of each command, per region at u_cullRegion * u_cullSlotCount
+layout (std430, binding = 14) buffer CullInstances {
+	uint b_cullInstances[];
+};
@@ -0,0 +1,47 @@
+// Shared by the passes of scene_cull, needs transform.glsl and cull.glsl first
+
+// CullCommand in scene.h
+struct CullCommand {
+	vec4 bounds;
+	Draw draw;
+	uint first;
+	uint count;
+	uint slots;
+};
+
+layout (std430, binding = 12) readonly buffer CullCommands {
+	CullCommand b_cullCommands[];
+};
+
+// DrawIndirectCommand per command, bucket and region, copied from the scene's templates before the dispatch
+layout (std430, binding = 13) buffer CullOutput {
+	uint b_cullOutput[];
+};
+
+// Bucket << 28 | rank within the bucket of each slot of an ordered cull, CULL_RANK_NONE when culled
+layout (std430, binding = 15) buffer CullRanks {
+	uint b_cullRanks[];
+};
+
+#define CULL_RANK_NONE 0xFFFFFFFFu
+#define CULL_RANK_SHIFT 28u
+
+uint cullSlot() {
+	return (gl_WorkGroupID.y * gl_NumWorkGroups.x + gl_WorkGroupID.x) * CULL_THREADS + gl_LocalInvocationID.x;
+}
+
+// Command owning a slot, found by its first slot
+uint cullCommand(uint slot) {
+	uint low = 0, high = u_cullCommandCount;
+	while (high - low > 1u) {
+		uint middle = (low + high) / 2u;
+		if (b_cullCommands[middle].first <= slot) low = middle;
+		else high = middle;
+	}
+	return low;
+}
+
+// Word of a command's indirect draw in the current region, 1 is the instance count and 4 the base instance
+uint cullOutputWord(uint bucket, uint command, uint word) {
+	return ((u_cullRegion * u_cullBuckets + bucket) * u_cullCommandCount + command) * 5u + word;
+}
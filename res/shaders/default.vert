@@ -1,24 +1,23 @@
 #version 460 core
 #extension GL_ARB_bindless_texture : require
 
-layout (location = 0) in ivec2 i_assign;
-layout (location = 1) in vec3 i_position;
-layout (location = 2) in vec2 i_texCoord;
-layout (location = 3) in vec3 i_normal;
-layout (location = 4) in vec3 i_tangent;
-layout (location = 5) in vec3 i_bitangent;
+layout (location = 0) in vec3 i_position;
+layout (location = 1) in vec2 i_texCoord;
+layout (location = 2) in vec3 i_normal;
+layout (location = 3) in vec4 i_tangent;
 
 out VS_OUT {
 	flat ivec2 assign;
+	flat vec4 tint;
 	vec3 position;
 	vec2 texCoord;
 	vec3 normal;
 	mat3 TBN;
 } vs_out;
 
-layout (std140, binding = 0) uniform Global {
-	samplerBuffer u_transforms;
-};
+#include "transform.glsl"
+
+invariant gl_Position;
 
 layout (std140, binding = 1) uniform Camera {
 	mat4 u_projection;
@@ -27,21 +26,21 @@ layout (std140, binding = 1) uniform Camera {
 };
 
 void main() {
-	mat4 model = mat4(
-		texelFetch(u_transforms, i_assign.y * 4 + 0),
-		texelFetch(u_transforms, i_assign.y * 4 + 1),
-		texelFetch(u_transforms, i_assign.y * 4 + 2),
-		texelFetch(u_transforms, i_assign.y * 4 + 3)
-	);
-
-	vs_out.assign = i_assign;
+	int transform;
+	uint material;
+	vec4 tint;
+	mat4 model;
+	mat3 normalMatrix;
+	fetchInstance(transform, material, tint, model, normalMatrix);
+
+	vs_out.assign = ivec2(material, transform);
+	vs_out.tint = tint;
 	vs_out.position = vec3(model * vec4(i_position, 1.0));
 	vs_out.texCoord = i_texCoord;
-	mat3 normalMatrix = transpose(inverse(mat3(model)));
 	vec3 N = normalize(normalMatrix * i_normal);
-	vec3 T = normalize(normalMatrix * i_tangent);
+	vec3 T = normalize(normalMatrix * i_tangent.xyz);
 	T = normalize(T - dot(T, N) * N);
-	vec3 B = normalize(normalMatrix * i_bitangent);
+	vec3 B = cross(N, T) * i_tangent.w;
 	vs_out.normal = N;
 	vs_out.TBN = mat3(T, B, N);
 
@@ -0,0 +1,43 @@
+#version 460 core
+
+out vec4 o_fragColor;
+
+layout (std140, binding = 1) uniform Camera {
+	mat4 u_projection;
+	mat4 u_view;
+	vec3 u_position;
+};
+
+#include "cluster.glsl"
+#include "gbuffer.glsl"
+
+layout (binding = 0) uniform sampler2D u_albedo;
+layout (binding = 1) uniform sampler2D u_normal;
+layout (binding = 2) uniform sampler2D u_specular;
+layout (binding = 3) uniform sampler2D u_depth;
+
+// Light the G-buffer once per pixel through the same cluster lists as the forward path
+void main() {
+	ivec2 texel = ivec2(gl_FragCoord.xy);
+	float depth = texelFetch(u_depth, texel, 0).r;
+	// Left for the skybox
+	if (depth == 1.0) discard;
+	gl_FragDepth = depth;
+
+	// View position from the perspective terms, the view matrix is rigid so its inverse is a transpose
+	vec3 ndc = vec3(gl_FragCoord.xy / vec2(textureSize(u_depth, 0)), depth) * 2.0 - 1.0;
+	float viewZ = -u_projection[3][2] / (ndc.z + u_projection[2][2]);
+	vec3 viewPosition = vec3(ndc.xy * -viewZ / vec2(u_projection[0][0], u_projection[1][1]), viewZ);
+	vec3 position = transpose(mat3(u_view)) * (viewPosition - u_view[3].xyz);
+
+	vec4 specular = texelFetch(u_specular, texel, 0);
+	vec3 result = shadeClustered(
+		position,
+		gl_FragCoord.xy,
+		decodeNormal(texelFetch(u_normal, texel, 0).rg),
+		texelFetch(u_albedo, texel, 0).rgb,
+		specular.rgb,
+		decodeShininess(specular.a)
+	);
+	o_fragColor = vec4(result, 1.0);
+}
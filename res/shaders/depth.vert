@@ -0,0 +1,25 @@
+#version 460 core
+#extension GL_ARB_bindless_texture : require
+
+layout (location = 0) in vec3 i_position;
+
+#include "transform.glsl"
+
+// Same position math in every program so a depth prepass matches exactly under GL_EQUAL
+invariant gl_Position;
+
+layout (std140, binding = 1) uniform Camera {
+	mat4 u_projection;
+	mat4 u_view;
+	vec3 u_position;
+};
+
+void main() {
+	int transform;
+	uint material;
+	vec4 tint;
+	mat4 model;
+	mat3 normalMatrix;
+	fetchInstance(transform, material, tint, model, normalMatrix);
+	gl_Position = u_projection * u_view * model * vec4(i_position, 1.0);
+}
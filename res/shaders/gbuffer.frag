@@ -0,0 +1,26 @@
+#version 460 core
+#extension GL_ARB_bindless_texture : require
+#extension GL_ARB_gpu_shader_int64 : require
+
+in VS_OUT {
+	flat ivec2 assign;
+	flat vec4 tint;
+	vec3 position;
+	vec2 texCoord;
+	vec3 normal;
+	mat3 TBN;
+} fs_in;
+
+layout (location = 0) out vec4 o_albedo;
+layout (location = 1) out vec2 o_normal;
+layout (location = 2) out vec4 o_specular;
+
+#include "surface.glsl"
+#include "gbuffer.glsl"
+
+void main() {
+	Surface surface = sampleSurface(uint(fs_in.assign.x), fs_in.texCoord, fs_in.normal, fs_in.TBN, fs_in.tint.rgb);
+	o_albedo = vec4(surface.diffuse, 1.0);
+	o_normal = encodeNormal(surface.normal);
+	o_specular = vec4(surface.specular, encodeShininess(surface.shininess));
+}
@@ -0,0 +1,27 @@
+// G-buffer encoding, GBuffer in gbuffer.h
+// 0: RGBA8 albedo, 1: RG16_SNORM octahedral normal, 2: RGBA8 specular and log2 shininess
+#define GBUFFER_SHININESS_BITS 11.0
+
+vec2 octWrap(vec2 v) {
+	return (1.0 - abs(v.yx)) * vec2(v.x >= 0.0 ? 1.0 : -1.0, v.y >= 0.0 ? 1.0 : -1.0);
+}
+
+vec2 encodeNormal(vec3 n) {
+	n /= abs(n.x) + abs(n.y) + abs(n.z);
+	return n.z >= 0.0 ? n.xy : octWrap(n.xy);
+}
+
+vec3 decodeNormal(vec2 e) {
+	vec3 n = vec3(e, 1.0 - abs(e.x) - abs(e.y));
+	float t = clamp(-n.z, 0.0, 1.0);
+	n.xy += vec2(n.x >= 0.0 ? -t : t, n.y >= 0.0 ? -t : t);
+	return normalize(n);
+}
+
+float encodeShininess(float shininess) {
+	return log2(max(shininess, 1.0)) / GBUFFER_SHININESS_BITS;
+}
+
+float decodeShininess(float encoded) {
+	return exp2(encoded * GBUFFER_SHININESS_BITS);
+}
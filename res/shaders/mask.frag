@@ -0,0 +1,14 @@
+#version 460 core
+#extension GL_ARB_bindless_texture : require
+#extension GL_ARB_gpu_shader_int64 : require
+
+in VS_OUT {
+	flat uint material;
+	vec2 texCoord;
+} fs_in;
+
+#include "surface.glsl"
+
+void main() {
+	if (sampleMask(fs_in.material, fs_in.texCoord, dFdx(fs_in.texCoord), dFdy(fs_in.texCoord)) < MATERIAL_MASK_CUTOFF) discard;
+}
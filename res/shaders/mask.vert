@@ -0,0 +1,34 @@
+#version 460 core
+#extension GL_ARB_bindless_texture : require
+
+// Alpha tested depth of masked geometry, the shading pass redraws it under GL_EQUAL
+
+layout (location = 0) in vec3 i_position;
+layout (location = 1) in vec2 i_texCoord;
+
+out VS_OUT {
+	flat uint material;
+	vec2 texCoord;
+} vs_out;
+
+#include "transform.glsl"
+
+invariant gl_Position;
+
+layout (std140, binding = 1) uniform Camera {
+	mat4 u_projection;
+	mat4 u_view;
+	vec3 u_position;
+};
+
+void main() {
+	int transform;
+	uint material;
+	vec4 tint;
+	mat4 model;
+	mat3 normalMatrix;
+	fetchInstance(transform, material, tint, model, normalMatrix);
+	vs_out.material = material;
+	vs_out.texCoord = i_texCoord;
+	gl_Position = u_projection * u_view * model * vec4(i_position, 1.0);
+}
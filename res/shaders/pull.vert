@@ -0,0 +1,62 @@
+#version 460 core
+#extension GL_ARB_bindless_texture : require
+
+// Vertex pulling variant of default.vert, gl_VertexID already includes the command's base vertex
+
+out VS_OUT {
+	flat ivec2 assign;
+	flat vec4 tint;
+	vec3 position;
+	vec2 texCoord;
+	vec3 normal;
+	mat3 TBN;
+} vs_out;
+
+#include "transform.glsl"
+
+invariant gl_Position;
+
+layout (std140, binding = 1) uniform Camera {
+	mat4 u_projection;
+	mat4 u_view;
+	vec3 u_position;
+};
+
+// Tightly packed vec3 positions
+layout (std430, binding = 1) readonly buffer Positions {
+	float b_positions[];
+};
+
+// Vertex: vec2 texCoord, vec3 normal, vec3 tangent, float sign
+layout (std430, binding = 2) readonly buffer Attributes {
+	float b_attributes[];
+};
+
+void main() {
+	int p = gl_VertexID * 3;
+	int a = gl_VertexID * 9;
+	vec3 position = vec3(b_positions[p], b_positions[p + 1], b_positions[p + 2]);
+	vec2 texCoord = vec2(b_attributes[a], b_attributes[a + 1]);
+	vec3 normal = vec3(b_attributes[a + 2], b_attributes[a + 3], b_attributes[a + 4]);
+	vec4 tangent = vec4(b_attributes[a + 5], b_attributes[a + 6], b_attributes[a + 7], b_attributes[a + 8]);
+
+	int transform;
+	uint material;
+	vec4 tint;
+	mat4 model;
+	mat3 normalMatrix;
+	fetchInstance(transform, material, tint, model, normalMatrix);
+
+	vs_out.assign = ivec2(material, transform);
+	vs_out.tint = tint;
+	vs_out.position = vec3(model * vec4(position, 1.0));
+	vs_out.texCoord = texCoord;
+	vec3 N = normalize(normalMatrix * normal);
+	vec3 T = normalize(normalMatrix * tangent.xyz);
+	T = normalize(T - dot(T, N) * N);
+	vec3 B = cross(N, T) * tangent.w;
+	vs_out.normal = N;
+	vs_out.TBN = mat3(T, B, N);
+
+	gl_Position = u_projection * u_view * model * vec4(position, 1.0);
+}
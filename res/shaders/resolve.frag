@@ -0,0 +1,119 @@
+#version 460 core
+#extension GL_ARB_bindless_texture : require
+#extension GL_ARB_gpu_shader_int64 : require
+
+#define TRANSFORM_NO_DRAW_PARAMETERS
+#define VISIBILITY_COMMAND_BITS 24
+
+flat in uint vs_cache;
+
+out vec4 o_fragColor;
+
+layout (std140, binding = 1) uniform Camera {
+	mat4 u_projection;
+	mat4 u_view;
+	vec3 u_position;
+};
+
+#include "transform.glsl"
+#include "surface.glsl"
+#include "cluster.glsl"
+
+// Pools of the geometry being resolved, bound per cache object like the vertex pulling path
+layout (std430, binding = 1) readonly buffer Positions {
+	float b_positions[];
+};
+
+layout (std430, binding = 2) readonly buffer Attributes {
+	float b_attributes[];
+};
+
+layout (std430, binding = 10) readonly buffer Indices {
+	uint b_indices[];
+};
+
+// cache << VISIBILITY_COMMAND_BITS | command for every instance in the visibility ID space
+layout (std430, binding = 11) readonly buffer VisibilityTable {
+	uint b_visibilityTable[];
+};
+
+layout (binding = 0) uniform usampler2D u_visibility;
+layout (binding = 1) uniform sampler2D u_depth;
+
+// Perspective correct barycentrics of the pixel and their change per pixel step in x and y
+void barycentrics(vec4 c0, vec4 c1, vec4 c2, vec2 ndc, vec2 size, out vec3 lambda, out vec3 ddx, out vec3 ddy) {
+	vec3 invW = 1.0 / vec3(c0.w, c1.w, c2.w);
+	vec2 p0 = c0.xy * invW.x;
+	vec2 p1 = c1.xy * invW.y;
+	vec2 p2 = c2.xy * invW.z;
+	float invDet = 1.0 / determinant(mat2(p2 - p1, p0 - p1));
+	ddx = vec3(p1.y - p2.y, p2.y - p0.y, p0.y - p1.y) * invDet * invW;
+	ddy = vec3(p2.x - p1.x, p0.x - p2.x, p1.x - p0.x) * invDet * invW;
+	float ddxSum = dot(ddx, vec3(1.0));
+	float ddySum = dot(ddy, vec3(1.0));
+
+	vec2 delta = ndc - p0;
+	float interpInvW = invW.x + delta.x * ddxSum + delta.y * ddySum;
+	float interpW = 1.0 / interpInvW;
+	lambda = interpW * (vec3(invW.x, 0.0, 0.0) + delta.x * ddx + delta.y * ddy);
+
+	// One pixel is 2 / size in ndc
+	ddx *= 2.0 / size.x;
+	ddy *= 2.0 / size.y;
+	ddxSum *= 2.0 / size.x;
+	ddySum *= 2.0 / size.y;
+	ddx = (lambda * interpInvW + ddx) / (interpInvW + ddxSum) - lambda;
+	ddy = (lambda * interpInvW + ddy) / (interpInvW + ddySum) - lambda;
+}
+
+void main() {
+	ivec2 texel = ivec2(gl_FragCoord.xy);
+	float depth = texelFetch(u_depth, texel, 0).r;
+	if (depth == 1.0) discard;
+	uint id = texelFetch(u_visibility, texel, 0).r;
+	uint instance = id >> u_visibilityShift;
+	uint entry = b_visibilityTable[instance];
+	if ((entry >> VISIBILITY_COMMAND_BITS) != vs_cache) discard;
+	gl_FragDepth = depth;
+
+	Draw draw = b_draws[entry & ((1u << VISIBILITY_COMMAND_BITS) - 1u)];
+	uint triangle = id & ((1u << u_visibilityShift) - 1u);
+	int transform;
+	uint material;
+	vec4 tint;
+	mat4 model;
+	mat3 normalMatrix;
+	fetchInstanceAt(draw, int(instance - draw.visibility), transform, material, tint, model, normalMatrix);
+	mat4 modelViewProjection = u_projection * u_view * model;
+
+	vec3 positions[3];
+	vec4 clip[3];
+	vec2 texCoords[3];
+	vec3 normals[3];
+	vec4 tangents[3];
+	for (uint i = 0; i < 3; i++) {
+		int vertex = int(b_indices[draw.baseIndex + triangle * 3u + i]) + draw.baseVertex;
+		int p = vertex * 3;
+		int a = vertex * 9;
+		positions[i] = vec3(b_positions[p], b_positions[p + 1], b_positions[p + 2]);
+		clip[i] = modelViewProjection * vec4(positions[i], 1.0);
+		texCoords[i] = vec2(b_attributes[a], b_attributes[a + 1]);
+		normals[i] = vec3(b_attributes[a + 2], b_attributes[a + 3], b_attributes[a + 4]);
+		tangents[i] = vec4(b_attributes[a + 5], b_attributes[a + 6], b_attributes[a + 7], b_attributes[a + 8]);
+	}
+
+	vec2 size = vec2(textureSize(u_depth, 0));
+	vec3 lambda, ddx, ddy;
+	barycentrics(clip[0], clip[1], clip[2], gl_FragCoord.xy / size * 2.0 - 1.0, size, lambda, ddx, ddy);
+
+	mat3x2 uv = mat3x2(texCoords[0], texCoords[1], texCoords[2]);
+	vec2 texCoord = uv * lambda;
+	vec3 position = vec3(model * vec4(mat3(positions[0], positions[1], positions[2]) * lambda, 1.0));
+	vec3 N = normalize(normalMatrix * (mat3(normals[0], normals[1], normals[2]) * lambda));
+	vec3 T = normalize(normalMatrix * (mat3(tangents[0].xyz, tangents[1].xyz, tangents[2].xyz) * lambda));
+	T = normalize(T - dot(T, N) * N);
+	vec3 B = cross(N, T) * tangents[0].w;
+
+	Surface surface = sampleSurfaceGrad(material, texCoord, uv * ddx, uv * ddy, N, mat3(T, B, N), tint.rgb);
+	o_fragColor = vec4(shadeClustered(position, gl_FragCoord.xy, surface.normal, surface.diffuse, surface.specular, surface.shininess), 1.0);
+}
@@ -0,0 +1,10 @@
+#version 460 core
+
+// Cache object being resolved, passed as the base instance of the fullscreen triangle
+flat out uint vs_cache;
+
+void main() {
+	vec2 position = vec2((gl_VertexID << 1) & 2, gl_VertexID & 2);
+	gl_Position = vec4(position * 2.0 - 1.0, 0.0, 1.0);
+	vs_cache = uint(gl_BaseInstance);
+}
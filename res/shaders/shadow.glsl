@@ -0,0 +1,31 @@
+// Cascaded shadow map of the first directional light, ShadowParams in shadow.h
+#define SHADOW_CASCADES 4
+#define SHADOW_UNIT 8
+// Receivers are pushed along their normal by this many texels of their cascade
+#define SHADOW_NORMAL_OFFSET 1.5
+#define SHADOW_BIAS 0.0005
+
+struct ShadowCascade {
+	mat4 viewProjection;
+	// World size of one texel
+	float texel;
+};
+
+layout (std140, binding = 3) uniform Shadows {
+	ShadowCascade u_cascades[SHADOW_CASCADES];
+	uint u_cascadeCount;
+};
+
+layout (binding = SHADOW_UNIT) uniform sampler2DArrayShadow u_shadowMap;
+
+// 1 when lit, the first cascade whose box holds the position is used and anything past the last is lit.
+// Cascades refresh at different rates so the boxes are checked rather than split distances
+float shadowFactor(vec3 position, vec3 normal) {
+	for (uint i = 0; i < u_cascadeCount; i++) {
+		vec3 offset = position + normal * u_cascades[i].texel * SHADOW_NORMAL_OFFSET;
+		vec3 p = (u_cascades[i].viewProjection * vec4(offset, 1.0)).xyz * 0.5 + 0.5;
+		if (any(lessThan(p, vec3(0.0))) || any(greaterThan(p, vec3(1.0)))) continue;
+		return texture(u_shadowMap, vec4(p.xy, float(i), p.z - SHADOW_BIAS));
+	}
+	return 1.0;
+}
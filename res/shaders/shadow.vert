@@ -0,0 +1,33 @@
+#version 460 core
+#extension GL_ARB_bindless_texture : require
+
+// Depth of the instances cull.comp kept for the current cascade. SHADOW_MASKED passes what mask.frag
+// needs to alpha test cutout casters
+
+layout (location = 0) in vec3 i_position;
+#ifdef SHADOW_MASKED
+layout (location = 1) in vec2 i_texCoord;
+
+out VS_OUT {
+	flat uint material;
+	vec2 texCoord;
+} vs_out;
+#endif
+
+#include "transform.glsl"
+#include "cull.glsl"
+
+void main() {
+	uint instance = b_cullInstances[u_cullRegion * u_cullSlotCount + gl_BaseInstance + gl_InstanceID];
+	int transform;
+	uint material;
+	vec4 tint;
+	mat4 model;
+	mat3 normalMatrix;
+	fetchInstanceAt(b_draws[gl_DrawID], int(instance), transform, material, tint, model, normalMatrix);
+	gl_Position = u_cullViewProjection * model * vec4(i_position, 1.0);
+#ifdef SHADOW_MASKED
+	vs_out.material = material;
+	vs_out.texCoord = i_texCoord;
+#endif
+}
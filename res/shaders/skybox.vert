@@ -1,6 +1,6 @@
 #version 460 core
 
-layout (location = 1) in vec3 i_position;
+layout (location = 0) in vec3 i_position;
 
 out VS_OUT {
 	vec3 texCoord;
@@ -0,0 +1,68 @@
+// Material sampling shared by the forward and G-buffer fragment shaders
+#include "../../src/material.h"
+
+#define FEEDBACK_BIAS 32.0
+#define FEEDBACK_SCALE 16.0
+
+// MaterialData in scene.h, grows with the scene's material pool
+struct Material {
+	MATERIAL_FIELDS(MATERIAL_FIELD_GLSL)
+};
+
+layout (std430, binding = 7) readonly buffer Materials {
+	Material b_materials[];
+};
+
+layout (std430, binding = 0) buffer Feedback {
+	uint u_feedback[];
+};
+
+struct Surface {
+	vec3 normal;
+	vec3 diffuse;
+	vec3 specular;
+	float shininess;
+	// Diffuse alpha scaled by the material opacity, only blended in the transparent queue
+	float alpha;
+};
+
+// Streamed textures only have storage for their resident levels, so plain sampling never reaches past them.
+// The level comes from explicit uv derivatives so the visibility resolve can pass analytic ones
+vec4 sampleStreamed(sampler2D s, vec2 texCoord, vec2 dx, vec2 dy) {
+	return textureGrad(s, texCoord, dx, dy);
+}
+
+// Record the finest uv derivative per material, sampled on every 8x8th pixel
+void writeFeedback(uint material, vec2 dx, vec2 dy) {
+	if (((int(gl_FragCoord.x) | int(gl_FragCoord.y)) & 7) != 0) return;
+	float lod = 0.5 * log2(max(max(dot(dx, dx), dot(dy, dy)), 1e-20));
+	atomicMin(u_feedback[material], uint(clamp(lod + FEEDBACK_BIAS, 0.0, 63.0) * FEEDBACK_SCALE));
+}
+
+// Opacity of a masked material, 1 without a mask
+float sampleMask(uint index, vec2 texCoord, vec2 dx, vec2 dy) {
+	Material material = b_materials[index];
+	if (material.mask == 0) return 1.0;
+	return sampleStreamed(sampler2D(material.mask), texCoord, dx, dy).r;
+}
+
+Surface sampleSurfaceGrad(uint index, vec2 texCoord, vec2 dx, vec2 dy, vec3 normal, mat3 TBN, vec3 tint) {
+	Material material = b_materials[index];
+	writeFeedback(index, dx, dy);
+
+	Surface surface;
+	surface.normal = (material.normal > 0) ?
+		normalize(TBN * ((sampleStreamed(sampler2D(material.normal), texCoord, dx, dy).rgb) * 2.0 - 1.0)) :
+		normalize(normal);
+	// Materials without a diffuse map are white under the tint, without a specular map they don't shine
+	vec4 diffuse = (material.diffuse > 0) ? sampleStreamed(sampler2D(material.diffuse), texCoord, dx, dy) : vec4(1.0);
+	surface.diffuse = diffuse.rgb * tint;
+	surface.alpha = diffuse.a * material.opacity;
+	surface.specular = (material.specular > 0) ? sampleStreamed(sampler2D(material.specular), texCoord, dx, dy).rgb : vec3(0.0);
+	surface.shininess = material.shininess;
+	return surface;
+}
+
+Surface sampleSurface(uint index, vec2 texCoord, vec3 normal, mat3 TBN, vec3 tint) {
+	return sampleSurfaceGrad(index, texCoord, dFdx(texCoord), dFdy(texCoord), normal, TBN, tint);
+}
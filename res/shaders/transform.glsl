@@ -0,0 +1,174 @@
+// Instance transform storage, the mode is chosen by the scene (TRANSFORM_MODE in scene.h)
+#define TRANSFORM_TEXTURE 0
+#define TRANSFORM_AFFINE 1
+#define TRANSFORM_QUAT 2
+
+layout (std140, binding = 0) uniform Global {
+	// 7 texels per instance: model matrix columns then normal matrix columns
+	samplerBuffer u_transforms;
+	samplerCube u_skybox;
+	uint u_transformMode;
+	// Triangle bits of a visibility ID
+	uint u_visibilityShift;
+};
+
+// TRANSFORM_AFFINE: 3 row-major vec4 rows per instance
+// TRANSFORM_QUAT: rotation quaternion then translation and uniform scale
+layout (std430, binding = 4) readonly buffer Transforms {
+	vec4 b_transforms[];
+};
+
+// Per command data indexed by gl_DrawID, DrawData in scene.h
+struct Draw {
+	// 1 + index into b_generators, 0 when every instance has its own transform
+	uint generator;
+	// First instance of the command in the visibility ID space
+	uint visibility;
+	uint baseIndex;
+	int baseVertex;
+	uint baseInstance;
+};
+
+layout (std430, binding = 3) readonly buffer Draws {
+	Draw b_draws[];
+};
+
+// Procedural InstanceSet, InstanceGenerator in scene.h
+#define PATTERN_GRID 1
+#define PATTERN_RING 2
+#define PATTERN_SCATTER 3
+
+struct Generator {
+	vec4 params;
+	uint pattern;
+	uint count;
+};
+
+layout (std430, binding = 5) readonly buffer Generators {
+	Generator b_generators[];
+};
+
+// Beside each transform record, InstanceData in scene.h
+struct Instance {
+	uint material;
+	// RGBA8
+	uint tint;
+};
+
+layout (std430, binding = 6) readonly buffer Instances {
+	Instance b_instances[];
+};
+
+vec3 quatRotate(vec4 q, vec3 v) {
+	return v + 2.0 * cross(q.xyz, cross(q.xyz, v) + q.w * v);
+}
+
+void fetchTransform(int index, out mat4 model, out mat3 normalMatrix) {
+	if (u_transformMode == TRANSFORM_AFFINE) {
+		vec4 r0 = b_transforms[index * 3 + 0];
+		vec4 r1 = b_transforms[index * 3 + 1];
+		vec4 r2 = b_transforms[index * 3 + 2];
+		model = transpose(mat4(r0, r1, r2, vec4(0.0, 0.0, 0.0, 1.0)));
+		// Cofactor matrix is the inverse transpose up to 1/det, normals are renormalized anyway
+		mat3 m = mat3(model);
+		normalMatrix = mat3(cross(m[1], m[2]), cross(m[2], m[0]), cross(m[0], m[1])) * sign(determinant(m));
+	} else if (u_transformMode == TRANSFORM_QUAT) {
+		vec4 q = b_transforms[index * 2 + 0];
+		vec4 ts = b_transforms[index * 2 + 1];
+		normalMatrix = mat3(
+			quatRotate(q, vec3(1.0, 0.0, 0.0)),
+			quatRotate(q, vec3(0.0, 1.0, 0.0)),
+			quatRotate(q, vec3(0.0, 0.0, 1.0))
+		);
+		model = mat4(mat3(normalMatrix * ts.w));
+		model[3] = vec4(ts.xyz, 1.0);
+		normalMatrix *= sign(ts.w);
+	} else {
+		model = mat4(
+			texelFetch(u_transforms, index * 7 + 0),
+			texelFetch(u_transforms, index * 7 + 1),
+			texelFetch(u_transforms, index * 7 + 2),
+			texelFetch(u_transforms, index * 7 + 3)
+		);
+		normalMatrix = mat3(
+			texelFetch(u_transforms, index * 7 + 4).xyz,
+			texelFetch(u_transforms, index * 7 + 5).xyz,
+			texelFetch(u_transforms, index * 7 + 6).xyz
+		);
+	}
+}
+
+float hashFloat(uint x) {
+	x ^= x >> 16;
+	x *= 0x7feb352dU;
+	x ^= x >> 15;
+	x *= 0x846ca68bU;
+	x ^= x >> 16;
+	return float(x) / 4294967295.0;
+}
+
+// Translation, yaw and uniform scale of instance id within a procedural set
+void generateInstance(Generator g, uint id, out vec3 offset, out float yaw, out float scale) {
+	offset = vec3(0.0);
+	yaw = 0.0;
+	scale = 1.0;
+	if (g.pattern == PATTERN_GRID) {
+		uint columns = max(uint(g.params.x), 1u);
+		offset = vec3(float(id % columns) * g.params.y, 0.0, float(id / columns) * g.params.z);
+	} else if (g.pattern == PATTERN_RING) {
+		float angle = 6.28318530718 * float(id) / float(g.count);
+		offset = vec3(cos(angle), 0.0, sin(angle)) * g.params.x;
+		yaw = -angle + (hashFloat(id) - 0.5) * g.params.y;
+	} else if (g.pattern == PATTERN_SCATTER) {
+		uint seed = id * 4u + floatBitsToUint(g.params.w);
+		float r = g.params.x * sqrt(hashFloat(seed));
+		float angle = 6.28318530718 * hashFloat(seed + 1u);
+		offset = vec3(cos(angle) * r, 0.0, sin(angle) * r);
+		yaw = 6.28318530718 * hashFloat(seed + 2u);
+		scale = mix(g.params.y, g.params.z, hashFloat(seed + 3u));
+	}
+}
+
+// Transform of an instance of a command: its own record, or the set record with the pattern applied
+void fetchInstanceAt(Draw draw, int instanceId, out int transform, out uint material, out vec4 tint, out mat4 model, out mat3 normalMatrix) {
+	transform = int(draw.baseInstance) + (draw.generator != 0 ? 0 : instanceId);
+	Instance instance = b_instances[transform];
+	material = instance.material;
+	tint = unpackUnorm4x8(instance.tint);
+	fetchTransform(transform, model, normalMatrix);
+	if (draw.generator != 0) {
+		vec3 offset;
+		float yaw, scale;
+		generateInstance(b_generators[draw.generator - 1], uint(instanceId), offset, yaw, scale);
+		mat3 rotation = mat3(cos(yaw), 0.0, -sin(yaw), 0.0, 1.0, 0.0, sin(yaw), 0.0, cos(yaw));
+		mat4 local = mat4(rotation * scale);
+		local[3] = vec4(offset, 1.0);
+		model = model * local;
+		// Uniform scale drops out when the shader renormalizes
+		normalMatrix = normalMatrix * rotation;
+	}
+}
+
+// Draw parameters only exist in vertex shaders, others define TRANSFORM_NO_DRAW_PARAMETERS.
+// TRANSFORM_CULLED draws are issued by scene_render_culled and take their instance from the cull output,
+// TRANSFORM_SORTED ones by transparent_render from the sorted ids
+#ifndef TRANSFORM_NO_DRAW_PARAMETERS
+#ifdef TRANSFORM_CULLED
+#include "cull.glsl"
+#elif defined(TRANSFORM_SORTED)
+// Instance within its command of every sorted draw instance, TransparentQueue.instances in transparent.h
+layout (std430, binding = 16) readonly buffer SortedInstances {
+	uint b_sortedInstances[];
+};
+#endif
+void fetchInstance(out int transform, out uint material, out vec4 tint, out mat4 model, out mat3 normalMatrix) {
+#ifdef TRANSFORM_CULLED
+	int instance = int(b_cullInstances[u_cullRegion * u_cullSlotCount + gl_BaseInstance + gl_InstanceID]);
+#elif defined(TRANSFORM_SORTED)
+	int instance = int(b_sortedInstances[gl_BaseInstance + gl_InstanceID]);
+#else
+	int instance = gl_InstanceID;
+#endif
+	fetchInstanceAt(b_draws[gl_DrawID], instance, transform, material, tint, model, normalMatrix);
+}
+#endif
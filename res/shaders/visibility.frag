@@ -0,0 +1,9 @@
+#version 460 core
+
+flat in uint vs_visibility;
+
+layout (location = 0) out uint o_visibility;
+
+void main() {
+	o_visibility = vs_visibility | uint(gl_PrimitiveID);
+}
@@ -0,0 +1,29 @@
+#version 460 core
+#extension GL_ARB_bindless_texture : require
+
+layout (location = 0) in vec3 i_position;
+
+// Instance part of the visibility ID, visibility.frag adds the triangle
+flat out uint vs_visibility;
+
+#include "transform.glsl"
+
+// Masked geometry is drawn again under GL_EQUAL over the depth mask.vert laid
+invariant gl_Position;
+
+layout (std140, binding = 1) uniform Camera {
+	mat4 u_projection;
+	mat4 u_view;
+	vec3 u_position;
+};
+
+void main() {
+	int transform;
+	uint material;
+	vec4 tint;
+	mat4 model;
+	mat3 normalMatrix;
+	fetchInstance(transform, material, tint, model, normalMatrix);
+	vs_visibility = (b_draws[gl_DrawID].visibility + uint(gl_InstanceID)) << u_visibilityShift;
+	gl_Position = u_projection * u_view * model * vec4(i_position, 1.0);
+}
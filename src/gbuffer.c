@@ -0,0 +1,84 @@
+#include "gbuffer.h"
+
+#include <glad/glad.h>
+#include "log.h"
+
+static const GLenum targetFormats[_GBUFFER_TARGETS] = { GL_RGBA8, GL_RG16_SNORM, GL_RGBA8 };
+
+static void gbuffer_create_targets(GBuffer* g);
+static void gbuffer_delete_targets(GBuffer* g);
+
+void gbuffer_init(GBuffer* g, int width, int height) {
+	g->width = width;
+	g->height = height;
+	glCreateFramebuffers(1, &g->framebuffer);
+	glCreateFramebuffers(1, &g->visibility_framebuffer);
+	glCreateVertexArrays(1, &g->vertex_array);
+	gbuffer_create_targets(g);
+}
+
+void gbuffer_destroy(GBuffer* g) {
+	gbuffer_delete_targets(g);
+	glDeleteFramebuffers(1, &g->framebuffer);
+	glDeleteFramebuffers(1, &g->visibility_framebuffer);
+	glDeleteVertexArrays(1, &g->vertex_array);
+}
+
+void gbuffer_resize(GBuffer* g, int width, int height) {
+	if (width == g->width && height == g->height) return;
+	if (width <= 0 || height <= 0) return;
+	g->width = width;
+	g->height = height;
+	gbuffer_delete_targets(g);
+	gbuffer_create_targets(g);
+}
+
+void gbuffer_resolve(GBuffer* g) {
+	for (unsigned int i = 0; i < _GBUFFER_TARGETS; i++)
+		glBindTextureUnit(i, g->textures[i]);
+	glBindTextureUnit(_GBUFFER_TARGETS, g->depth);
+	glBindVertexArray(g->vertex_array);
+	glDrawArrays(GL_TRIANGLES, 0, 3);
+	glBindVertexArray(0);
+}
+
+void gbuffer_bind_visibility(GBuffer* g) {
+	glBindTextureUnit(0, g->visibility);
+	glBindTextureUnit(1, g->depth);
+}
+
+size_t gbuffer_size(const GBuffer* g) {
+	return (size_t)g->width * g->height * GBUFFER_PIXEL_BYTES;
+}
+
+static void gbuffer_create_targets(GBuffer* g) {
+	GLenum attachments[_GBUFFER_TARGETS];
+	glCreateTextures(GL_TEXTURE_2D, _GBUFFER_TARGETS, g->textures);
+	for (unsigned int i = 0; i < _GBUFFER_TARGETS; i++) {
+		glTextureStorage2D(g->textures[i], 1, targetFormats[i], g->width, g->height);
+		glNamedFramebufferTexture(g->framebuffer, GL_COLOR_ATTACHMENT0 + i, g->textures[i], 0);
+		attachments[i] = GL_COLOR_ATTACHMENT0 + i;
+	}
+	glNamedFramebufferDrawBuffers(g->framebuffer, _GBUFFER_TARGETS, attachments);
+
+	glCreateTextures(GL_TEXTURE_2D, 1, &g->depth);
+	glTextureStorage2D(g->depth, 1, GL_DEPTH_COMPONENT32F, g->width, g->height);
+	glNamedFramebufferTexture(g->framebuffer, GL_DEPTH_ATTACHMENT, g->depth, 0);
+
+	glCreateTextures(GL_TEXTURE_2D, 1, &g->visibility);
+	glTextureStorage2D(g->visibility, 1, GL_R32UI, g->width, g->height);
+	glNamedFramebufferTexture(g->visibility_framebuffer, GL_COLOR_ATTACHMENT0, g->visibility, 0);
+	glNamedFramebufferTexture(g->visibility_framebuffer, GL_DEPTH_ATTACHMENT, g->depth, 0);
+
+	if (glCheckNamedFramebufferStatus(g->framebuffer, GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+		plogf(LL_ERROR, "G-buffer framebuffer incomplete\n");
+	if (glCheckNamedFramebufferStatus(g->visibility_framebuffer, GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+		plogf(LL_ERROR, "Visibility framebuffer incomplete\n");
+	plogf(LL_INFO, "G-buffer %dx%d, %.2f MiB\n", g->width, g->height, gbuffer_size(g) / 1048576.0);
+}
+
+static void gbuffer_delete_targets(GBuffer* g) {
+	glDeleteTextures(_GBUFFER_TARGETS, g->textures);
+	glDeleteTextures(1, &g->depth);
+	glDeleteTextures(1, &g->visibility);
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <stddef.h>
+
+enum GBUFFER_TARGET {
+	GBUFFER_ALBEDO,
+	GBUFFER_NORMAL,
+	GBUFFER_SPECULAR,
+	_GBUFFER_TARGETS
+};
+
+// RGBA8 albedo, RG16_SNORM octahedral normal, RGBA8 specular and shininess, D32F depth
+#define GBUFFER_PIXEL_BYTES (4 + 4 + 4 + 4)
+
+typedef struct {
+	unsigned int framebuffer;
+	unsigned int textures[_GBUFFER_TARGETS];
+	unsigned int depth;
+	// R32UI visibility IDs sharing the depth target, see scene_resolve_visibility
+	unsigned int visibility_framebuffer;
+	unsigned int visibility;
+	// Attributeless, the lighting pass draws a fullscreen triangle
+	unsigned int vertex_array;
+	int width, height;
+} GBuffer;
+
+void gbuffer_init(GBuffer* g, int width, int height);
+void gbuffer_destroy(GBuffer* g);
+void gbuffer_resize(GBuffer* g, int width, int height);
+// Bind the targets and depth to texture units 0-3 and draw the lighting pass, the program must be bound
+void gbuffer_resolve(GBuffer* g);
+// Bind the visibility IDs and depth to texture units 0-1 for the visibility resolve
+void gbuffer_bind_visibility(GBuffer* g);
+size_t gbuffer_size(const GBuffer* g);
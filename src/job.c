@@ -0,0 +1,44 @@
+#include "job.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <unistd.h>
+
+typedef struct {
+	JobFunc fn;
+	void* ctx;
+	unsigned int count;
+	atomic_uint next;
+} JobBatch;
+
+static void* job_worker(void* arg) {
+	JobBatch* batch = arg;
+	unsigned int i;
+	while ((i = atomic_fetch_add(&batch->next, 1)) < batch->count)
+		batch->fn(batch->ctx, i);
+	return NULL;
+}
+
+unsigned int job_thread_count(void) {
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	if (n < 1) return 1;
+	return n > JOB_THREAD_MAX ? JOB_THREAD_MAX : (unsigned int)n;
+}
+
+// Run fn for every index in [0, count), the calling thread joins in and returns once all are done
+void job_parallel_for(unsigned int count, JobFunc fn, void* ctx) {
+	JobBatch batch = { .fn = fn, .ctx = ctx, .count = count };
+	atomic_init(&batch.next, 0);
+
+	unsigned int nThreads = job_thread_count();
+	if (nThreads > count) nThreads = count;
+	pthread_t threads[JOB_THREAD_MAX];
+	unsigned int nStarted = 0;
+	for (unsigned int i = 1; i < nThreads; i++) {
+		if (pthread_create(&threads[nStarted], NULL, job_worker, &batch)) break;
+		nStarted++;
+	}
+	job_worker(&batch);
+	for (unsigned int i = 0; i < nStarted; i++)
+		pthread_join(threads[i], NULL);
+}
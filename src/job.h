@@ -0,0 +1,8 @@
+#pragma once
+
+#define JOB_THREAD_MAX 32
+
+typedef void (*JobFunc)(void* ctx, unsigned int index);
+
+unsigned int job_thread_count(void);
+void job_parallel_for(unsigned int count, JobFunc fn, void* ctx);
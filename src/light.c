@@ -0,0 +1,108 @@
+#include "light.h"
+
+#include <float.h>
+#include <stdlib.h>
+#include <glad/glad.h>
+#include "scene.h"
+#include "log.h"
+
+static void light_grid_upload(LightGrid* grid);
+
+void light_grid_init(LightGrid* grid, float zNear, float zFar) {
+	grid->n_lights = 0;
+	grid->capacity = LIGHT_CAPACITY;
+	grid->lights = malloc(sizeof(Light) * grid->capacity);
+	grid->dirty = true;
+
+	float range = logf(zFar / zNear);
+	grid->params = (LightGridParams) {
+		.cluster_count = { CLUSTER_X, CLUSTER_Y, CLUSTER_Z },
+		.slice_scale = CLUSTER_Z / range,
+		.slice_bias = -CLUSTER_Z * logf(zNear) / range,
+		.z_near = zNear,
+		.z_far = zFar,
+	};
+	glCreateBuffers(1, &grid->params_buffer);
+	glNamedBufferData(grid->params_buffer, sizeof(LightGridParams), NULL, GL_DYNAMIC_DRAW);
+
+	grid->light_buffer = 0;
+	grid->light_gpu_capacity = 0;
+	glCreateBuffers(1, &grid->cluster_buffer);
+	glNamedBufferData(grid->cluster_buffer, sizeof(unsigned int) * CLUSTER_STRIDE * CLUSTER_X * CLUSTER_Y * CLUSTER_Z, NULL, GL_DYNAMIC_COPY);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, SSBO_CLUSTER, grid->cluster_buffer);
+}
+
+void light_grid_destroy(LightGrid* grid) {
+	free(grid->lights);
+	grid->lights = NULL;
+	glDeleteBuffers(1, &grid->params_buffer);
+	glDeleteBuffers(1, &grid->light_buffer);
+	glDeleteBuffers(1, &grid->cluster_buffer);
+}
+
+void light_grid_add(LightGrid* grid, const Light* light) {
+	if (grid->n_lights == grid->capacity) {
+		grid->capacity *= 2;
+		grid->lights = realloc(grid->lights, sizeof(Light) * grid->capacity);
+	}
+	Light* l = &grid->lights[grid->n_lights++];
+	*l = *light;
+	l->radius = light_radius(l);
+	grid->dirty = true;
+}
+
+void light_grid_truncate(LightGrid* grid, unsigned int count) {
+	if (count < grid->n_lights) grid->n_lights = count;
+	grid->dirty = true;
+}
+
+void light_grid_cull(LightGrid* grid, float width, float height) {
+	if (grid->dirty) light_grid_upload(grid);
+	grid->params.tile_size[0] = width / CLUSTER_X;
+	grid->params.tile_size[1] = height / CLUSTER_Y;
+	glNamedBufferSubData(grid->params_buffer, 0, sizeof(LightGridParams), &grid->params);
+	glDispatchCompute(CLUSTER_X, CLUSTER_Y, CLUSTER_Z);
+	glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+}
+
+// Distance at which the brightest channel falls below LIGHT_CUTOFF
+float light_radius(const Light* light) {
+	if (light->type == LIGHT_DIRECTIONAL) return FLT_MAX;
+	float c = light->positionConstant[3], l = light->directionLinear[3], q = light->ambientQuadratic[3];
+	float intensity = 0.0f;
+	for (unsigned int i = 0; i < 3; i++)
+		intensity = fmaxf(intensity, fmaxf(light->diffuseCutOff[i], light->ambientQuadratic[i]));
+	float k = c - intensity / LIGHT_CUTOFF;
+	if (k >= 0.0f) return 0.0f;
+	if (q > 0.0f) return (-l + sqrtf(l * l - 4.0f * q * k)) / (2.0f * q);
+	if (l > 0.0f) return -k / l;
+	return FLT_MAX;
+}
+
+// Directional lights go first so the fragment shader can loop over them without a cluster lookup
+static void light_grid_upload(LightGrid* grid) {
+	if (grid->light_gpu_capacity < grid->capacity) {
+		if (grid->light_buffer) glDeleteBuffers(1, &grid->light_buffer);
+		glCreateBuffers(1, &grid->light_buffer);
+		glNamedBufferData(grid->light_buffer, sizeof(Light) * grid->capacity, NULL, GL_DYNAMIC_DRAW);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, SSBO_LIGHT, grid->light_buffer);
+		grid->light_gpu_capacity = grid->capacity;
+	}
+	grid->params.n_lights = grid->n_lights;
+	grid->params.n_directional = 0;
+	grid->dirty = false;
+	if (!grid->n_lights) return;
+	Light* map = glMapNamedBufferRange(grid->light_buffer, 0, sizeof(Light) * grid->n_lights, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+	if (!map) {
+		plogf(LL_ERROR, "Mapping light buffer failed\n");
+		return;
+	}
+	unsigned int directional = 0;
+	for (unsigned int i = 0; i < grid->n_lights; i++)
+		if (grid->lights[i].type == LIGHT_DIRECTIONAL) directional++;
+	grid->params.n_directional = directional;
+	unsigned int next[2] = { 0, directional };
+	for (unsigned int i = 0; i < grid->n_lights; i++)
+		map[next[grid->lights[i].type != LIGHT_DIRECTIONAL]++] = grid->lights[i];
+	glUnmapNamedBuffer(grid->light_buffer);
+}
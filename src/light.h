@@ -1,8 +1,22 @@
 #pragma once
 
+#include <stdbool.h>
 #include <cglm/cglm.h>
 
 #define LIGHT_SIZE 96
+// Initial light pool, grows on demand
+#define LIGHT_CAPACITY 16
+
+// Froxel grid: screen tiles times exponential depth slices between the camera planes
+#define CLUSTER_X 16
+#define CLUSTER_Y 9
+#define CLUSTER_Z 24
+// Lights kept per cluster, the rest are dropped
+#define CLUSTER_LIGHT_MAX 255
+// Per cluster record in the cluster buffer: count then indices into the light buffer
+#define CLUSTER_STRIDE (CLUSTER_LIGHT_MAX + 1)
+// Attenuation at which a point or spot light is considered out of range
+#define LIGHT_CUTOFF (1.0f / 256.0f)
 
 enum LIGHT_TYPE {
 	LIGHT_DIRECTIONAL,
@@ -12,9 +26,45 @@ enum LIGHT_TYPE {
 
 typedef struct {
 	unsigned int type;
+	// Filled in by light_grid_add from the attenuation terms
+	float radius;
 	vec4 positionConstant;
 	vec4 directionLinear;
 	vec4 ambientQuadratic;
 	vec4 diffuseCutOff;
 	vec4 specularOuterCutOff;
-} Light;
\ No newline at end of file
+} Light;
+
+// Lights UBO in cluster.glsl
+typedef struct {
+	unsigned int cluster_count[3];
+	unsigned int n_lights;
+	float tile_size[2];
+	float slice_scale, slice_bias;
+	float z_near, z_far;
+	unsigned int n_directional;
+	unsigned int pad;
+} LightGridParams;
+
+typedef struct {
+	unsigned int n_lights;
+	unsigned int capacity;
+	Light* lights;
+	bool dirty;
+
+	LightGridParams params;
+	unsigned int params_buffer;
+	// Directional lights first, then the point and spot lights binned by cluster.comp
+	unsigned int light_buffer;
+	unsigned int light_gpu_capacity;
+	unsigned int cluster_buffer;
+} LightGrid;
+
+void light_grid_init(LightGrid* grid, float zNear, float zFar);
+void light_grid_destroy(LightGrid* grid);
+void light_grid_add(LightGrid* grid, const Light* light);
+// Drop every light after the first count
+void light_grid_truncate(LightGrid* grid, unsigned int count);
+// Upload pending lights and bin them, the cluster program must be bound
+void light_grid_cull(LightGrid* grid, float width, float height);
+float light_radius(const Light* light);
@@ -33,6 +33,13 @@ int plogf(enum LOG_LEVEL level, const char* format, ...) {
 	return res;
 }
 
+// Monotonic seconds for timing log output
+double plog_time(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
 static const char* source_str(unsigned int source) {
 	switch (source) {
 		case GL_DEBUG_SOURCE_API: return "API";
@@ -10,4 +10,5 @@ enum LOG_LEVEL {
 };
 
 int plogf(enum LOG_LEVEL level, const char* format, ...);
+double plog_time(void);
 void gl_log(unsigned int source, unsigned int type, unsigned int id, unsigned int severity, int length, char const* message, void const* userParam);
\ No newline at end of file
@@ -6,6 +6,11 @@
 #include "light.h"
 #include "texture.h"
 #include "stb_image.h"
+#include "profile.h"
+#include "gbuffer.h"
+#include "shadow.h"
+#include "transparent.h"
+#include <string.h>
 
 #define WINDOW_WIDTH 800
 #define WINDOW_HEIGHT 600
@@ -18,23 +23,82 @@
 #define MOVEMENT_SPEED 5.0f
 #define ROTATION_SPEED 0.1f
 
-#define LIGHT_MAX 8
-
 #define N_SIDE 16
 
+#define N_STRESS 4
+
+#define N_ROCKS 1000000
+#define ROCK_RADIUS 150.0f
+
+// Seconds between overdraw measurements while the prepass is on, the overdraw follows the view
+#define OVERDRAW_INTERVAL 5.0
+
+#define FLYTHROUGH_DURATION 20.0
+#define FLYTHROUGH_FAR 60.0f
+#define FLYTHROUGH_NEAR 3.0f
+
+#define BENCH_INTERVAL 2.0
+#define BENCH_INSTANCES (1 << 20)
+#define CHURN_LIVE 50000
+#define CHURN_RATE 10000
+// Translucent cubes sorted every frame by bench_transparent
+#define BENCH_TRANSPARENT_INSTANCES 100000
+// Point lights scattered over the floor for each step of bench_lights
+#define BENCH_LIGHT_COUNTS { 8, 256, 4096 }
+
 enum UBO_BINDING {
 	UBO_GLOBAL,
 	UBO_CAMERA,
-	UBO_MATERIAL,
 	UBO_LIGHT,
+	// UBO_CULL follows, bound per pass by the scene's users
+	UBO_SHADOW,
 };
 
 enum SHADER_TYPE {
 	SHADER_DEFAULT,
 	SHADER_SKYBOX,
+	SHADER_DEPTH,
+	SHADER_PULL,
+	SHADER_CLUSTER,
+	SHADER_GBUFFER,
+	SHADER_GBUFFER_PULL,
+	SHADER_DEFERRED,
+	SHADER_VISIBILITY,
+	SHADER_RESOLVE,
+	SHADER_CULL,
+	SHADER_SHADOW,
+	SHADER_SHADOW_MASK,
+	SHADER_ORDERED,
+	SHADER_CULL_ORDER,
+	SHADER_MASK,
+	SHADER_DISCARD,
+	SHADER_TRANSPARENT,
 	_SHADER_MAX
 };
 
+enum SHADING_MODE {
+	SHADING_FORWARD,
+	SHADING_DEFERRED,
+	SHADING_VISIBILITY,
+	_SHADING_MAX
+};
+
+enum BENCH_MODE {
+	BENCH_NONE,
+	BENCH_DEPTH,
+	BENCH_PULL,
+	BENCH_TRANSFORMS,
+	BENCH_CHURN,
+	BENCH_LIGHTS,
+	BENCH_DEFERRED,
+	BENCH_VISIBILITY,
+	BENCH_PREPASS,
+	BENCH_SHADOWS,
+	BENCH_ORDER,
+	BENCH_MASK,
+	BENCH_TRANSPARENT,
+};
+
 typedef struct {
 	Window window;
 	Camera camera;
@@ -44,7 +108,7 @@ typedef struct {
 	
 	unsigned int global_buffer;
 	unsigned int camera_buffer;
-	unsigned int light_buffer;
+	LightGrid lights;
 	
 	struct {
 		unsigned int texture;
@@ -55,15 +119,78 @@ typedef struct {
 	} skybox;
 
 	Scene scene;
+	GBuffer gbuffer;
+	ShadowMap shadows;
+	// Translucent instances, sorted back to front every frame and blended after the skybox
+	TransparentQueue transparent;
+	// Cycled with G
+	enum SHADING_MODE shading;
+
+	bool flythrough;
+	double flythrough_time;
+	bool stress;
+	bool rocks;
+	bool static_batch;
+	// Depth prepass before forward shading, toggled with P. Overdraw is measured on first use, again
+	// after every cache rebuild and every OVERDRAW_INTERVAL
+	bool prepass;
+	unsigned int overdraw_revision;
+	double overdraw_time;
+	// Forward pass culled to the view and drawn nearest depth bucket first, toggled with O
+	bool front_to_back;
+	CullOutput view_cull;
+	unsigned int view_buffer;
+
+	// Times the same draws through two paths, see bench_paths
+	enum BENCH_MODE bench;
+	double bench_time;
+	GpuTimer bench_timers[4];
+	double bench_cpu[2];
+	unsigned int bench_frames;
+	InstanceSet* churn_set;
+	InstanceHandle* churn_handles;
+	unsigned int bench_step;
+	// Unordered output beside view_cull so neither is resized every frame
+	CullOutput bench_cull;
 } Application;
 
 void on_setup(Application* app);
 void on_event(Application* app, Event* e);
 void on_update(Application* app, double frameTime);
+void on_render(Application* app, double frameTime);
+void update_global(Application* app);
 void on_teardown(Application* app);
+void update_flythrough(Application* app, double frameTime);
 
 int main(const int argc, const char* argv[]) {
 	Application app = { 0 };
+	for (int i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "--flythrough")) app.flythrough = true;
+		else if (!strcmp(argv[i], "--stress")) app.stress = true;
+		else if (!strcmp(argv[i], "--rocks")) app.rocks = true;
+		else if (!strcmp(argv[i], "--static")) app.scene.static_flatten = true;
+		else if (!strcmp(argv[i], "--static-batch")) app.static_batch = app.scene.static_batch = app.scene.static_flatten = true;
+		else if (!strcmp(argv[i], "--assimp-tangents")) app.scene.assimp_tangents = true;
+		else if (!strcmp(argv[i], "--vertex-pulling")) app.scene.vertex_pulling = true;
+		else if (!strcmp(argv[i], "--bench-depth")) app.bench = BENCH_DEPTH, app.stress = true;
+		else if (!strcmp(argv[i], "--bench-pull")) app.bench = BENCH_PULL, app.stress = true;
+		else if (!strcmp(argv[i], "--bench-transforms")) app.bench = BENCH_TRANSFORMS;
+		else if (!strcmp(argv[i], "--bench-churn")) app.bench = BENCH_CHURN;
+		else if (!strcmp(argv[i], "--bench-lights")) app.bench = BENCH_LIGHTS;
+		else if (!strcmp(argv[i], "--bench-deferred")) app.bench = BENCH_DEFERRED;
+		else if (!strcmp(argv[i], "--bench-visibility")) app.bench = BENCH_VISIBILITY, app.stress = true;
+		else if (!strcmp(argv[i], "--bench-prepass")) app.bench = BENCH_PREPASS, app.stress = true;
+		else if (!strcmp(argv[i], "--prepass")) app.prepass = true;
+		else if (!strcmp(argv[i], "--bench-shadows")) app.bench = BENCH_SHADOWS;
+		else if (!strcmp(argv[i], "--front-to-back")) app.front_to_back = true;
+		else if (!strcmp(argv[i], "--bench-order")) app.bench = BENCH_ORDER, app.stress = true;
+		else if (!strcmp(argv[i], "--bench-mask")) app.bench = BENCH_MASK, app.stress = true;
+		else if (!strcmp(argv[i], "--bench-transparent")) app.bench = BENCH_TRANSPARENT, app.flythrough = true;
+		else if (!strcmp(argv[i], "--deferred")) app.shading = SHADING_DEFERRED;
+		else if (!strcmp(argv[i], "--visibility")) app.shading = SHADING_VISIBILITY;
+		else if (!strcmp(argv[i], "--transforms-affine")) app.scene.transform_mode = TRANSFORM_AFFINE;
+		else if (!strcmp(argv[i], "--transforms-quat")) app.scene.transform_mode = TRANSFORM_QUAT;
+	}
 	if (!window_init(&app.window, WINDOW_WIDTH, WINDOW_HEIGHT, WINDOW_TITLE)) {
 		plogf(LL_ERROR, "Failed to initialize window\n");
 		return 1;
@@ -86,13 +213,7 @@ int main(const int argc, const char* argv[]) {
 		on_update(&app, frameTime);
 		
 		// Render
-		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-		glUseProgram(app.shaders[SHADER_DEFAULT]);
-		scene_render(&app.scene);
-		glUseProgram(app.shaders[SHADER_SKYBOX]);
-		glBindVertexArray(app.skybox.vertex_array);
-		glDrawElements(GL_TRIANGLES, 36, GL_UNSIGNED_INT, 0);
-		glBindVertexArray(0);
+		on_render(&app, frameTime);
 
 		glfwSwapBuffers(app.window.window);
 		glfwPollEvents();
@@ -106,6 +227,12 @@ int main(const int argc, const char* argv[]) {
 
 void on_setup(Application* app) {
 	void load_skybox(Application* app);
+	void load_stress(Application* app);
+	void load_rocks(Application* app);
+	void load_instances(Application* app, Part* part);
+	void load_churn(Application* app, Part* part);
+	void load_transparent(Application* app, Part* part);
+	void scatter_lights(Application* app, unsigned int count);
 
 	// GL setup
 	glEnable(GL_DEPTH_TEST);
@@ -128,21 +255,114 @@ void on_setup(Application* app) {
 		(ShaderArgs) { GL_FRAGMENT_SHADER, "res/shaders/skybox.frag" }
 	);
 
+	create_shader(
+		&app->shaders[SHADER_DEPTH], 1,
+		(ShaderArgs) { GL_VERTEX_SHADER, "res/shaders/depth.vert" }
+	);
+
+	create_shader(
+		&app->shaders[SHADER_PULL], 2,
+		(ShaderArgs) { GL_VERTEX_SHADER, "res/shaders/pull.vert" },
+		(ShaderArgs) { GL_FRAGMENT_SHADER, "res/shaders/default.frag" }
+	);
+
+	create_shader(
+		&app->shaders[SHADER_CLUSTER], 1,
+		(ShaderArgs) { GL_COMPUTE_SHADER, "res/shaders/cluster.comp" }
+	);
+
+	create_shader(
+		&app->shaders[SHADER_GBUFFER], 2,
+		(ShaderArgs) { GL_VERTEX_SHADER, "res/shaders/default.vert" },
+		(ShaderArgs) { GL_FRAGMENT_SHADER, "res/shaders/gbuffer.frag" }
+	);
+
+	create_shader(
+		&app->shaders[SHADER_GBUFFER_PULL], 2,
+		(ShaderArgs) { GL_VERTEX_SHADER, "res/shaders/pull.vert" },
+		(ShaderArgs) { GL_FRAGMENT_SHADER, "res/shaders/gbuffer.frag" }
+	);
+
+	create_shader(
+		&app->shaders[SHADER_DEFERRED], 2,
+		(ShaderArgs) { GL_VERTEX_SHADER, "res/shaders/deferred.vert" },
+		(ShaderArgs) { GL_FRAGMENT_SHADER, "res/shaders/deferred.frag" }
+	);
+
+	create_shader(
+		&app->shaders[SHADER_VISIBILITY], 2,
+		(ShaderArgs) { GL_VERTEX_SHADER, "res/shaders/visibility.vert" },
+		(ShaderArgs) { GL_FRAGMENT_SHADER, "res/shaders/visibility.frag" }
+	);
+
+	create_shader(
+		&app->shaders[SHADER_RESOLVE], 2,
+		(ShaderArgs) { GL_VERTEX_SHADER, "res/shaders/resolve.vert" },
+		(ShaderArgs) { GL_FRAGMENT_SHADER, "res/shaders/resolve.frag" }
+	);
+
+	create_shader(
+		&app->shaders[SHADER_CULL], 1,
+		(ShaderArgs) { GL_COMPUTE_SHADER, "res/shaders/cull.comp" }
+	);
+
+	create_shader(
+		&app->shaders[SHADER_SHADOW], 1,
+		(ShaderArgs) { GL_VERTEX_SHADER, "res/shaders/shadow.vert" }
+	);
+
+	create_shader(
+		&app->shaders[SHADER_SHADOW_MASK], 2,
+		(ShaderArgs) { GL_VERTEX_SHADER, "res/shaders/shadow.vert", "#define SHADOW_MASKED\n" },
+		(ShaderArgs) { GL_FRAGMENT_SHADER, "res/shaders/mask.frag" }
+	);
+
+	create_shader(
+		&app->shaders[SHADER_ORDERED], 2,
+		(ShaderArgs) { GL_VERTEX_SHADER, "res/shaders/default.vert", "#define TRANSFORM_CULLED\n" },
+		(ShaderArgs) { GL_FRAGMENT_SHADER, "res/shaders/default.frag" }
+	);
+
+	create_shader(
+		&app->shaders[SHADER_CULL_ORDER], 1,
+		(ShaderArgs) { GL_COMPUTE_SHADER, "res/shaders/cull_order.comp" }
+	);
+
+	create_shader(
+		&app->shaders[SHADER_MASK], 2,
+		(ShaderArgs) { GL_VERTEX_SHADER, "res/shaders/mask.vert" },
+		(ShaderArgs) { GL_FRAGMENT_SHADER, "res/shaders/mask.frag" }
+	);
+
+	create_shader(
+		&app->shaders[SHADER_DISCARD], 2,
+		(ShaderArgs) { GL_VERTEX_SHADER, "res/shaders/default.vert" },
+		(ShaderArgs) { GL_FRAGMENT_SHADER, "res/shaders/default.frag", "#define MATERIAL_DISCARD\n" }
+	);
+
+	create_shader(
+		&app->shaders[SHADER_TRANSPARENT], 2,
+		(ShaderArgs) { GL_VERTEX_SHADER, "res/shaders/default.vert", "#define TRANSFORM_SORTED\n" },
+		(ShaderArgs) { GL_FRAGMENT_SHADER, "res/shaders/default.frag", "#define MATERIAL_TRANSLUCENT\n" }
+	);
+
 	glCreateBuffers(1, &app->global_buffer);
-	glNamedBufferData(app->global_buffer, 16, NULL, GL_STATIC_DRAW);
+	glNamedBufferData(app->global_buffer, 32, NULL, GL_STATIC_DRAW);
 	glBindBufferBase(GL_UNIFORM_BUFFER, UBO_GLOBAL, app->global_buffer);
 
 	glCreateBuffers(1, &app->camera_buffer);
 	glNamedBufferData(app->camera_buffer, 144, NULL, GL_DYNAMIC_DRAW);
 	glBindBufferBase(GL_UNIFORM_BUFFER, UBO_CAMERA, app->camera_buffer);
 	camera_init(&app->camera, app->window.width, app->window.height, CAMERA_FOV, CAMERA_NEAR, CAMERA_FAR);
+	gbuffer_init(&app->gbuffer, app->window.width, app->window.height);
 
-	glCreateBuffers(1, &app->light_buffer);
-	glNamedBufferData(app->light_buffer, 16 + LIGHT_SIZE * LIGHT_MAX, NULL, GL_STATIC_DRAW);
-	glBindBufferBase(GL_UNIFORM_BUFFER, UBO_LIGHT, app->light_buffer);
-
-	uint lightCount = 1;
-	glNamedBufferSubData(app->light_buffer, 0, sizeof(uint), &lightCount);
+	light_grid_init(&app->lights, CAMERA_NEAR, CAMERA_FAR);
+	glBindBufferBase(GL_UNIFORM_BUFFER, UBO_LIGHT, app->lights.params_buffer);
+	shadow_init(&app->shadows);
+	glBindBufferBase(GL_UNIFORM_BUFFER, UBO_SHADOW, app->shadows.params_buffer);
+	transparent_init(&app->transparent);
+	glCreateBuffers(1, &app->view_buffer);
+	glNamedBufferData(app->view_buffer, sizeof(CullView), NULL, GL_DYNAMIC_DRAW);
 
 	Light l = {
 		.type = LIGHT_DIRECTIONAL,
@@ -151,51 +371,26 @@ void on_setup(Application* app) {
 		.diffuseCutOff = { 0.8, 0.8, 0.8 },
 		.specularOuterCutOff = { 1.0, 1.0, 1.0 }
 	};
-
-	glNamedBufferSubData(app->light_buffer, 16, sizeof(uint), &l.type);
-	glNamedBufferSubData(app->light_buffer, 32, sizeof(vec4) * 5, &l.positionConstant);
+	light_grid_add(&app->lights, &l);
 	
 	scene_init(&app->scene);
-
-	app->scene.transform_handle = glGetTextureHandleARB(app->scene.transform_texture);
-	glMakeTextureHandleResidentARB(app->scene.transform_handle);
-	glNamedBufferSubData(app->global_buffer, 0, 8, &app->scene.transform_handle);
 	// Load cube model
 	mat4 modelMatrix; glm_mat4_identity(modelMatrix);
 	glm_translate(modelMatrix, (vec3){ 5, 0, 0 });
 	scene_load(&app->scene, "res/models/cube/cube.obj", 0, modelMatrix, false);
 	// Load floor material
-	Material* floorMat = &app->scene.materials[app->scene.n_materials++];
-	unsigned int floorDiffuse = 0;
-	load_texture_color(&floorDiffuse, (unsigned char[3]){ 85, 170, 255 });
-	floorMat->diffuse = scene_insert_texture(&app->scene, strhash("floorDiffuse"), floorDiffuse);
-
-	unsigned int floorSpecular = 0;
-	load_texture_color(&floorSpecular, (unsigned char[3]){ 64, 64, 64 });
-	floorMat->specular = scene_insert_texture(&app->scene, strhash("floorSpecular"), floorSpecular);
-
-	floorMat->shininess = 1.0f;
-	// Insert floor part into cube geometry (same mesh, different material)
+	Material floorMat = {
+		.diffuse = scene_load_texture_color(&app->scene, (unsigned char[3]){ 85, 170, 255 }),
+		.specular = scene_load_texture_color(&app->scene, (unsigned char[3]){ 64, 64, 64 }),
+		.shininess = 1.0f
+	};
+	// Floor reuses the cube part with a material override
 	Geometry* cubeGeometry = &app->scene.geometry[0];
 	Part* cubePart = &cubeGeometry->parts[0];
-	Part* floorPart = &cubeGeometry->parts[cubeGeometry->n_parts++];
-	floorPart->n_index = cubePart->n_index;
-	floorPart->base_index = cubePart->base_index;
-	floorPart->base_vertex = cubePart->base_vertex;
-	floorPart->material = 2;
-	
-	for (unsigned int i = 0; i < N_SIDE; i++) {
-		for (unsigned int j = 0; j < N_SIDE; j++) {
-			float x = (2.0f * i) - (N_SIDE);
-			float y = -2.0f;
-			float z = (2.0f * j) - (N_SIDE);
-			Node* iCubeNode = node_new(1, 0);
-			iCubeNode->geometry = &app->scene.geometry[0];
-			glm_translate_make(iCubeNode->transform, (vec3) { x, y, z });
-			node_parts(iCubeNode)[0] = floorPart;
-			app->scene.nodes[app->scene.n_nodes++] = iCubeNode;
-		}
-	}
+	InstanceSet* floorSet = scene_add_instances(&app->scene, cubeGeometry, cubePart, PATTERN_GRID, N_SIDE * N_SIDE);
+	floorSet->material = scene_insert_material(&app->scene, &floorMat);
+	glm_vec4_copy((vec4){ N_SIDE, 2.0f, 2.0f, 0.0f }, floorSet->params);
+	glm_translate_make(floorSet->transform, (vec3){ -N_SIDE, -2.0f, -N_SIDE });
 
 	glm_mat4_identity(modelMatrix);
 	glm_translate(modelMatrix, (vec3){ 0, 1, 0 });
@@ -204,9 +399,102 @@ void on_setup(Application* app) {
 	glm_translate(modelMatrix, (vec3){ 0, 0, 5 });
 	scene_load(&app->scene, "res/models/cube/cube.obj", 0, modelMatrix, false);
 
+	if (app->stress) load_stress(app);
+	// Everything loaded so far stays put, instance sets are left alone
+	if (app->static_batch) scene_batch_static(&app->scene);
+	if (app->rocks) load_rocks(app);
+	if (app->bench == BENCH_TRANSFORMS) load_instances(app, cubePart);
+	if (app->bench == BENCH_CHURN) load_churn(app, cubePart);
+	if (app->bench == BENCH_TRANSPARENT) load_transparent(app, cubePart);
+	if (app->bench == BENCH_LIGHTS) scatter_lights(app, ((unsigned int[])BENCH_LIGHT_COUNTS)[0]);
+
 	scene_build_cache(&app->scene);
+	update_global(app);
 
 	load_skybox(app);
+
+	if (app->bench)
+		for (unsigned int i = 0; i < 4; i++) gpu_timer_init(&app->bench_timers[i]);
+}
+
+// Rows of high poly models and cutout panels behind the floor, every copy after the first reuses the import
+void load_stress(Application* app) {
+	const char* models[] = {
+		"res/models/nanosuit/nanosuit.obj",
+		"res/models/cyborg/cyborg.obj",
+	};
+	const float scales[] = { 0.2f, 1.0f };
+	for (unsigned int m = 0; m < 2; m++) {
+		for (unsigned int i = 0; i < N_STRESS; i++) {
+			mat4 modelMatrix; glm_mat4_identity(modelMatrix);
+			glm_translate(modelMatrix, (vec3){ (3.0f * i) - 1.5f * N_STRESS, -1.0f, -N_SIDE - 3.0f * (m + 1) });
+			glm_scale_uni(modelMatrix, scales[m]);
+			scene_load(&app->scene, models[m], 1, modelMatrix, false);
+		}
+	}
+	// Cutout panels in front of the rows, the alpha tested material and the shadows it casts
+	for (unsigned int i = 0; i < N_STRESS; i++) {
+		mat4 modelMatrix;
+		glm_translate_make(modelMatrix, (vec3){ (3.0f * i) - 1.5f * N_STRESS, -1.0f, -N_SIDE - 1.5f });
+		glm_scale_uni(modelMatrix, 1.5f);
+		scene_load(&app->scene, "res/models/fence/fence.obj", 1, modelMatrix, false);
+	}
+}
+
+// Rock field scattered on the GPU around the scene, one instance set and no nodes
+void load_rocks(Application* app) {
+	Part* rock = scene_load_part(&app->scene, "res/models/rock/rock.obj", 2);
+	if (!rock) return;
+	InstanceSet* rocks = scene_add_instances(&app->scene, &app->scene.geometry[2], rock, PATTERN_SCATTER, N_ROCKS);
+	glm_vec4_copy((vec4){ ROCK_RADIUS, 0.05f, 0.3f, 1.0f }, rocks->params);
+	glm_translate_make(rocks->transform, (vec3){ 0.0f, -3.0f, 0.0f });
+}
+
+// Square field of BENCH_INSTANCES small rotated cubes under the floor, stored as explicit transforms
+void load_instances(Application* app, Part* part) {
+	unsigned int side = (unsigned int)sqrt(BENCH_INSTANCES);
+	InstanceSet* set = scene_add_instances(&app->scene, &app->scene.geometry[0], part, PATTERN_LIST, BENCH_INSTANCES);
+	for (unsigned int i = 0; i < BENCH_INSTANCES; i++) {
+		glm_translate_make(set->transforms[i], (vec3){ 0.25f * (i % side) - 0.125f * side, -4.0f, 0.25f * (i / side) - 0.125f * side });
+		glm_rotate_y(set->transforms[i], i * 0.1f, set->transforms[i]);
+		glm_scale_uni(set->transforms[i], 0.1f);
+	}
+}
+
+// Lattice of BENCH_TRANSPARENT_INSTANCES small half transparent cubes above the floor, the flythrough
+// circles it so the sort order changes a little every frame
+void load_transparent(Application* app, Part* part) {
+	Material glass = {
+		.diffuse = scene_load_texture_color(&app->scene, (unsigned char[3]){ 255, 160, 64 }),
+		.specular = scene_load_texture_color(&app->scene, (unsigned char[3]){ 128, 128, 128 }),
+		.shininess = 32.0f,
+		.transparency = 0.5f
+	};
+	unsigned int side = (unsigned int)ceil(cbrt(BENCH_TRANSPARENT_INSTANCES));
+	InstanceSet* set = scene_add_instances(&app->scene, &app->scene.geometry[0], part, PATTERN_LIST, BENCH_TRANSPARENT_INSTANCES);
+	set->material = scene_insert_material(&app->scene, &glass);
+	for (unsigned int i = 0; i < BENCH_TRANSPARENT_INSTANCES; i++) {
+		unsigned int x = i % side, y = i / side % side, z = i / (side * side);
+		glm_translate_make(set->transforms[i], (vec3){ 0.5f * x - 0.25f * side, 1.0f + 0.5f * y, 0.5f * z - 0.25f * side });
+		glm_scale_uni(set->transforms[i], 0.1f);
+	}
+}
+
+static void churn_transform(mat4 dest) {
+	glm_translate_make(dest, (vec3){ (rand() % 2000) * 0.02f - 20.0f, 4.0f + (rand() % 400) * 0.01f, (rand() % 2000) * 0.02f - 20.0f });
+	glm_scale_uni(dest, 0.05f);
+}
+
+// Cubes floating above the scene, bench_churn replaces CHURN_RATE of them every frame
+void load_churn(Application* app, Part* part) {
+	app->churn_set = scene_add_instances(&app->scene, &app->scene.geometry[0], part, PATTERN_LIST, 0);
+	scene_reserve_instances(&app->scene, app->churn_set, CHURN_LIVE);
+	app->churn_handles = malloc(sizeof(InstanceHandle) * CHURN_LIVE);
+	for (unsigned int i = 0; i < CHURN_LIVE; i++) {
+		mat4 transform;
+		churn_transform(transform);
+		app->churn_handles[i] = scene_instance_add(&app->scene, app->churn_set, transform);
+	}
 }
 
 void load_skybox(Application* app) {
@@ -296,6 +584,8 @@ void load_skybox(Application* app) {
 	glVertexArrayElementBuffer(app->skybox.vertex_array, app->skybox.element_buffer);
 }
 
+static const char* shadingNames[] = { "forward", "deferred", "visibility buffer" };
+
 void on_event(Application* app, Event* e) {
 	switch (e->type) {
 	case EVENT_RESIZE:
@@ -303,10 +593,23 @@ void on_event(Application* app, Event* e) {
 		app->camera.vp_width = e->resize.width;
 		app->camera.vp_height = e->resize.height;
 		app->camera.update_projection = true;
+		gbuffer_resize(&app->gbuffer, e->resize.width, e->resize.height);
 		break;
 	case EVENT_KEYBOARD:
 		if (e->keyboard.key == GLFW_KEY_ESCAPE && e->keyboard.action)
 			glfwSetWindowShouldClose(app->window.window, true);
+		if (e->keyboard.key == GLFW_KEY_G && e->keyboard.action == GLFW_PRESS) {
+			app->shading = (app->shading + 1) % _SHADING_MAX;
+			plogf(LL_INFO, "Shading: %s\n", shadingNames[app->shading]);
+		}
+		if (e->keyboard.key == GLFW_KEY_P && e->keyboard.action == GLFW_PRESS) {
+			app->prepass = !app->prepass;
+			plogf(LL_INFO, "Depth prepass: %s\n", app->prepass ? "on" : "off");
+		}
+		if (e->keyboard.key == GLFW_KEY_O && e->keyboard.action == GLFW_PRESS) {
+			app->front_to_back = !app->front_to_back;
+			plogf(LL_INFO, "Front to back: %s\n", app->front_to_back ? "on" : "off");
+		}
 		break;
 	case EVENT_MOUSE_MOVE:
 	{
@@ -324,6 +627,8 @@ void on_event(Application* app, Event* e) {
 }
 
 void on_update(Application* app, double frameTime) {
+	if (app->flythrough) update_flythrough(app, frameTime);
+
 	if (glfwGetKey(app->window.window, GLFW_KEY_W) == GLFW_PRESS) {
 		glm_vec3_muladds(app->camera.front, (float)frameTime * MOVEMENT_SPEED, app->camera.position);
 		app->camera.update_view = true;
@@ -374,12 +679,434 @@ void on_update(Application* app, double frameTime) {
 	}
 }
 
+void on_render(Application* app, double frameTime) {
+	void bench_paths(Application* app, double frameTime);
+	void bench_transforms(Application* app, double frameTime);
+	void bench_churn(Application* app, double frameTime);
+	void bench_lights(Application* app, double frameTime);
+	void bench_shading(Application* app, double frameTime);
+	void render_scene(Application* app, enum SHADING_MODE shading);
+	void bench_shadows(Application* app, double frameTime);
+	void bench_order(Application* app, double frameTime);
+	void bench_transparent(Application* app, double frameTime);
+
+	if (app->bench != BENCH_LIGHTS) {
+		glUseProgram(app->shaders[SHADER_CLUSTER]);
+		light_grid_cull(&app->lights, app->camera.vp_width, app->camera.vp_height);
+	}
+	// The sun set up in on_setup is the first light
+	if (app->lights.n_lights && app->lights.lights[0].type == LIGHT_DIRECTIONAL)
+		shadow_update(&app->shadows, &app->scene, &app->camera, app->lights.lights[0].directionLinear,
+			app->shaders[SHADER_CULL], app->shaders[SHADER_SHADOW], app->shaders[SHADER_SHADOW_MASK]);
+	if (app->bench == BENCH_SHADOWS) bench_shadows(app, frameTime);
+	if (app->bench == BENCH_ORDER) bench_order(app, frameTime);
+	if (app->bench == BENCH_LIGHTS) bench_lights(app, frameTime);
+	else if (app->bench == BENCH_DEFERRED || app->bench == BENCH_VISIBILITY) bench_shading(app, frameTime);
+	else if (app->bench == BENCH_CHURN) bench_churn(app, frameTime);
+	else if (app->bench == BENCH_TRANSFORMS) bench_transforms(app, frameTime);
+	else if (app->bench == BENCH_TRANSPARENT) bench_transparent(app, frameTime);
+	else if (app->bench && app->bench != BENCH_SHADOWS && app->bench != BENCH_ORDER) bench_paths(app, frameTime);
+	if (scene_flush_instances(&app->scene)) update_global(app);
+	transparent_sort(&app->transparent, &app->scene, &app->camera);
+
+	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+	render_scene(app, app->shading);
+	glUseProgram(app->shaders[SHADER_SKYBOX]);
+	glBindVertexArray(app->skybox.vertex_array);
+	glDrawElements(GL_TRIANGLES, 36, GL_UNSIGNED_INT, 0);
+	glUseProgram(app->shaders[SHADER_TRANSPARENT]);
+	if (app->bench == BENCH_TRANSPARENT) gpu_timer_begin(&app->bench_timers[0]);
+	transparent_render(&app->transparent);
+	if (app->bench == BENCH_TRANSPARENT) gpu_timer_end(&app->bench_timers[0]);
+	glBindVertexArray(0);
+	scene_stream_textures(&app->scene);
+}
+
+// Scene into the default framebuffer, opaque geometry then alpha masked. Forward can lay depth first for
+// the geometry with enough overdraw so each pixel is shaded once, or cull to the view and draw near
+// instances first so early-Z rejects most of what they hide without a second pass. Deferred fills the G-buffer through the same MDI path,
+// then lights each pixel once and writes its depth back for the skybox. The visibility buffer only
+// stores instance and triangle IDs, the resolve refetches the triangle and shades it per pixel
+void render_scene(Application* app, enum SHADING_MODE shading) {
+	void cull_view(Application* app, CullOutput* output, unsigned int buckets);
+	void render_masked(Application* app, unsigned int program, bool depthOnly);
+
+	bool pulling = app->scene.vertex_pulling;
+	// The resolve needs 12 fragment storage blocks and IDs that fit in 32 bits
+	if (shading == SHADING_VISIBILITY && (!app->scene.visibility_shift || !app->shaders[SHADER_RESOLVE])) shading = SHADING_FORWARD;
+	if (shading == SHADING_FORWARD) {
+		if (app->front_to_back && !pulling) {
+			cull_view(app, &app->view_cull, CULL_BUCKETS);
+			glUseProgram(app->shaders[SHADER_ORDERED]);
+			scene_render_culled(&app->scene, &app->view_cull, 0, QUEUE_OPAQUE, COMMANDS_ALL, false);
+			render_masked(app, app->shaders[SHADER_DEFAULT], false);
+			return;
+		}
+		if (app->prepass) {
+			glUseProgram(app->shaders[SHADER_DEPTH]);
+			// Results of an earlier measurement arrive a frame or more later. Benchmarks keep the first
+			// measurement, the extra passes inside their timers would skew them
+			scene_poll_overdraw(&app->scene);
+			bool rebuilt = app->overdraw_revision != app->scene.static_revision;
+			if ((rebuilt || (!app->bench && glfwGetTime() - app->overdraw_time > OVERDRAW_INTERVAL)) && scene_measure_overdraw(&app->scene)) {
+				app->overdraw_revision = app->scene.static_revision;
+				app->overdraw_time = glfwGetTime();
+			}
+			scene_render_prepass(&app->scene);
+		}
+		glUseProgram(app->shaders[pulling ? SHADER_PULL : SHADER_DEFAULT]);
+		scene_render(&app->scene);
+		render_masked(app, app->shaders[pulling ? SHADER_PULL : SHADER_DEFAULT], false);
+		return;
+	}
+	if (shading == SHADING_VISIBILITY) {
+		glBindFramebuffer(GL_FRAMEBUFFER, app->gbuffer.visibility_framebuffer);
+		glClear(GL_DEPTH_BUFFER_BIT);
+		glUseProgram(app->shaders[SHADER_VISIBILITY]);
+		scene_render_depth(&app->scene);
+		render_masked(app, app->shaders[SHADER_VISIBILITY], true);
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+		glUseProgram(app->shaders[SHADER_RESOLVE]);
+		gbuffer_bind_visibility(&app->gbuffer);
+		scene_resolve_visibility(&app->scene);
+		return;
+	}
+	glBindFramebuffer(GL_FRAMEBUFFER, app->gbuffer.framebuffer);
+	glClear(GL_DEPTH_BUFFER_BIT);
+	glUseProgram(app->shaders[pulling ? SHADER_GBUFFER_PULL : SHADER_GBUFFER]);
+	scene_render(&app->scene);
+	render_masked(app, app->shaders[pulling ? SHADER_GBUFFER_PULL : SHADER_GBUFFER], false);
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	glUseProgram(app->shaders[SHADER_DEFERRED]);
+	gbuffer_resolve(&app->gbuffer);
+}
+
+// Draw the scene through two paths each frame and log their GPU times every BENCH_INTERVAL.
+// BENCH_DEPTH: depth only through the position arrays vs the full arrays
+// BENCH_PULL: the default pass through vertex attributes vs vertex pulling
+// BENCH_PREPASS: forward shading without vs with the depth prepass
+// BENCH_MASK: alpha testing in the shading program of every draw vs a mask prepass for masked geometry only
+void bench_paths(Application* app, double frameTime) {
+	const char* names[2] = { "position stream", "full vertex" };
+	if (app->bench == BENCH_PULL) names[0] = "vertex attributes", names[1] = "vertex pulling";
+	if (app->bench == BENCH_PREPASS) names[0] = "forward", names[1] = "prepass + forward";
+	if (app->bench == BENCH_MASK) names[0] = "discard everywhere", names[1] = "mask prepass";
+	bool pulling = app->scene.vertex_pulling;
+	bool prepass = app->prepass;
+	if (app->bench == BENCH_DEPTH) glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+	for (unsigned int i = 0; i < 2; i++) {
+		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+		gpu_timer_begin(&app->bench_timers[i]);
+		if (app->bench == BENCH_DEPTH) {
+			glUseProgram(app->shaders[SHADER_DEPTH]);
+			if (i == 0) scene_render_depth(&app->scene);
+			else scene_render(&app->scene);
+		} else if (app->bench == BENCH_PREPASS) {
+			app->prepass = i == 1;
+			render_scene(app, SHADING_FORWARD);
+		} else if (app->bench == BENCH_MASK) {
+			app->prepass = false;
+			if (i == 1) render_scene(app, SHADING_FORWARD);
+			else {
+				glUseProgram(app->shaders[SHADER_DISCARD]);
+				scene_render(&app->scene);
+				scene_render_masks(&app->scene);
+			}
+		} else {
+			glUseProgram(app->shaders[i == 0 ? SHADER_DEFAULT : SHADER_PULL]);
+			app->scene.vertex_pulling = i == 1;
+			scene_render(&app->scene);
+		}
+		gpu_timer_end(&app->bench_timers[i]);
+	}
+	app->scene.vertex_pulling = pulling;
+	app->prepass = prepass;
+	glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+
+	app->bench_time += frameTime;
+	if (app->bench_time >= BENCH_INTERVAL) {
+		app->bench_time = 0.0;
+		double a = gpu_timer_average(&app->bench_timers[0]);
+		double b = gpu_timer_average(&app->bench_timers[1]);
+		plogf(LL_INFO, "Bench: %.3f ms %s, %.3f ms %s (%.2fx)\n", a, names[0], b, names[1], a > 0.0 ? b / a : 0.0);
+	}
+}
+
+// Cycle the transform storage modes, logging the GPU time of the default pass in each
+void bench_transforms(Application* app, double frameTime) {
+	const char* names[] = { "texture mat4", "affine 3x4", "quaternion" };
+	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+	glUseProgram(app->shaders[SHADER_DEFAULT]);
+	gpu_timer_begin(&app->bench_timers[0]);
+	scene_render(&app->scene);
+	gpu_timer_end(&app->bench_timers[0]);
+
+	app->bench_time += frameTime;
+	if (app->bench_time >= BENCH_INTERVAL) {
+		app->bench_time = 0.0;
+		plogf(LL_INFO, "Bench: %.3f ms %s transforms, %u instances\n",
+			gpu_timer_average(&app->bench_timers[0]), names[app->scene.transform_mode], app->scene.n_transforms);
+		app->scene.transform_mode = (app->scene.transform_mode + 1) % 3;
+		scene_upload_transforms(&app->scene);
+		update_global(app);
+		// Drop samples still in flight from the previous mode
+		gpu_timer_destroy(&app->bench_timers[0]);
+		gpu_timer_init(&app->bench_timers[0]);
+	}
+}
+
+// Remove and add CHURN_RATE random instances, logging the CPU time of the edits and of the flush
+void bench_churn(Application* app, double frameTime) {
+	double start = plog_time();
+	for (unsigned int i = 0; i < CHURN_RATE; i++) {
+		unsigned int victim = rand() % CHURN_LIVE;
+		mat4 transform;
+		churn_transform(transform);
+		scene_instance_remove(&app->scene, app->churn_set, app->churn_handles[victim]);
+		app->churn_handles[victim] = scene_instance_add(&app->scene, app->churn_set, transform);
+	}
+	double edited = plog_time();
+	if (scene_flush_instances(&app->scene)) update_global(app);
+	app->bench_cpu[0] += edited - start;
+	app->bench_cpu[1] += plog_time() - edited;
+	app->bench_frames++;
+
+	app->bench_time += frameTime;
+	if (app->bench_time >= BENCH_INTERVAL) {
+		plogf(LL_INFO, "Bench: %u adds + %u removes per frame, %.3f ms edits, %.3f ms flush\n", CHURN_RATE, CHURN_RATE,
+			app->bench_cpu[0] * 1000.0 / app->bench_frames, app->bench_cpu[1] * 1000.0 / app->bench_frames);
+		app->bench_time = 0.0;
+		app->bench_cpu[0] = app->bench_cpu[1] = 0.0;
+		app->bench_frames = 0;
+	}
+}
+
+// Render forward then deferred or visibility shading each frame, logging both GPU times and the
+// attachment traffic each path has at one write per pixel (overdraw multiplies the first pass writes)
+void bench_shading(Application* app, double frameTime) {
+	enum SHADING_MODE modes[2] = { SHADING_FORWARD, app->bench == BENCH_VISIBILITY ? SHADING_VISIBILITY : SHADING_DEFERRED };
+	for (unsigned int i = 0; i < 2; i++) {
+		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+		gpu_timer_begin(&app->bench_timers[i]);
+		render_scene(app, modes[i]);
+		gpu_timer_end(&app->bench_timers[i]);
+	}
+
+	app->bench_time += frameTime;
+	if (app->bench_time >= BENCH_INTERVAL) {
+		app->bench_time = 0.0;
+		size_t pixels = (size_t)app->gbuffer.width * app->gbuffer.height;
+		// Color and depth for forward. Deferred writes and reads the G-buffer before the same color and depth,
+		// the visibility resolve reads the IDs and depth once per cache object
+		double traffic[2] = { pixels * 8 / 1048576.0 };
+		if (modes[1] == SHADING_DEFERRED) traffic[1] = (pixels * 8 + 2 * gbuffer_size(&app->gbuffer)) / 1048576.0;
+		else traffic[1] = pixels * (8 + 8 * app->scene.n_cache + 8) / 1048576.0;
+		plogf(LL_INFO, "Bench: %.3f ms forward (%.1f MiB), %.3f ms %s (%.1f MiB)\n",
+			gpu_timer_average(&app->bench_timers[0]), traffic[0],
+			gpu_timer_average(&app->bench_timers[1]), shadingNames[modes[1]], traffic[1]);
+	}
+}
+
+// Step through BENCH_LIGHT_COUNTS, logging the GPU time of the light binning and of the default pass
+void bench_lights(Application* app, double frameTime) {
+	void scatter_lights(Application* app, unsigned int count);
+	const unsigned int counts[] = BENCH_LIGHT_COUNTS;
+	const unsigned int nCounts = sizeof(counts) / sizeof(counts[0]);
+	glUseProgram(app->shaders[SHADER_CLUSTER]);
+	gpu_timer_begin(&app->bench_timers[0]);
+	light_grid_cull(&app->lights, app->camera.vp_width, app->camera.vp_height);
+	gpu_timer_end(&app->bench_timers[0]);
+	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+	glUseProgram(app->shaders[SHADER_DEFAULT]);
+	gpu_timer_begin(&app->bench_timers[1]);
+	scene_render(&app->scene);
+	gpu_timer_end(&app->bench_timers[1]);
+
+	app->bench_time += frameTime;
+	if (app->bench_time >= BENCH_INTERVAL) {
+		app->bench_time = 0.0;
+		plogf(LL_INFO, "Bench: %u lights, %.3f ms binning, %.3f ms shading\n", counts[app->bench_step],
+			gpu_timer_average(&app->bench_timers[0]), gpu_timer_average(&app->bench_timers[1]));
+		app->bench_step = (app->bench_step + 1) % nCounts;
+		scatter_lights(app, counts[app->bench_step]);
+		for (unsigned int i = 0; i < 2; i++) {
+			gpu_timer_destroy(&app->bench_timers[i]);
+			gpu_timer_init(&app->bench_timers[i]);
+		}
+	}
+}
+
+// Log the GPU time of each cascade per update and how often it was drawn, every other interval
+// redraws every cascade every frame to compare against the cached cascades
+void bench_shadows(Application* app, double frameTime) {
+	app->bench_time += frameTime;
+	if (app->bench_time < BENCH_INTERVAL) return;
+	app->bench_time = 0.0;
+	ShadowMap* s = &app->shadows;
+	double total = 0.0;
+	for (unsigned int i = 0; i < SHADOW_CASCADES; i++) {
+		double ms = gpu_timer_average(&s->timers[i]);
+		total += ms * s->updates[i];
+		plogf(LL_INFO, "Bench: cascade %u, %.3f ms per update, %.1f updates/s\n", i, ms, s->updates[i] / BENCH_INTERVAL);
+		s->updates[i] = 0;
+	}
+	plogf(LL_INFO, "Bench: shadows %s, %.3f ms/s\n", s->cache ? "cached" : "redrawn every frame", total / BENCH_INTERVAL);
+	s->cache = !s->cache;
+}
+
+// Masked geometry after the opaque pass: its alpha tested depth through mask.frag, then the pass's own
+// program over it under GL_EQUAL so shading never discards and keeps early-Z
+void render_masked(Application* app, unsigned int program, bool depthOnly) {
+	glUseProgram(app->shaders[SHADER_MASK]);
+	glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+	scene_render_masks(&app->scene);
+	glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+	glUseProgram(program);
+	scene_render_masked(&app->scene, depthOnly);
+}
+
+// Cull the scene to the camera into output, ordered by view depth over buckets when there is more than one
+void cull_view(Application* app, CullOutput* output, unsigned int buckets) {
+	Camera* camera = &app->camera;
+	cull_output_reserve(output, &app->scene, 1, buckets);
+	CullView view;
+	mat4 viewProjection;
+	glm_mat4_mul(camera->perspective, camera->view, viewProjection);
+	cull_view_init(&view, &app->scene, viewProjection, 0);
+	if (buckets > 1) cull_view_order(&view, camera->position, camera->front, camera->z_near, camera->z_far, buckets);
+	glNamedBufferSubData(app->view_buffer, 0, sizeof(CullView), &view);
+	glBindBufferBase(GL_UNIFORM_BUFFER, UBO_CULL, app->view_buffer);
+	glUseProgram(app->shaders[SHADER_CULL]);
+	scene_cull(&app->scene, output, 0, app->shaders[SHADER_CULL_ORDER]);
+}
+
+// Cull and draw the forward pass unordered then front to back each frame, timing the cull and the
+// draw of each. The ordering pays for itself when the draw it saves is more than the cull it adds
+void bench_order(Application* app, double frameTime) {
+	for (unsigned int i = 0; i < 2; i++) {
+		CullOutput* output = i == 0 ? &app->bench_cull : &app->view_cull;
+		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+		gpu_timer_begin(&app->bench_timers[i * 2]);
+		cull_view(app, output, i == 0 ? 1 : CULL_BUCKETS);
+		gpu_timer_end(&app->bench_timers[i * 2]);
+		gpu_timer_begin(&app->bench_timers[i * 2 + 1]);
+		glUseProgram(app->shaders[SHADER_ORDERED]);
+		scene_render_culled(&app->scene, output, 0, QUEUE_OPAQUE, COMMANDS_ALL, false);
+		gpu_timer_end(&app->bench_timers[i * 2 + 1]);
+	}
+
+	app->bench_time += frameTime;
+	if (app->bench_time >= BENCH_INTERVAL) {
+		app->bench_time = 0.0;
+		double ms[4];
+		for (unsigned int i = 0; i < 4; i++) ms[i] = gpu_timer_average(&app->bench_timers[i]);
+		plogf(LL_INFO, "Bench: unordered %.3f ms cull + %.3f ms draw, %u buckets %.3f ms cull + %.3f ms draw\n",
+			ms[0], ms[1], CULL_BUCKETS, ms[2], ms[3]);
+		plogf(LL_INFO, "Bench: ordering costs %.3f ms, saves %.3f ms of drawing\n", ms[2] - ms[0], ms[1] - ms[3]);
+	}
+}
+
+// Log the CPU time of transparent_sort per frame, how many sorts kept last frame's order and the GPU time
+// of the blended draws. The draws themselves are timed around transparent_render in on_render
+void bench_transparent(Application* app, double frameTime) {
+	TransparentQueue* q = &app->transparent;
+	app->bench_time += frameTime;
+	app->bench_frames++;
+	if (app->bench_time < BENCH_INTERVAL) return;
+	plogf(LL_INFO, "Bench: %u transparent instances, %.3f ms sort, %u coherent / %u full sorts, %.3f ms draw\n",
+		q->n_entries, q->sort_time * 1000.0 / app->bench_frames, q->coherent_sorts, q->full_sorts,
+		gpu_timer_average(&app->bench_timers[0]));
+	app->bench_time = 0.0;
+	app->bench_frames = 0;
+	q->sort_time = 0.0;
+	q->coherent_sorts = q->full_sorts = 0;
+}
+
+// Replace every light after the sun with count small point lights above the floor
+void scatter_lights(Application* app, unsigned int count) {
+	light_grid_truncate(&app->lights, 1);
+	for (unsigned int i = 0; i < count; i++) {
+		vec3 color = { (rand() % 100) * 0.003f, (rand() % 100) * 0.003f, (rand() % 100) * 0.003f };
+		Light l = {
+			.type = LIGHT_POINT,
+			.positionConstant = { (rand() % 1000) * 0.004f * N_SIDE - 2.0f * N_SIDE, -1.0f + (rand() % 100) * 0.04f, (rand() % 1000) * 0.004f * N_SIDE - 2.0f * N_SIDE, 1.0f },
+			.directionLinear = { 0.0f, 0.0f, 0.0f, 0.5f },
+			.ambientQuadratic = { 0.0f, 0.0f, 0.0f, 5.0f },
+			.diffuseCutOff = { color[0], color[1], color[2] },
+			.specularOuterCutOff = { color[0], color[1], color[2] }
+		};
+		light_grid_add(&app->lights, &l);
+	}
+}
+
+// Transform storage may be reallocated on upload, the texture path gets a new handle
+void update_global(Application* app) {
+	unsigned int mode = app->scene.transform_mode;
+	glNamedBufferSubData(app->global_buffer, 0, 8, &app->scene.transform_handle);
+	glNamedBufferSubData(app->global_buffer, 16, sizeof(unsigned int), &mode);
+	glNamedBufferSubData(app->global_buffer, 20, sizeof(unsigned int), &app->scene.visibility_shift);
+}
+
+// Scripted camera path spiralling in towards the origin, logs resident texture memory once per second
+void update_flythrough(Application* app, double frameTime) {
+	double previous = app->flythrough_time;
+	app->flythrough_time += frameTime;
+	float t = fmin(app->flythrough_time / FLYTHROUGH_DURATION, 1.0);
+	float distance = FLYTHROUGH_FAR + (FLYTHROUGH_NEAR - FLYTHROUGH_FAR) * t;
+	float angle = t * 2.0f * M_PI;
+
+	glm_vec3_copy((vec3){ sinf(angle) * distance, 1.0f + 0.1f * distance, cosf(angle) * distance }, app->camera.position);
+	vec3 direction;
+	glm_vec3_negate_to(app->camera.position, direction);
+	glm_vec3_normalize(direction);
+	versor yaw, pitch;
+	glm_quatv(yaw, atan2f(-direction[0], -direction[2]), (vec3){ 0, 1, 0 });
+	glm_quatv(pitch, asinf(direction[1]), (vec3){ 1, 0, 0 });
+	glm_quat_mul(yaw, pitch, app->camera.rotation);
+	app->camera.update_view = true;
+
+	if (floor(app->flythrough_time) != floor(previous)) {
+		size_t resident, total;
+		scene_texture_memory(&app->scene, &resident, &total);
+		plogf(LL_INFO, "Flythrough %.0fs: %.2f / %.2f MiB texture memory resident\n",
+			floor(app->flythrough_time), resident / 1048576.0, total / 1048576.0);
+	}
+	if (app->flythrough_time >= FLYTHROUGH_DURATION)
+		glfwSetWindowShouldClose(app->window.window, true);
+}
+
 void on_teardown(Application* app) {
 	glDeleteProgram(app->shaders[SHADER_DEFAULT]);
 	glDeleteProgram(app->shaders[SHADER_SKYBOX]);
+	glDeleteProgram(app->shaders[SHADER_DEPTH]);
+	glDeleteProgram(app->shaders[SHADER_PULL]);
+	glDeleteProgram(app->shaders[SHADER_CLUSTER]);
+	glDeleteProgram(app->shaders[SHADER_GBUFFER]);
+	glDeleteProgram(app->shaders[SHADER_GBUFFER_PULL]);
+	glDeleteProgram(app->shaders[SHADER_DEFERRED]);
+	glDeleteProgram(app->shaders[SHADER_VISIBILITY]);
+	glDeleteProgram(app->shaders[SHADER_RESOLVE]);
+	glDeleteProgram(app->shaders[SHADER_CULL]);
+	glDeleteProgram(app->shaders[SHADER_SHADOW]);
+	glDeleteProgram(app->shaders[SHADER_SHADOW_MASK]);
+	glDeleteProgram(app->shaders[SHADER_ORDERED]);
+	glDeleteProgram(app->shaders[SHADER_CULL_ORDER]);
+	glDeleteProgram(app->shaders[SHADER_MASK]);
+	glDeleteProgram(app->shaders[SHADER_DISCARD]);
+	glDeleteProgram(app->shaders[SHADER_TRANSPARENT]);
+	if (app->bench)
+		for (unsigned int i = 0; i < 4; i++) gpu_timer_destroy(&app->bench_timers[i]);
+	free(app->churn_handles);
 	
 	glDeleteBuffers(1, &app->global_buffer);
 	glDeleteBuffers(1, &app->camera_buffer);
+	light_grid_destroy(&app->lights);
+	shadow_destroy(&app->shadows);
+	transparent_destroy(&app->transparent);
+	cull_output_destroy(&app->view_cull);
+	cull_output_destroy(&app->bench_cull);
+	glDeleteBuffers(1, &app->view_buffer);
+	gbuffer_destroy(&app->gbuffer);
 
 	scene_destroy(&app->scene);
 }
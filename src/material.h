@@ -0,0 +1,20 @@
+#ifndef MATERIAL_LAYOUT_H
+#define MATERIAL_LAYOUT_H
+
+// GPU material record, included by scene.h and by the shaders so both sides expand the same field list.
+// F(C type, GLSL type, name), std430 and the C struct agree as long as every field is naturally aligned
+#define MATERIAL_FIELDS(F) \
+	F(uint64_t, uint64_t, diffuse) \
+	F(uint64_t, uint64_t, specular) \
+	F(uint64_t, uint64_t, normal) \
+	F(uint64_t, uint64_t, mask) \
+	F(float, float, shininess) \
+	F(float, float, opacity)
+
+// Masked materials keep the fragments whose mask red channel reaches this
+#define MATERIAL_MASK_CUTOFF 0.5
+
+#define MATERIAL_FIELD_C(c, glsl, name) c name;
+#define MATERIAL_FIELD_GLSL(c, glsl, name) glsl name;
+
+#endif
@@ -0,0 +1,313 @@
+#include "mesh.h"
+
+#include <string.h>
+#include "job.h"
+#include "log.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define MIN(a, b) (((a) < (b)) ? (a) : (b))
+
+typedef struct {
+	const struct aiMesh* mesh;
+	vec4* tangents;
+	vec3* face_tangents;
+	vec3* face_bitangents;
+	// Vertex -> triangle corner (triangle * 3 + corner) adjacency in CSR form
+	unsigned int* offsets;
+	unsigned int* corners;
+} TangentMesh;
+
+typedef struct {
+	unsigned int mesh;
+	unsigned int first;
+	unsigned int count;
+} TangentChunk;
+
+typedef struct {
+	TangentMesh* meshes;
+	unsigned int n_meshes;
+	TangentChunk* chunks;
+} TangentBatch;
+
+static const struct aiVector3D zero = { 0 };
+static const vec4 defaultTangent = { 1.0f, 0.0f, 0.0f, 1.0f };
+
+// Hash of the source streams, conversion is deterministic so equal sources give equal ranges
+unsigned long long mesh_hash(const struct aiMesh* aiMsh, bool tangents, unsigned int* nIndex) {
+	size_t size = sizeof(struct aiVector3D) * aiMsh->mNumVertices;
+	unsigned long long hash = hash_bytes(aiMsh->mVertices, size, HASH_SEED);
+	if (aiMsh->mTextureCoords[0]) hash = hash_bytes(aiMsh->mTextureCoords[0], size, hash);
+	if (aiMsh->mNormals) hash = hash_bytes(aiMsh->mNormals, size, hash);
+	hash = hash_bytes(&tangents, sizeof(tangents), hash);
+	*nIndex = 0;
+	for (unsigned int i = 0; i < aiMsh->mNumFaces; i++) {
+		hash = hash_bytes(aiMsh->mFaces[i].mIndices, sizeof(unsigned int) * aiMsh->mFaces[i].mNumIndices, hash);
+		*nIndex += aiMsh->mFaces[i].mNumIndices;
+	}
+	return hash;
+}
+
+// Same streams as mesh_hash, a matching hash alone can be a collision
+bool mesh_equal(const struct aiMesh* a, const struct aiMesh* b) {
+	if (a->mNumVertices != b->mNumVertices || a->mNumFaces != b->mNumFaces) return false;
+	if (!a->mTextureCoords[0] != !b->mTextureCoords[0] || !a->mNormals != !b->mNormals) return false;
+	size_t size = sizeof(struct aiVector3D) * a->mNumVertices;
+	if (memcmp(a->mVertices, b->mVertices, size)) return false;
+	if (a->mTextureCoords[0] && memcmp(a->mTextureCoords[0], b->mTextureCoords[0], size)) return false;
+	if (a->mNormals && memcmp(a->mNormals, b->mNormals, size)) return false;
+	for (unsigned int i = 0; i < a->mNumFaces; i++) {
+		if (a->mFaces[i].mNumIndices != b->mFaces[i].mNumIndices) return false;
+		if (memcmp(a->mFaces[i].mIndices, b->mFaces[i].mIndices, sizeof(unsigned int) * a->mFaces[i].mNumIndices)) return false;
+	}
+	return true;
+}
+
+static void tangent_adjacency(void* ctx, unsigned int index) {
+	TangentMesh* m = &((TangentBatch*)ctx)->meshes[index];
+	const struct aiMesh* aiMsh = m->mesh;
+	memset(m->offsets, 0, sizeof(unsigned int) * (aiMsh->mNumVertices + 1));
+	for (unsigned int i = 0; i < aiMsh->mNumFaces; i++) {
+		if (aiMsh->mFaces[i].mNumIndices != 3) continue;
+		for (unsigned int j = 0; j < 3; j++)
+			m->offsets[aiMsh->mFaces[i].mIndices[j] + 1]++;
+	}
+	for (unsigned int i = 0; i < aiMsh->mNumVertices; i++)
+		m->offsets[i + 1] += m->offsets[i];
+	// Fill using offsets as cursors, then shift them back
+	for (unsigned int i = 0; i < aiMsh->mNumFaces; i++) {
+		if (aiMsh->mFaces[i].mNumIndices != 3) continue;
+		for (unsigned int j = 0; j < 3; j++)
+			m->corners[m->offsets[aiMsh->mFaces[i].mIndices[j]]++] = i * 3 + j;
+	}
+	for (unsigned int i = aiMsh->mNumVertices; i > 0; i--)
+		m->offsets[i] = m->offsets[i - 1];
+	m->offsets[0] = 0;
+}
+
+// Unnormalized uv gradient of each triangle
+static void tangent_faces(void* ctx, unsigned int index) {
+	TangentBatch* batch = ctx;
+	TangentChunk* chunk = &batch->chunks[index];
+	TangentMesh* m = &batch->meshes[chunk->mesh];
+	const struct aiMesh* aiMsh = m->mesh;
+	for (unsigned int i = chunk->first; i < chunk->first + chunk->count; i++) {
+		glm_vec3_zero(m->face_tangents[i]);
+		glm_vec3_zero(m->face_bitangents[i]);
+		if (aiMsh->mFaces[i].mNumIndices != 3) continue;
+		const unsigned int* idx = aiMsh->mFaces[i].mIndices;
+		const struct aiVector3D *p0 = &aiMsh->mVertices[idx[0]], *p1 = &aiMsh->mVertices[idx[1]], *p2 = &aiMsh->mVertices[idx[2]];
+		const struct aiVector3D *t0 = &aiMsh->mTextureCoords[0][idx[0]], *t1 = &aiMsh->mTextureCoords[0][idx[1]], *t2 = &aiMsh->mTextureCoords[0][idx[2]];
+		vec3 e1 = { p1->x - p0->x, p1->y - p0->y, p1->z - p0->z };
+		vec3 e2 = { p2->x - p0->x, p2->y - p0->y, p2->z - p0->z };
+		float du1 = t1->x - t0->x, dv1 = t1->y - t0->y;
+		float du2 = t2->x - t0->x, dv2 = t2->y - t0->y;
+		float det = du1 * dv2 - du2 * dv1;
+		if (fabsf(det) < 1e-12f) continue;
+		float r = 1.0f / det;
+		for (unsigned int j = 0; j < 3; j++) {
+			m->face_tangents[i][j] = (e1[j] * dv2 - e2[j] * dv1) * r;
+			m->face_bitangents[i][j] = (e2[j] * du1 - e1[j] * du2) * r;
+		}
+	}
+}
+
+// Project a face vector into the tangent plane of n and normalize, zero if degenerate
+static void tangent_project(const vec3 v, vec3 n, vec3 dest) {
+	glm_vec3_copy((float*)v, dest);
+	glm_vec3_muladds(n, -glm_vec3_dot(n, dest), dest);
+	float length = glm_vec3_norm(dest);
+	if (length > 1e-12f) glm_vec3_scale(dest, 1.0f / length, dest);
+	else glm_vec3_zero(dest);
+}
+
+// Per vertex, average the projected face frames weighted by the corner angle, orthonormalize against
+// the normal and keep the bitangent only as a handedness sign. Unlike MikkTSpace vertices are never split:
+// faces meeting at a shared vertex with opposite handedness (mirrored uvs) can't both be right, the side
+// with more corner angle wins and the other side is shaded with its tangent and sign
+static void tangent_vertices(void* ctx, unsigned int index) {
+	TangentBatch* batch = ctx;
+	TangentChunk* chunk = &batch->chunks[index];
+	TangentMesh* m = &batch->meshes[chunk->mesh];
+	const struct aiMesh* aiMsh = m->mesh;
+	for (unsigned int v = chunk->first; v < chunk->first + chunk->count; v++) {
+		vec3 n = { aiMsh->mNormals[v].x, aiMsh->mNormals[v].y, aiMsh->mNormals[v].z };
+		glm_vec3_normalize(n);
+		vec3 p = { aiMsh->mVertices[v].x, aiMsh->mVertices[v].y, aiMsh->mVertices[v].z };
+		// Accumulated per handedness, [0] right handed faces and [1] left handed ones
+		vec3 sides[2] = { { 0 }, { 0 } };
+		float weights[2] = { 0.0f, 0.0f };
+		for (unsigned int k = m->offsets[v]; k < m->offsets[v + 1]; k++) {
+			unsigned int face = m->corners[k] / 3, corner = m->corners[k] % 3;
+			const unsigned int* idx = aiMsh->mFaces[face].mIndices;
+			const struct aiVector3D* a = &aiMsh->mVertices[idx[(corner + 1) % 3]];
+			const struct aiVector3D* c = &aiMsh->mVertices[idx[(corner + 2) % 3]];
+			vec3 ea = { a->x - p[0], a->y - p[1], a->z - p[2] };
+			vec3 ec = { c->x - p[0], c->y - p[1], c->z - p[2] };
+			tangent_project(ea, n, ea);
+			tangent_project(ec, n, ec);
+			float angle = acosf(glm_clamp(glm_vec3_dot(ea, ec), -1.0f, 1.0f));
+
+			vec3 ft, fb, cross;
+			tangent_project(m->face_tangents[face], n, ft);
+			tangent_project(m->face_bitangents[face], n, fb);
+			// Faces without a uv gradient have no handedness to vote with
+			if (glm_vec3_norm2(ft) == 0.0f || glm_vec3_norm2(fb) == 0.0f) continue;
+			glm_vec3_cross(n, ft, cross);
+			unsigned int side = glm_vec3_dot(cross, fb) < 0.0f;
+			glm_vec3_muladds(ft, angle, sides[side]);
+			weights[side] += angle;
+		}
+		unsigned int side = weights[1] > weights[0];
+		vec3 t;
+		glm_vec3_copy(sides[side], t);
+		float length = glm_vec3_norm(t);
+		if (length > 1e-12f) {
+			glm_vec3_scale(t, 1.0f / length, t);
+		} else {
+			// No uv gradient, any vector perpendicular to the normal will do
+			glm_vec3_cross(n, fabsf(n[0]) < 0.9f ? (vec3){ 1, 0, 0 } : (vec3){ 0, 1, 0 }, t);
+			glm_vec3_normalize(t);
+		}
+		glm_vec4(t, side ? -1.0f : 1.0f, m->tangents[v]);
+	}
+}
+
+// Generate a tangent and handedness sign for every mesh with a non NULL output array,
+// parallel over meshes and chunks of triangles/vertices within each mesh
+void mesh_generate_tangents(const struct aiMesh* const* meshes, vec4* const* tangents, unsigned int count) {
+	TangentBatch batch = { .meshes = calloc(count, sizeof(TangentMesh)) };
+	if (!batch.meshes) return;
+
+	unsigned int nFaceChunks = 0, nVertexChunks = 0;
+	for (unsigned int i = 0; i < count; i++) {
+		const struct aiMesh* aiMsh = meshes[i];
+		if (!tangents[i]) continue;
+		if (!aiMsh->mNormals || !aiMsh->mTextureCoords[0]) {
+			for (unsigned int j = 0; j < aiMsh->mNumVertices; j++)
+				glm_vec4_copy((float*)defaultTangent, tangents[i][j]);
+			continue;
+		}
+		TangentMesh* m = &batch.meshes[batch.n_meshes];
+		m->mesh = aiMsh;
+		m->tangents = tangents[i];
+		m->face_tangents = malloc(sizeof(vec3) * aiMsh->mNumFaces);
+		m->face_bitangents = malloc(sizeof(vec3) * aiMsh->mNumFaces);
+		m->offsets = malloc(sizeof(unsigned int) * (aiMsh->mNumVertices + 1));
+		m->corners = malloc(sizeof(unsigned int) * 3 * aiMsh->mNumFaces);
+		if (!m->face_tangents || !m->face_bitangents || !m->offsets || !m->corners) {
+			plogf(LL_ERROR, "Tangent allocation failed\n");
+			free(m->face_tangents); free(m->face_bitangents); free(m->offsets); free(m->corners);
+			memset(m, 0, sizeof(TangentMesh));
+			for (unsigned int j = 0; j < aiMsh->mNumVertices; j++)
+				glm_vec4_copy((float*)defaultTangent, tangents[i][j]);
+			continue;
+		}
+		nFaceChunks += (aiMsh->mNumFaces + TANGENT_CHUNK - 1) / TANGENT_CHUNK;
+		nVertexChunks += (aiMsh->mNumVertices + TANGENT_CHUNK - 1) / TANGENT_CHUNK;
+		batch.n_meshes++;
+	}
+
+	batch.chunks = malloc(sizeof(TangentChunk) * (nFaceChunks > nVertexChunks ? nFaceChunks : nVertexChunks));
+	if (batch.chunks) {
+		job_parallel_for(batch.n_meshes, tangent_adjacency, &batch);
+
+		unsigned int n = 0;
+		for (unsigned int i = 0; i < batch.n_meshes; i++) {
+			for (unsigned int j = 0; j < batch.meshes[i].mesh->mNumFaces; j += TANGENT_CHUNK)
+				batch.chunks[n++] = (TangentChunk) { i, j, MIN(TANGENT_CHUNK, batch.meshes[i].mesh->mNumFaces - j) };
+		}
+		job_parallel_for(n, tangent_faces, &batch);
+
+		n = 0;
+		for (unsigned int i = 0; i < batch.n_meshes; i++) {
+			for (unsigned int j = 0; j < batch.meshes[i].mesh->mNumVertices; j += TANGENT_CHUNK)
+				batch.chunks[n++] = (TangentChunk) { i, j, MIN(TANGENT_CHUNK, batch.meshes[i].mesh->mNumVertices - j) };
+		}
+		job_parallel_for(n, tangent_vertices, &batch);
+	}
+
+	for (unsigned int i = 0; i < batch.n_meshes; i++) {
+		TangentMesh* m = &batch.meshes[i];
+		free(m->face_tangents);
+		free(m->face_bitangents);
+		free(m->offsets);
+		free(m->corners);
+	}
+	free(batch.chunks);
+	free(batch.meshes);
+}
+
+// Reference path for aiProcess_CalcTangentSpace imports
+void mesh_tangents_from_assimp(const struct aiMesh* aiMsh, vec4* tangents) {
+	for (unsigned int i = 0; i < aiMsh->mNumVertices; i++) {
+		if (!aiMsh->mTangents || !aiMsh->mBitangents || !aiMsh->mNormals) {
+			glm_vec4_copy((float*)defaultTangent, tangents[i]);
+			continue;
+		}
+		vec3 n = { aiMsh->mNormals[i].x, aiMsh->mNormals[i].y, aiMsh->mNormals[i].z };
+		vec3 t = { aiMsh->mTangents[i].x, aiMsh->mTangents[i].y, aiMsh->mTangents[i].z };
+		vec3 b = { aiMsh->mBitangents[i].x, aiMsh->mBitangents[i].y, aiMsh->mBitangents[i].z };
+		vec3 cross;
+		glm_vec3_cross(n, t, cross);
+		glm_vec4(t, glm_vec3_dot(cross, b) < 0.0f ? -1.0f : 1.0f, tangents[i]);
+	}
+}
+
+static void convert_vertex(Vertex* v, const struct aiMesh* aiMsh, const vec4* tangents, unsigned int i) {
+	const struct aiVector3D* uv = aiMsh->mTextureCoords[0] ? &aiMsh->mTextureCoords[0][i] : &zero;
+	const struct aiVector3D* n = aiMsh->mNormals ? &aiMsh->mNormals[i] : &zero;
+	const float* t = tangents ? (const float*)tangents[i] : defaultTangent;
+	glm_vec2_copy((vec2){ uv->x, uv->y }, v->texCoord);
+	glm_vec3_copy((vec3){ n->x, n->y, n->z }, v->normal);
+	glm_vec3_copy((vec3){ t[0], t[1], t[2] }, v->tangent);
+	v->sign = t[3];
+}
+
+// aiVector3D is already a packed float triple
+void mesh_convert_positions(vec3* dst, const struct aiMesh* aiMsh, unsigned int first, unsigned int count) {
+	_Static_assert(sizeof(struct aiVector3D) == sizeof(vec3), "aiVector3D must match vec3");
+	memcpy(dst, &aiMsh->mVertices[first], sizeof(vec3) * count);
+}
+
+// Interleave the separate assimp streams into Vertex, dst may be write combined mapped memory
+// so the SSE path assembles each vertex in registers and writes it sequentially
+void mesh_convert_vertices(Vertex* dst, const struct aiMesh* aiMsh, const vec4* tangents, unsigned int first, unsigned int count) {
+	unsigned int i = 0;
+#ifdef __SSE2__
+	_Static_assert(sizeof(Vertex) == 9 * sizeof(float), "SSE conversion expects a packed 36 byte Vertex");
+	if (aiMsh->mTextureCoords[0] && aiMsh->mNormals) {
+		const float* u = &aiMsh->mTextureCoords[0][first].x;
+		const float* n = &aiMsh->mNormals[first].x;
+		const __m128 fallback = _mm_loadu_ps(defaultTangent);
+		float* out = (float*)dst;
+		// 16 byte loads read one float past each vec3, only vectorize while a following element exists
+		for (; i < count && first + i + 1 < aiMsh->mNumVertices; i++) {
+			__m128 ua = _mm_loadu_ps(u + 3 * i), na = _mm_loadu_ps(n + 3 * i);
+			__m128 t = tangents ? _mm_loadu_ps(tangents[first + i]) : fallback;
+			// [ux uy nx ny] [nz tx ty tz] [tw]
+			__m128 w0 = _mm_movelh_ps(ua, na);
+			__m128 w1 = _mm_shuffle_ps(_mm_shuffle_ps(na, t, _MM_SHUFFLE(0, 0, 2, 2)), t, _MM_SHUFFLE(2, 1, 2, 0));
+
+			float* v = out + 9 * i;
+			_mm_storeu_ps(v + 0, w0);
+			_mm_storeu_ps(v + 4, w1);
+			_mm_store_ss(v + 8, _mm_shuffle_ps(t, t, _MM_SHUFFLE(3, 3, 3, 3)));
+		}
+	}
+#endif
+	for (; i < count; i++)
+		convert_vertex(&dst[i], aiMsh, tangents, first + i);
+}
+
+// Returns the number of indices written for faces [firstFace, firstFace + nFaces)
+unsigned int mesh_convert_indices(unsigned int* dst, const struct aiMesh* aiMsh, unsigned int firstFace, unsigned int nFaces) {
+	unsigned int n = 0;
+	for (unsigned int i = firstFace; i < firstFace + nFaces; i++) {
+		memcpy(&dst[n], aiMsh->mFaces[i].mIndices, sizeof(unsigned int) * aiMsh->mFaces[i].mNumIndices);
+		n += aiMsh->mFaces[i].mNumIndices;
+	}
+	return n;
+}
@@ -0,0 +1,15 @@
+#pragma once
+
+#include <assimp/scene.h>
+#include "scene.h"
+
+// Triangles or vertices per parallel tangent job
+#define TANGENT_CHUNK 16384
+
+unsigned long long mesh_hash(const struct aiMesh* aiMsh, bool tangents, unsigned int* nIndex);
+bool mesh_equal(const struct aiMesh* a, const struct aiMesh* b);
+void mesh_generate_tangents(const struct aiMesh* const* meshes, vec4* const* tangents, unsigned int count);
+void mesh_tangents_from_assimp(const struct aiMesh* aiMsh, vec4* tangents);
+void mesh_convert_positions(vec3* dst, const struct aiMesh* aiMsh, unsigned int first, unsigned int count);
+void mesh_convert_vertices(Vertex* dst, const struct aiMesh* aiMsh, const vec4* tangents, unsigned int first, unsigned int count);
+unsigned int mesh_convert_indices(unsigned int* dst, const struct aiMesh* aiMsh, unsigned int firstFace, unsigned int nFaces);
@@ -0,0 +1,42 @@
+#include "profile.h"
+
+#include <glad/glad.h>
+
+void gpu_timer_init(GpuTimer* t) {
+	glCreateQueries(GL_TIME_ELAPSED, PROFILE_LATENCY, t->queries);
+	t->frame = 0;
+	t->elapsed = 0;
+	t->samples = 0;
+}
+
+void gpu_timer_destroy(GpuTimer* t) {
+	glDeleteQueries(PROFILE_LATENCY, t->queries);
+}
+
+void gpu_timer_begin(GpuTimer* t) {
+	unsigned int query = t->queries[t->frame % PROFILE_LATENCY];
+	// Collect the result this query produced PROFILE_LATENCY frames ago before reusing it
+	if (t->frame >= PROFILE_LATENCY) {
+		int available = 0;
+		glGetQueryObjectiv(query, GL_QUERY_RESULT_AVAILABLE, &available);
+		if (available) {
+			GLuint64 elapsed = 0;
+			glGetQueryObjectui64v(query, GL_QUERY_RESULT, &elapsed);
+			t->elapsed += elapsed;
+			t->samples++;
+		}
+	}
+	glBeginQuery(GL_TIME_ELAPSED, query);
+}
+
+void gpu_timer_end(GpuTimer* t) {
+	glEndQuery(GL_TIME_ELAPSED);
+	t->frame++;
+}
+
+double gpu_timer_average(GpuTimer* t) {
+	double average = t->samples ? t->elapsed / 1e6 / t->samples : 0.0;
+	t->elapsed = 0;
+	t->samples = 0;
+	return average;
+}
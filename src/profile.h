@@ -0,0 +1,20 @@
+#pragma once
+
+#include <stdint.h>
+
+// Queries in flight per timer, results are read this many frames late so nothing stalls
+#define PROFILE_LATENCY 4
+
+typedef struct {
+	unsigned int queries[PROFILE_LATENCY];
+	unsigned int frame;
+	uint64_t elapsed;
+	unsigned int samples;
+} GpuTimer;
+
+void gpu_timer_init(GpuTimer* t);
+void gpu_timer_destroy(GpuTimer* t);
+void gpu_timer_begin(GpuTimer* t);
+void gpu_timer_end(GpuTimer* t);
+// Average milliseconds since the last call, resets the accumulated samples
+double gpu_timer_average(GpuTimer* t);
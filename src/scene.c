@@ -1,10 +1,14 @@
 #include "scene.h"
 
+#include <stdio.h>
+#include <float.h>
+#include <sys/resource.h>
 #include <glad/glad.h>
 #include <assimp/cimport.h>
 #include <assimp/scene.h>
 #include <assimp/postprocess.h>
 #include "texture.h"
+#include "mesh.h"
 #include "log.h"
 
 Part** node_parts(const Node* node);
@@ -13,6 +17,15 @@ Node** node_children(const Node* node);
 #define MIN(a, b) (((a) < (b)) ? (a) : (b))
 #define MAX(a, b) (((a) > (b)) ? (a) : (b))
 
+// Pool contents built by scene_batch_static before they replace a geometry's buffers
+typedef struct {
+	vec3* positions;
+	Vertex* vertices;
+	unsigned int* indices;
+	size_t n_vertex, n_index;
+	size_t vertex_capacity, index_capacity;
+} StaticPool;
+
 unsigned long long strhash(const char* str) {
 	unsigned long long hash = 0;
 	while (*str) {
@@ -22,30 +35,97 @@ unsigned long long strhash(const char* str) {
 	return hash;
 }
 
-static void scene_load_geometry(Scene* scene, unsigned int index, const struct aiScene* aiScn, unsigned int materialOffset);
-static void scene_load_materials(Scene* scene, const char* path, const struct aiScene* aiScn);
+// FNV-1a, pass HASH_SEED or a previous result to chain buffers
+unsigned long long hash_bytes(const void* data, size_t size, unsigned long long hash) {
+	const unsigned char* bytes = data;
+	for (size_t i = 0; i < size; i++) {
+		hash ^= bytes[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+static bool hash_file(const char* path, unsigned long long* hash) {
+	FILE* fp = fopen(path, "rb");
+	if (!fp) return false;
+	unsigned char buffer[65536];
+	size_t n;
+	*hash = HASH_SEED;
+	while ((n = fread(buffer, 1, sizeof(buffer), fp)))
+		*hash = hash_bytes(buffer, n, *hash);
+	fclose(fp);
+	return true;
+}
+
+static void scene_load_geometry(Scene* scene, unsigned int index, const struct aiScene* aiScn, const unsigned int* materialMap);
+static void scene_load_materials(Scene* scene, const char* path, const struct aiScene* aiScn, unsigned int* materialMap);
+static void geometry_reserve(Scene* scene, Geometry* g, size_t nVertices, size_t nIndices);
+static void geometry_upload_mesh(Scene* scene, Geometry* g, const Part* p, const struct aiMesh* aiMsh, const vec4* tangents);
+static unsigned int buffer_grow(unsigned int buffer, size_t used, size_t capacity);
+static MeshRange* geometry_find_mesh(Scene* scene, Geometry* g, unsigned long long key, const struct aiMesh* aiMsh, unsigned int nIndex);
+static bool geometry_mesh_equal(Scene* scene, const Geometry* g, const MeshRange* range, const struct aiMesh* aiMsh);
 static void scene_load_texture(Scene* scene, Texture** texture, const char* path, const struct aiMaterial* aiMat, enum aiTextureType type);
+static bool scene_grow_textures(Scene* scene);
+static unsigned long long material_hash(const Material* m);
+static bool scene_grow_material_table(Scene* scene);
+static bool scene_texture_reallocate(Texture* t, unsigned int first);
 static void scene_load_node(Scene* scene, Node** node, const struct aiScene* aiScn, const struct aiNode* aiNd, Node* parent, unsigned int geometryIdx, unsigned int partOffset);
 static void node_world_transform(Node* node, mat4 dest);
+static unsigned int node_count(const Node* node);
+static Node* node_flatten(Node* root);
+static int static_compare(const void* a, const void* b);
+static void static_pool_append(StaticPool* pool, const Geometry* g, const Part* p, unsigned int bias);
+static void transform_write(Node* node, Transform* t);
+static InstanceData node_instance(Node* node, Part* part);
+static void transform_write_matrix(mat4 parent, mat4 local, Transform* t);
+static void transform_reserve_gpu(Scene* scene, unsigned int count);
+static void transform_release_gpu(Scene* scene);
+static bool transform_pack_quat(const Transform* t, vec4 dst[2]);
+static void transform_upload_range(Scene* scene, unsigned int first, unsigned int count);
+static void scene_upload_materials(Scene* scene);
+static void feedback_reserve(Scene* scene, unsigned int capacity);
+static void scene_process_feedback(Scene* scene, const unsigned int* feedback, unsigned int count);
+static void scene_render_pulled(Scene* scene);
+static void scene_render_pulled_object(Scene* scene, CacheObject* cached);
+static void scene_render_object(Scene* scene, CacheObject* cached, unsigned int vertexArray);
+static enum RENDER_QUEUE material_queue(const Scene* scene, unsigned int material);
+static bool geometry_prepass(const Geometry* g);
+static void scene_depth_state(Scene* scene, const Geometry* g);
+static void scene_upload_visibility(Scene* scene, const unsigned int* table, unsigned int count, unsigned int maxTriangles);
+static size_t scene_write_draws(Scene* scene, CacheObject* cached, const DrawData* draws, size_t offset);
+static void scene_upload_cull(Scene* scene, const CullCommand* cull, const DrawIndirectCommand* templates, unsigned int count, unsigned int slots);
+static void bounds_sphere(const vec3* positions, unsigned int count, vec4 dest);
+static float hash_float(uint32_t x);
 
 void scene_init(Scene* scene) {
 	scene->materials = calloc(MATERIAL_MAX, sizeof(Material));
-	scene->textures = calloc(TEXTURE_MAX, sizeof(Texture));
+	scene->material_capacity = MATERIAL_MAX;
+	scene->material_table = calloc(MATERIAL_MAX * 2, sizeof(unsigned int));
+	scene->material_table_capacity = MATERIAL_MAX * 2;
+	scene->textures = calloc(TEXTURE_MAX, sizeof(Texture*));
+	scene->texture_capacity = TEXTURE_MAX;
 	scene->geometry = calloc(GEOMETRY_MAX, sizeof(Geometry));
+	scene->models = calloc(MODEL_MAX, sizeof(Model));
 	scene->nodes = calloc(NODE_MAX, sizeof(Node*));
-	scene->cache = calloc(GEOMETRY_MAX, sizeof(CacheObject));
+	scene->node_capacity = NODE_MAX;
+	scene->cache = calloc(CACHE_MAX, sizeof(CacheObject));
+	scene->staging = malloc(GEOMETRY_STAGING_SIZE);
 
-	glCreateBuffers(1, &scene->material_buffer);
-	glNamedBufferData(scene->material_buffer, 32 * MATERIAL_MAX, NULL, GL_STATIC_DRAW);
-	glBindBufferBase(GL_UNIFORM_BUFFER, 2, scene->material_buffer);
+	scene->transforms = malloc(sizeof(Transform) * TRANSFORM_MAX);
+	scene->instance_data = malloc(sizeof(InstanceData) * TRANSFORM_MAX);
+	scene->transform_capacity = TRANSFORM_MAX;
+	transform_reserve_gpu(scene, TRANSFORM_MAX);
 
-	glCreateBuffers(1, &scene->transform_buffer);
-	glNamedBufferData(scene->transform_buffer, sizeof(mat4) * TRANSFORM_MAX, NULL, GL_STATIC_DRAW);
-	glCreateTextures(GL_TEXTURE_BUFFER, 1, &scene->transform_texture);
-	glTextureBuffer(scene->transform_texture, GL_RGBA32F, scene->transform_buffer);
+	// One material per command, each cache object starts at an aligned offset so it can be bound as a range.
+	// Room for twice the commands, the instance set tail of each object is stored again on its own
+	glGetIntegerv(GL_SHADER_STORAGE_BUFFER_OFFSET_ALIGNMENT, &scene->draw_alignment);
+	scene->draw_capacity = TRANSFORM_MAX;
+	scene->draw_buffer = buffer_grow(0, 0, (sizeof(DrawData) * scene->draw_capacity + scene->draw_alignment * CACHE_MAX) * 2);
+	glCreateVertexArrays(1, &scene->pull_array);
+	glCreateQueries(GL_SAMPLES_PASSED, CACHE_MAX, scene->overdraw_queries[0]);
+	glCreateQueries(GL_SAMPLES_PASSED, CACHE_MAX, scene->overdraw_queries[1]);
 
-	glCreateBuffers(1, &scene->assign_buffer);
-	glNamedBufferData(scene->assign_buffer, sizeof(ivec2) * TRANSFORM_MAX, NULL, GL_STATIC_DRAW);
+	feedback_reserve(scene, MATERIAL_MAX);
 }
 
 void scene_destroy(Scene* scene) {
@@ -54,65 +134,154 @@ void scene_destroy(Scene* scene) {
 		scene->material_buffer = 0;
 	}
 
-	if (scene->transform_handle) {
-		glMakeTextureHandleNonResidentARB(scene->transform_handle);
-		scene->transform_handle = 0;
+	transform_release_gpu(scene);
+	glDeleteQueries(CACHE_MAX, scene->overdraw_queries[0]);
+	glDeleteQueries(CACHE_MAX, scene->overdraw_queries[1]);
+	free(scene->transforms);
+	free(scene->instance_data);
+	scene->transforms = NULL;
+	scene->instance_data = NULL;
+
+	if (scene->draw_buffer) {
+		glDeleteBuffers(1, &scene->draw_buffer);
+		scene->draw_buffer = 0;
 	}
-	if (scene->transform_texture) {
-		glDeleteTextures(1, &scene->transform_texture);
-		scene->transform_texture = 0;
+	if (scene->pull_array) {
+		glDeleteVertexArrays(1, &scene->pull_array);
+		scene->pull_array = 0;
 	}
-	if (scene->transform_buffer) {
-		glDeleteBuffers(1, &scene->transform_buffer);
-		scene->transform_buffer = 0;
+	if (scene->cull_buffer) {
+		glDeleteBuffers(1, &scene->cull_buffer);
+		glDeleteBuffers(1, &scene->cull_template);
+		scene->cull_buffer = scene->cull_template = 0;
+		scene->cull_capacity = 0;
 	}
 
-	if (scene->assign_buffer) {
-		glDeleteBuffers(1, &scene->assign_buffer);
-		scene->assign_buffer = 0;
+	if (scene->feedback_fence) {
+		glDeleteSync(scene->feedback_fence);
+		scene->feedback_fence = NULL;
+	}
+	if (scene->feedback_buffer) {
+		glDeleteBuffers(1, &scene->feedback_buffer);
+		scene->feedback_buffer = 0;
+	}
+	if (scene->feedback_readback) {
+		glDeleteBuffers(1, &scene->feedback_readback);
+		scene->feedback_readback = 0;
 	}
 
+	for (unsigned int i = 0; i < scene->n_cache; i++)
+		glDeleteBuffers(1, &scene->cache[i].indirect_buffer);
 	scene->n_cache = 0;
 
 	for (unsigned int i = 0; i < scene->n_geometry; i++) {
 		Geometry* g = &scene->geometry[i];
+		glDeleteBuffers(1, &g->position_buffer);
 		glDeleteBuffers(1, &g->vertex_buffer);
 		glDeleteBuffers(1, &g->element_buffer);
 		glDeleteVertexArrays(1, &g->vertex_array);
-		glDeleteBuffers(1, &g->indirect_buffer);
+		glDeleteVertexArrays(1, &g->depth_array);
+		free(g->cpu_positions);
+		free(g->cpu_vertices);
+		free(g->cpu_indices);
 	}
 
-	for (unsigned int i = 0; i < TEXTURE_MAX; i++) {
-		Texture* t = &scene->textures[i];
-		if (!t->key) continue;
+	for (unsigned int i = 0; i < scene->texture_capacity; i++) {
+		Texture* t = scene->textures[i];
+		if (!t) continue;
 		if (t->handle) glMakeTextureHandleNonResidentARB(t->handle);
 		if (t->texture) glDeleteTextures(1, &t->texture);
+		texture_decode_release(&t->decode);
+		free(t->path);
+		free(t);
 	}
 	
 	for (unsigned int i = 0; i < scene->n_nodes; i++) {
 		node_delete(&scene->nodes[i]);
 	}
 
+	for (unsigned int i = 0; i < scene->n_models; i++) {
+		node_delete(&scene->models[i].root);
+		free(scene->models[i].path);
+	}
+
+	for (unsigned int i = 0; i < scene->n_instance_sets; i++) {
+		free(scene->instance_sets[i]->transforms);
+		free(scene->instance_sets[i]->dense_handle);
+		free(scene->instance_sets[i]->handle_dense);
+		free(scene->instance_sets[i]->generations);
+		free(scene->instance_sets[i]);
+	}
+	free(scene->instance_sets);
+	if (scene->generator_buffer) {
+		glDeleteBuffers(1, &scene->generator_buffer);
+		scene->generator_buffer = 0;
+	}
+	if (scene->visibility_table) {
+		glDeleteBuffers(1, &scene->visibility_table);
+		scene->visibility_table = 0;
+	}
+
 	free(scene->materials);
+	free(scene->material_table);
 	free(scene->textures);
 	free(scene->geometry);
+	free(scene->models);
 	free(scene->nodes);
 	free(scene->cache);
+	free(scene->transparent);
+	free(scene->staging);
 }
 
 void scene_load(Scene* scene, const char* path, unsigned int geometryIdx, mat4 initialTransform, bool flipUVs) {
-	const struct aiScene* aiScn = aiImportFile(
-		path,
-		(flipUVs ? aiProcess_FlipUVs : 0) | aiProcess_CalcTangentSpace | aiProcess_Triangulate | aiProcess_JoinIdenticalVertices | aiProcess_SortByPType
-	);
+	double start = plog_time();
+	unsigned int flags = (flipUVs ? aiProcess_FlipUVs : 0) | aiProcess_Triangulate | aiProcess_JoinIdenticalVertices | aiProcess_SortByPType;
+	if (scene->assimp_tangents) flags |= aiProcess_CalcTangentSpace;
+
+	// Parts live in one geometry pool, so the pool is part of the model identity
+	Model identity = { .path = (char*)path, .flags = flags, .geometry = geometryIdx, .flatten = scene->static_flatten };
+	identity.key = hash_bytes(path, strlen(path), HASH_SEED);
+	identity.key = hash_bytes(&flags, sizeof(flags), identity.key);
+	identity.key = hash_bytes(&geometryIdx, sizeof(geometryIdx), identity.key);
+	identity.key = hash_bytes(&scene->static_flatten, sizeof(scene->static_flatten), identity.key);
+	Model* model = scene_find_model(scene, &identity);
+	if (model) {
+		Node* node = node_clone(model->root, NULL);
+		if (!node) {
+			plogf(LL_ERROR, "Node allocation failed\n");
+			return;
+		}
+		glm_mat4_copy(initialTransform, node->transform);
+		*scene_add_node(scene) = node;
+		plogf(LL_INFO, "Instanced model: %s in %.3fms\n", path, (plog_time() - start) * 1000.0);
+		return;
+	}
+
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	long peakRss = usage.ru_maxrss;
+
+	const struct aiScene* aiScn = aiImportFile(path, flags);
+	plogf(LL_INFO, "Assimp import of %s in %.3fms\n", path, (plog_time() - start) * 1000.0);
 	if (!aiScn || aiScn->mFlags & AI_SCENE_FLAGS_INCOMPLETE || !aiScn->mRootNode) {
 		plogf(LL_ERROR, "Failed to load model: %s. %s\n", path, aiGetErrorString());
+		aiReleaseImport(aiScn);
+		return;
 	}
 
 	unsigned int partOffset = scene->geometry[geometryIdx].n_parts;
-	scene_load_geometry(scene, geometryIdx, aiScn, scene->n_materials);
-	scene_load_materials(scene, path, aiScn);
-	Node** node = &scene->nodes[scene->n_nodes++];
+	unsigned int textureLookups = scene->texture_lookups, textureHits = scene->texture_hits;
+	unsigned int materialLookups = scene->material_lookups, materialHits = scene->material_hits;
+	unsigned int materialMap[aiScn->mNumMaterials];
+	scene_load_materials(scene, path, aiScn, materialMap);
+	scene_load_geometry(scene, geometryIdx, aiScn, materialMap);
+	plogf(LL_INFO, "Deduplicated %u/%u textures, %u/%u materials (total hit rate: textures %.0f%%, materials %.0f%%)\n",
+		scene->texture_hits - textureHits, scene->texture_lookups - textureLookups,
+		scene->material_hits - materialHits, scene->material_lookups - materialLookups,
+		scene->texture_lookups ? 100.0 * scene->texture_hits / scene->texture_lookups : 0.0,
+		scene->material_lookups ? 100.0 * scene->material_hits / scene->material_lookups : 0.0
+	);
+	Node** node = scene_add_node(scene);
 	scene_load_node(
 		scene,
 		node,
@@ -122,33 +291,82 @@ void scene_load(Scene* scene, const char* path, unsigned int geometryIdx, mat4 i
 		geometryIdx,
 		partOffset
 	);
+	aiReleaseImport(aiScn);
+	if (scene->static_flatten) {
+		unsigned int before = node_count(*node);
+		*node = node_flatten(*node);
+		plogf(LL_INFO, "Flattened %s from %u to %u nodes\n", path, before, node_count(*node));
+	}
+	if (scene->n_models < MODEL_MAX) {
+		Model* added = &scene->models[scene->n_models++];
+		*added = identity;
+		added->path = strdup(path);
+		added->root = node_clone(*node, NULL);
+	} else {
+		plogf(LL_WARN, "Model registry full, %s will be imported again on reload\n", path);
+	}
 	plogf(LL_INFO, "Applying transform\n");
 	glm_mat4_copy(initialTransform, (*node)->transform);
+	getrusage(RUSAGE_SELF, &usage);
+	plogf(LL_INFO, "Imported model: %s in %.3fms, peak RSS %ld KiB (+%ld KiB)\n",
+		path, (plog_time() - start) * 1000.0, usage.ru_maxrss, usage.ru_maxrss - peakRss);
 }
 
+Model* scene_find_model(Scene* scene, const Model* identity) {
+	for (unsigned int i = 0; i < scene->n_models; i++) {
+		const Model* m = &scene->models[i];
+		if (m->key == identity->key && m->flags == identity->flags && m->geometry == identity->geometry &&
+			m->flatten == identity->flatten && !strcmp(m->path, identity->path)) return &scene->models[i];
+	}
+	return NULL;
+}
+
+// Orders by the range a part draws, then its material, so parts sharing a deduplicated range sort together
 static int part_compare(const void* a, const void* b) {
 	if (!a) return -1;
 	if (!b) return 1;
 	const Part *p = a, *q = b;
-	int n_index = p->n_index - q->n_index;
-	int base_index = p->base_index - q->base_index;
-	int base_vertex = p->base_vertex - q->base_vertex;
-	if (!n_index && !base_index && !base_vertex) return 0;
-	return p - q;
+	if (p->base_vertex != q->base_vertex) return p->base_vertex < q->base_vertex ? -1 : 1;
+	if (p->base_index != q->base_index) return p->base_index < q->base_index ? -1 : 1;
+	if (p->n_index != q->n_index) return p->n_index < q->n_index ? -1 : 1;
+	return (p->material > q->material) - (p->material < q->material);
+}
+
+// Materials are per instance, parts drawing the same range can share a command
+static bool part_same_range(const Part* p, const Part* q) {
+	return p->base_vertex == q->base_vertex && p->base_index == q->base_index && p->n_index == q->n_index;
 }
 
 static int cache_part_compare(const void* a, const void* b) {
 	if (!a) return -1;
 	if (!b) return 1;
 	const CachePart *p = a, *q = b;
-	int geometry = p->node->geometry - q->node->geometry;
+	int geometry = p->geometry - q->geometry;
 	if (geometry) return geometry;
-	return part_compare(p->part, q->part);
+	// Opaque, masked then transparent parts of a geometry, each queue in a cache object of its own
+	int queue = (int)p->queue - (int)q->queue;
+	if (queue) return queue;
+	// Instance sets always get their own command, keep them after the node parts
+	int set = (p->set != NULL) - (q->set != NULL);
+	if (set) return set;
+	if (p->set) return p->set < q->set ? -1 : p->set > q->set;
+	int part = part_compare(p->part, q->part);
+	if (part) return part;
+	return (int)p->instance.material - (int)q->instance.material;
 }
 
 void scene_build_cache(Scene* scene) {
+	// Drop the previous cache
+	for (unsigned int i = 0; i < scene->n_cache; i++) {
+		glDeleteBuffers(1, &scene->cache[i].indirect_buffer);
+		scene->cache[i].indirect_buffer = 0;
+	}
+	scene->n_cache = 0;
+	scene->instances_rebuild = false;
+	scene->dirty_first = scene->dirty_end = 0;
+
 	// Count total parts in scene to allocate cache
-	unsigned int partCount = 0;
+	unsigned int partCount = 0, nodeCount = 0;
 	for (unsigned int i = 0; i < scene->n_nodes; i++) {
 		// Traverse each tree
 		Node* node = scene->nodes[i];
@@ -159,16 +377,28 @@ void scene_build_cache(Scene* scene) {
 			Node* n = queue[--nQueue];
 			// Increment part total
 			partCount += n->n_parts;
+			nodeCount++;
 			// Traverse children
 			for (unsigned int j = 0; j < n->n_children; j++)
 				queue[nQueue++] = node_children(n)[j];
 		}
 	}
+	// Instance sets are one entry each, list sets store every transform, procedural sets only theirs
+	unsigned int transformCount = partCount, nGenerators = 0, visibilityCount = partCount;
+	for (unsigned int i = 0; i < scene->n_instance_sets; i++) {
+		InstanceSet* set = scene->instance_sets[i];
+		transformCount += set->pattern == PATTERN_LIST ? set->capacity : 1;
+		visibilityCount += set->pattern == PATTERN_LIST ? set->capacity : set->n_instances;
+		nGenerators += set->pattern != PATTERN_LIST;
+	}
+	unsigned int* visibility = malloc(sizeof(unsigned int) * MAX(visibilityCount, 1));
+	unsigned int nVisibility = 0, maxTriangles = 1;
+	unsigned int entryCount = partCount + scene->n_instance_sets;
 	
 	// Build parts list
 	// Same loop as in counting, this time copy the data
 	unsigned int n_parts = 0;
-	CachePart* parts = malloc(sizeof(CachePart) * partCount);
+	CachePart* parts = malloc(sizeof(CachePart) * entryCount);
 	for (unsigned int i = 0; i < scene->n_nodes; i++) {
 		Node* node = scene->nodes[i];
 		Node* queue[128];
@@ -177,119 +407,1190 @@ void scene_build_cache(Scene* scene) {
 		while (nQueue) {
 			Node* n = queue[--nQueue];
 			for (unsigned int j = 0; j < n->n_parts; j++) {
-				CachePart* cached = &parts[n_parts++];
-				cached->part = node_parts(n)[j];
-				cached->node = n;
+				InstanceData instance = node_instance(n, node_parts(n)[j]);
+				parts[n_parts++] = (CachePart) { .part = node_parts(n)[j], .node = n, .geometry = n->geometry, .instance = instance, .queue = material_queue(scene, instance.material) };
 			}
 			for (unsigned int j = 0; j < n->n_children; j++)
 				queue[nQueue++] = node_children(n)[j];
 		}
 	}
+	for (unsigned int i = 0; i < scene->n_instance_sets; i++) {
+		InstanceSet* set = scene->instance_sets[i];
+		InstanceData instance = { set->material != MATERIAL_NONE ? set->material : set->part->material, set->tint };
+		parts[n_parts++] = (CachePart) { .part = set->part, .set = set, .geometry = set->geometry, .instance = instance, .queue = material_queue(scene, instance.material) };
+	}
 	// Sort parts by geometry and part to instance identical parts
 	qsort(parts, n_parts, sizeof(CachePart), cache_part_compare);
 
-	DrawIndirectCommand* commands = malloc(sizeof(DrawIndirectCommand) * TRANSFORM_MAX);
-	mat4* transform = malloc(sizeof(mat4) * TRANSFORM_MAX);
-	unsigned int nTransform = 0;
+	DrawIndirectCommand* commands = malloc(sizeof(DrawIndirectCommand) * entryCount);
+	DrawData* draws = malloc(sizeof(DrawData) * entryCount);
+	CullCommand* cull = malloc(sizeof(CullCommand) * MAX(entryCount, 1));
+	DrawIndirectCommand* cullTemplate = malloc(sizeof(DrawIndirectCommand) * MAX(entryCount, 1));
+	InstanceGenerator* generators = malloc(sizeof(InstanceGenerator) * MAX(nGenerators, 1));
+	if (entryCount > scene->draw_capacity) {
+		scene->draw_capacity = MAX(entryCount, scene->draw_capacity * 2);
+		scene->draw_buffer = buffer_grow(scene->draw_buffer, 0, (sizeof(DrawData) * scene->draw_capacity + scene->draw_alignment * CACHE_MAX) * 2);
+	}
+	if (transformCount > scene->transform_capacity) {
+		scene->transform_capacity = MAX(transformCount, scene->transform_capacity * 2);
+		scene->transforms = realloc(scene->transforms, sizeof(Transform) * scene->transform_capacity);
+		scene->instance_data = realloc(scene->instance_data, sizeof(InstanceData) * scene->transform_capacity);
+	}
+	if (entryCount > scene->transparent_capacity) {
+		scene->transparent_capacity = entryCount;
+		scene->transparent = realloc(scene->transparent, sizeof(TransparentCommand) * entryCount);
+	}
+	scene->n_transparent = 0;
+	TransparentCommand* transparent = NULL;
+	unsigned int nTransform = 0, nDraws = 0, nSetInstances = 0, nMaterialSplits = 0;
+	nGenerators = 0;
+	size_t drawOffset = 0;
 
 	// Build render cache
 	// New cacheobject when geometry changes
 	// New cachepart when part changes, same parts increment instance
 	Geometry* currentGeometry = NULL;
+	enum RENDER_QUEUE currentQueue = QUEUE_OPAQUE;
 	CacheObject* currentCache = NULL;
 	Part* currentPart = NULL;
+	unsigned int currentMaterial = MATERIAL_NONE;
 	DrawIndirectCommand* command = NULL;
 	for (unsigned int i = 0; i < n_parts; i++) {
 		CachePart* cachePart = &parts[i];
-		// Switch object if geometry changes
-		if (cachePart->node->geometry != currentGeometry) {
+		// Switch object if geometry or queue changes
+		if (cachePart->geometry != currentGeometry || cachePart->queue != currentQueue) {
 			plogf(LL_INFO, "Switching geometry\n");
 			// Write commands for old geometry
 			if (currentGeometry) {
 				plogf(LL_INFO, "Writing indirect buffer\n");
-				glCreateBuffers(1, &currentGeometry->indirect_buffer);
+				glCreateBuffers(1, &currentCache->indirect_buffer);
 				glNamedBufferData(
-					currentGeometry->indirect_buffer,
+					currentCache->indirect_buffer,
 					currentCache->n_commands * sizeof(DrawIndirectCommand),
 					commands,
 					GL_STATIC_DRAW
 				);
+				drawOffset = scene_write_draws(scene, currentCache, draws, drawOffset);
 			}
 			// Setup new geometry
-			currentGeometry = cachePart->node->geometry;
+			currentGeometry = cachePart->geometry;
+			currentQueue = cachePart->queue;
 			currentCache = &scene->cache[scene->n_cache++];
 			currentCache->geometry = currentGeometry;
+			currentCache->queue = currentQueue;
+			currentCache->n_commands = 0;
+			currentCache->n_static = 0;
+			currentCache->command_base = nDraws;
+			currentPart = NULL;
 		}
-		// Switch command if part changes (vertices/indices, not on material change)
-		if (part_compare(cachePart->part, currentPart)) {
+		// Switch command if part changes (vertices/indices, materials are per instance)
+		if (cachePart->set || !currentPart || !part_same_range(cachePart->part, currentPart)) {
 			currentPart = cachePart->part;
+			currentMaterial = cachePart->instance.material;
+			draws[currentCache->n_commands] = (DrawData) {
+				.visibility = nVisibility,
+				.base_index = currentPart->base_index,
+				.base_vertex = currentPart->base_vertex,
+				.base_instance = nTransform
+			};
+			maxTriangles = MAX(maxTriangles, currentPart->n_index / 3);
+			cull[nDraws] = (CullCommand) { .draw = draws[currentCache->n_commands] };
+			glm_vec4_copy(currentPart->bounds, cull[nDraws].bounds);
+			cullTemplate[nDraws] = (DrawIndirectCommand) { currentPart->n_index, 0, currentPart->base_index, currentPart->base_vertex, 0 };
 			command = &commands[currentCache->n_commands++];
+			if (!cachePart->set) currentCache->n_static = currentCache->n_commands;
+			nDraws++;
 			// Initialize new command
 			command->n_index = currentPart->n_index;
 			command->n_instance = 0;
 			command->base_index = currentPart->base_index;
 			command->base_vertex = currentPart->base_vertex;
 			command->base_instance = nTransform;
+			transparent = NULL;
+			if (currentQueue == QUEUE_TRANSPARENT) {
+				transparent = &scene->transparent[scene->n_transparent++];
+				*transparent = (TransparentCommand) { .geometry = currentGeometry, .draw = draws[currentCache->n_commands - 1], .command = *command };
+				glm_vec4_copy(currentPart->bounds, transparent->bounds);
+			}
+		}
+		unsigned int visibilityEntry = (scene->n_cache - 1) << VISIBILITY_COMMAND_BITS | (currentCache->n_commands - 1);
+		if (cachePart->set) {
+			// Whole set in one command, nothing merges into it
+			InstanceSet* set = cachePart->set;
+			unsigned int setVisibility = set->pattern == PATTERN_LIST ? set->capacity : set->n_instances;
+			for (unsigned int j = 0; j < setVisibility; j++)
+				visibility[nVisibility++] = visibilityEntry;
+			command->n_instance = set->n_instances;
+			cull[nDraws - 1].count = set->n_instances;
+			cull[nDraws - 1].slots = set->pattern == PATTERN_LIST ? set->capacity : set->n_instances;
+			nSetInstances += set->n_instances;
+			currentPart = NULL;
+			set->built = true;
+			set->command_dirty = false;
+			set->base_transform = nTransform;
+			set->cache_index = scene->n_cache - 1;
+			set->command_index = currentCache->n_commands - 1;
+			if (set->pattern == PATTERN_LIST) {
+				// Unused reserved slots keep whatever they held, they are outside the instance count
+				for (unsigned int j = 0; j < set->n_instances; j++) {
+					scene->instance_data[nTransform + j] = cachePart->instance;
+					transform_write_matrix(set->transform, set->transforms[j], &scene->transforms[nTransform + j]);
+				}
+				nTransform += set->capacity;
+			} else {
+				// Every instance reads the set transform, the shader applies the pattern on top
+				mat4 identity = GLM_MAT4_IDENTITY_INIT;
+				scene->instance_data[nTransform] = cachePart->instance;
+				transform_write_matrix(set->transform, identity, &scene->transforms[nTransform++]);
+				InstanceGenerator* generator = &generators[nGenerators++];
+				*generator = (InstanceGenerator) { .pattern = set->pattern, .count = set->n_instances };
+				glm_vec4_copy(set->params, generator->params);
+				draws[currentCache->n_commands - 1].generator = nGenerators;
+				cull[nDraws - 1].draw.generator = nGenerators;
+			}
+			if (transparent) {
+				transparent->set = set;
+				transparent->draw = draws[currentCache->n_commands - 1];
+			}
+			continue;
+		}
+		// Instance transform and material, found in the shader as gl_BaseInstance + gl_InstanceID
+		if (cachePart->instance.material != currentMaterial) {
+			currentMaterial = cachePart->instance.material;
+			nMaterialSplits++;
 		}
-		// Setup instance transform and assign
 		command->n_instance++;
-		node_world_transform(cachePart->node, transform[nTransform]);
-		ivec2 assign = { cachePart->part->material, nTransform };
-		glNamedBufferSubData(scene->assign_buffer, nTransform * sizeof(ivec2), sizeof(ivec2), assign);
+		if (transparent) transparent->count++;
+		cull[nDraws - 1].count++;
+		cull[nDraws - 1].slots++;
+		visibility[nVisibility++] = visibilityEntry;
+		scene->instance_data[nTransform] = cachePart->instance;
+		transform_write(cachePart->node, &scene->transforms[nTransform]);
 		nTransform++;
 	}
 	free(parts);
 	// Last processed geometry didn't get switched, save it (if parts > 0)
 	if (currentGeometry) {
 		plogf(LL_INFO, "Writing indirect buffer\n");
-		glCreateBuffers(1, &currentGeometry->indirect_buffer);
+		glCreateBuffers(1, &currentCache->indirect_buffer);
 		glNamedBufferData(
-			currentGeometry->indirect_buffer,
+			currentCache->indirect_buffer,
 			currentCache->n_commands * sizeof(DrawIndirectCommand),
 			commands,
 			GL_STATIC_DRAW
 		);
+		scene_write_draws(scene, currentCache, draws, drawOffset);
 	}
 	free(commands);
+	free(draws);
+	// Instance slots of every command back to back, list sets keep their reserved capacity so adds fit
+	unsigned int nSlots = 0;
+	for (unsigned int i = 0; i < nDraws; i++) {
+		cull[i].first = cullTemplate[i].base_instance = nSlots;
+		nSlots += cull[i].slots;
+	}
+	scene_upload_cull(scene, cull, cullTemplate, nDraws, nSlots);
+	free(cull);
+	free(cullTemplate);
+	// Generators are rewritten completely, no need to keep the old contents
+	if (nGenerators > scene->generator_capacity) {
+		scene->generator_capacity = MAX(nGenerators, scene->generator_capacity * 2);
+		scene->generator_buffer = buffer_grow(scene->generator_buffer, 0, sizeof(InstanceGenerator) * scene->generator_capacity);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, SSBO_GENERATOR, scene->generator_buffer);
+	}
+	if (nGenerators) glNamedBufferSubData(scene->generator_buffer, 0, sizeof(InstanceGenerator) * nGenerators, generators);
+	free(generators);
+	plogf(LL_INFO, "Per draw data: %u bytes for %u commands (%u with per draw materials)\n",
+		nDraws * (unsigned int)sizeof(DrawData), nDraws, nDraws + nMaterialSplits);
+	size_t poolUsed = 0, poolCapacity = 0;
+	for (unsigned int i = 0; i < GEOMETRY_MAX; i++) {
+		const Geometry* g = &scene->geometry[i];
+		poolUsed += (sizeof(vec3) + sizeof(Vertex)) * g->n_vertices + sizeof(unsigned int) * g->n_indices;
+		poolCapacity += (sizeof(vec3) + sizeof(Vertex)) * g->vertex_capacity + sizeof(unsigned int) * g->index_capacity;
+	}
+	plogf(LL_INFO, "Cache: %u nodes, %u instance sets, %u commands, %u transforms, geometry pools %.2f / %.2f MiB\n",
+		nodeCount, scene->n_instance_sets, nDraws, nTransform, poolUsed / 1048576.0, poolCapacity / 1048576.0);
+	if (scene->n_transparent) plogf(LL_INFO, "Transparent queue: %u commands\n", scene->n_transparent);
+	if (scene->n_instance_sets)
+		plogf(LL_INFO, "Instance sets: %u sets, %u instances, %u procedural\n", scene->n_instance_sets, nSetInstances, nGenerators);
+	scene_upload_visibility(scene, visibility, nVisibility, maxTriangles);
+	free(visibility);
 	// Buffer transforms
-	glNamedBufferSubData(scene->transform_buffer, 0, sizeof(mat4) * nTransform, transform);
-	free(transform);
+	scene->n_transforms = nTransform;
+	scene_upload_transforms(scene);
 	
-	// Buffer materials
-	for (unsigned int i = 0; i < scene->n_materials; i++) {
-		Material* mat = &scene->materials[i];
-		if (mat->diffuse && mat->diffuse->texture) {
-			if (!mat->diffuse->handle) {
-				mat->diffuse->handle = glGetTextureHandleARB(mat->diffuse->texture);
-				glMakeTextureHandleResidentARB(mat->diffuse->handle);
+	scene_upload_materials(scene);
+	scene->revision++;
+	scene->static_revision++;
+}
+
+// Records and templates are rewritten completely, no need to keep the old contents
+static void scene_upload_cull(Scene* scene, const CullCommand* cull, const DrawIndirectCommand* templates, unsigned int count, unsigned int slots) {
+	if (count > scene->cull_capacity) {
+		scene->cull_capacity = MAX(count, scene->cull_capacity * 2);
+		if (scene->cull_buffer) glDeleteBuffers(1, &scene->cull_buffer);
+		if (scene->cull_template) glDeleteBuffers(1, &scene->cull_template);
+		scene->cull_buffer = buffer_grow(0, 0, sizeof(CullCommand) * scene->cull_capacity);
+		scene->cull_template = buffer_grow(0, 0, sizeof(DrawIndirectCommand) * scene->cull_capacity);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, SSBO_CULL, scene->cull_buffer);
+	}
+	if (count) {
+		glNamedBufferSubData(scene->cull_buffer, 0, sizeof(CullCommand) * count, cull);
+		glNamedBufferSubData(scene->cull_template, 0, sizeof(DrawIndirectCommand) * count, templates);
+	}
+	scene->n_commands = count;
+	scene->n_cull_slots = slots;
+}
+
+Node** scene_add_node(Scene* scene) {
+	if (scene->n_nodes == scene->node_capacity) {
+		scene->node_capacity *= 2;
+		scene->nodes = realloc(scene->nodes, sizeof(Node*) * scene->node_capacity);
+	}
+	return &scene->nodes[scene->n_nodes++];
+}
+
+InstanceSet* scene_add_instances(Scene* scene, Geometry* g, Part* part, enum INSTANCE_PATTERN pattern, unsigned int count) {
+	InstanceSet* set = calloc(1, sizeof(InstanceSet));
+	set->geometry = g;
+	set->part = part;
+	set->n_instances = count;
+	set->pattern = pattern;
+	set->material = MATERIAL_NONE;
+	set->tint = TINT_NONE;
+	glm_mat4_identity(set->transform);
+	if (pattern == PATTERN_LIST) {
+		set->n_instances = 0;
+		mat4 identity = GLM_MAT4_IDENTITY_INIT;
+		set->free_handle = HANDLE_NONE;
+		scene_reserve_instances(scene, set, count);
+		for (unsigned int i = 0; i < count; i++) scene_instance_add(scene, set, identity);
+	}
+	scene->instance_sets = realloc(scene->instance_sets, sizeof(InstanceSet*) * (scene->n_instance_sets + 1));
+	scene->instance_sets[scene->n_instance_sets++] = set;
+	return set;
+}
+
+// Import a model for use in instance sets, returns its first part without adding a node to the scene
+Part* scene_load_part(Scene* scene, const char* path, unsigned int geometryIdx) {
+	unsigned int nNodes = scene->n_nodes;
+	mat4 identity = GLM_MAT4_IDENTITY_INIT;
+	scene_load(scene, path, geometryIdx, identity, false);
+	if (scene->n_nodes == nNodes) return NULL;
+	Node* root = scene->nodes[--scene->n_nodes];
+	Part* part = NULL;
+	Node* queue[128];
+	unsigned int nQueue = 1;
+	queue[0] = root;
+	while (nQueue && !part) {
+		Node* n = queue[--nQueue];
+		if (n->n_parts) part = node_parts(n)[0];
+		for (unsigned int j = 0; j < n->n_children; j++)
+			queue[nQueue++] = node_children(n)[j];
+	}
+	node_delete(&root);
+	return part;
+}
+
+static int static_compare(const void* a, const void* b) {
+	const CachePart *p = a, *q = b;
+	int geometry = p->geometry - q->geometry;
+	if (geometry) return geometry;
+	if (p->instance.material != q->instance.material) return p->instance.material < q->instance.material ? -1 : 1;
+	if (p->instance.tint != q->instance.tint) return p->instance.tint < q->instance.tint ? -1 : 1;
+	return 0;
+}
+
+// Replace every root node with pre-transformed copies of its meshes, merged into one part per
+// geometry, material and tint. Sources come from the CPU copies kept while scene->static_batch, so call
+// this at load time after the static props and before anything that moves. Each batched pool is rebuilt
+// from the ranges instance sets still draw followed by the batches, the merged sources are dropped
+void scene_batch_static(Scene* scene) {
+	double start = plog_time();
+	unsigned int nEntries = 0, nodesBefore = 0;
+	for (unsigned int i = 0; i < scene->n_nodes; i++) nodesBefore += node_count(scene->nodes[i]);
+	CachePart* entries = NULL;
+	for (unsigned int i = 0; i < scene->n_nodes; i++) {
+		Node* queue[128];
+		unsigned int nQueue = 1;
+		queue[0] = scene->nodes[i];
+		while (nQueue) {
+			Node* n = queue[--nQueue];
+			entries = realloc(entries, sizeof(CachePart) * (nEntries + n->n_parts));
+			for (unsigned int j = 0; j < n->n_parts; j++)
+				entries[nEntries++] = (CachePart) { .part = node_parts(n)[j], .node = n, .geometry = n->geometry, .instance = node_instance(n, node_parts(n)[j]) };
+			for (unsigned int j = 0; j < n->n_children; j++)
+				queue[nQueue++] = node_children(n)[j];
+		}
+	}
+	for (unsigned int i = 0; i < nEntries; i++) {
+		if (entries[i].geometry->cpu_positions) continue;
+		plogf(LL_ERROR, "Static batching needs scene->static_batch set before loading, nothing batched\n");
+		free(entries);
+		return;
+	}
+	qsort(entries, nEntries, sizeof(CachePart), static_compare);
+
+	Node** batched = malloc(sizeof(Node*) * MAX(nEntries, 1));
+	unsigned int nBatched = 0;
+	size_t poolBefore = 0, poolAfter = 0;
+	bool rebuilt[GEOMETRY_MAX] = { false };
+	// Ranges instance sets still draw, old Part then its new range
+	Part* live = malloc(sizeof(Part) * 2 * MAX(scene->n_instance_sets, 1));
+	StaticPool pool = { 0 };
+	for (unsigned int gFirst = 0, gLast; gFirst < nEntries; gFirst = gLast) {
+		Geometry* g = entries[gFirst].geometry;
+		for (gLast = gFirst + 1; gLast < nEntries && entries[gLast].geometry == g; gLast++);
+		rebuilt[g - scene->geometry] = true;
+		poolBefore += (sizeof(vec3) + sizeof(Vertex)) * g->vertex_capacity + sizeof(unsigned int) * g->index_capacity;
+		pool.n_vertex = pool.n_index = 0;
+
+		// Live ranges first, copied as they are
+		unsigned int nLive = 0;
+		for (unsigned int i = 0; i < scene->n_instance_sets; i++) {
+			const Part* p = scene->instance_sets[i]->part;
+			if (scene->instance_sets[i]->geometry != g || !p) continue;
+			bool seen = false;
+			for (unsigned int l = 0; l < nLive && !seen; l++)
+				seen = live[2 * l].base_vertex == p->base_vertex && live[2 * l].base_index == p->base_index;
+			if (seen) continue;
+			live[2 * nLive] = *p;
+			live[2 * nLive + 1] = (Part) { .n_index = p->n_index, .base_index = pool.n_index, .base_vertex = pool.n_vertex };
+			static_pool_append(&pool, g, p, 0);
+			nLive++;
+		}
+
+		// Then one part per material and tint, each source pre-transformed by its node
+		unsigned int firstBatch = nBatched;
+		for (unsigned int first = gFirst, last; first < gLast; first = last) {
+			for (last = first + 1; last < gLast && !static_compare(&entries[first], &entries[last]); last++);
+			if (g->n_parts + (nBatched - firstBatch) == PART_MAX) {
+				plogf(LL_WARN, "Geometry parts full, static batch dropped\n");
+				continue;
+			}
+			size_t baseVertex = pool.n_vertex, baseIndex = pool.n_index;
+			for (unsigned int e = first; e < last; e++) {
+				size_t v0 = pool.n_vertex;
+				static_pool_append(&pool, g, entries[e].part, (unsigned int)(v0 - baseVertex));
+				Transform t;
+				transform_write(entries[e].node, &t);
+				mat3 model, normal;
+				glm_mat4_pick3(t.model, model);
+				for (unsigned int c = 0; c < 3; c++) glm_vec3_copy(t.normal[c], normal[c]);
+				// Mirrored transforms flip the tangent frame handedness
+				float handedness = glm_mat3_det(model) < 0.0f ? -1.0f : 1.0f;
+				for (size_t v = v0; v < pool.n_vertex; v++) {
+					glm_mat4_mulv3(t.model, pool.positions[v], 1.0f, pool.positions[v]);
+					glm_mat3_mulv(normal, pool.vertices[v].normal, pool.vertices[v].normal);
+					glm_vec3_normalize(pool.vertices[v].normal);
+					glm_mat3_mulv(model, pool.vertices[v].tangent, pool.vertices[v].tangent);
+					glm_vec3_normalize(pool.vertices[v].tangent);
+					pool.vertices[v].sign *= handedness;
+				}
 			}
-			glNamedBufferSubData(scene->material_buffer, i * 32, 8, &mat->diffuse->handle);
+			// Parts are only added once the old ones are remapped, the node keeps the range until then
+			Node* node = node_new(1, 0);
+			glm_mat4_identity(node->transform);
+			node->geometry = g;
+			node->tint = entries[first].instance.tint;
+			Part* range = malloc(sizeof(Part));
+			*range = (Part) { .n_index = (unsigned int)(pool.n_index - baseIndex), .base_index = (unsigned int)baseIndex,
+				.base_vertex = (unsigned int)baseVertex, .material = entries[first].instance.material };
+			bounds_sphere((const vec3*)(pool.positions + baseVertex), (unsigned int)(pool.n_vertex - baseVertex), range->bounds);
+			node_parts(node)[0] = range;
+			batched[nBatched++] = node;
 		}
-		if (mat->specular && mat->specular->texture) {
-			if (!mat->specular->handle) {
-				mat->specular->handle = glGetTextureHandleARB(mat->specular->texture);
-				glMakeTextureHandleResidentARB(mat->specular->handle);
+
+		// Parts outside the live ranges only belonged to the batched nodes, they draw nothing from here on
+		for (unsigned int i = 0; i < g->n_parts; i++) {
+			Part* p = &g->parts[i];
+			bool found = false;
+			for (unsigned int l = 0; l < nLive && !found; l++) {
+				if (live[2 * l].base_vertex != p->base_vertex || live[2 * l].base_index != p->base_index) continue;
+				p->base_vertex = live[2 * l + 1].base_vertex;
+				p->base_index = live[2 * l + 1].base_index;
+				found = true;
 			}
-			glNamedBufferSubData(scene->material_buffer, i * 32 + 8, 8, &mat->specular->handle);
+			if (!found) p->n_index = p->base_index = p->base_vertex = 0;
 		}
-		if (mat->normal && mat->normal->texture) {
-			if (!mat->normal->handle) {
-				mat->normal->handle = glGetTextureHandleARB(mat->normal->texture);
-				glMakeTextureHandleResidentARB(mat->normal->handle);
+		unsigned int nMeshes = 0;
+		for (unsigned int i = 0; i < g->n_meshes; i++) {
+			MeshRange m = g->meshes[i];
+			for (unsigned int l = 0; l < nLive; l++) {
+				if (live[2 * l].base_vertex != m.base_vertex || live[2 * l].base_index != m.base_index) continue;
+				m.base_vertex = live[2 * l + 1].base_vertex;
+				m.base_index = live[2 * l + 1].base_index;
+				g->meshes[nMeshes++] = m;
+				break;
 			}
-			glNamedBufferSubData(scene->material_buffer, i * 32 + 16, 8, &mat->normal->handle);
 		}
-		glNamedBufferSubData(scene->material_buffer, i * 32 + 24, sizeof(float), &mat->shininess);
+		g->n_meshes = nMeshes;
+		for (unsigned int i = firstBatch; i < nBatched; i++) {
+			Part* range = node_parts(batched[i])[0];
+			g->parts[g->n_parts] = *range;
+			node_parts(batched[i])[0] = &g->parts[g->n_parts++];
+			free(range);
+		}
+
+		// Exactly sized pool in place of the old one
+		GLuint buffers[3];
+		glCreateBuffers(3, buffers);
+		glNamedBufferData(buffers[0], sizeof(vec3) * pool.n_vertex, pool.positions, GL_STATIC_DRAW);
+		glNamedBufferData(buffers[1], sizeof(Vertex) * pool.n_vertex, pool.vertices, GL_STATIC_DRAW);
+		glNamedBufferData(buffers[2], sizeof(unsigned int) * pool.n_index, pool.indices, GL_STATIC_DRAW);
+		glDeleteBuffers(1, &g->position_buffer);
+		glDeleteBuffers(1, &g->vertex_buffer);
+		glDeleteBuffers(1, &g->element_buffer);
+		g->position_buffer = buffers[0];
+		g->vertex_buffer = buffers[1];
+		g->element_buffer = buffers[2];
+		g->n_vertices = g->vertex_capacity = (unsigned int)pool.n_vertex;
+		g->n_indices = g->index_capacity = (unsigned int)pool.n_index;
+		glVertexArrayVertexBuffer(g->vertex_array, BINDING_POSITION, g->position_buffer, 0, sizeof(vec3));
+		glVertexArrayVertexBuffer(g->vertex_array, BINDING_ATTRIBUTES, g->vertex_buffer, 0, sizeof(Vertex));
+		glVertexArrayVertexBuffer(g->depth_array, BINDING_POSITION, g->position_buffer, 0, sizeof(vec3));
+		glVertexArrayElementBuffer(g->vertex_array, g->element_buffer);
+		glVertexArrayElementBuffer(g->depth_array, g->element_buffer);
+		poolAfter += (sizeof(vec3) + sizeof(Vertex)) * pool.n_vertex + sizeof(unsigned int) * pool.n_index;
+	}
+	free(pool.positions);
+	free(pool.vertices);
+	free(pool.indices);
+	free(live);
+	free(entries);
+
+	// Later loads go straight to the pools
+	scene->static_batch = false;
+	for (unsigned int i = 0; i < GEOMETRY_MAX; i++) {
+		Geometry* g = &scene->geometry[i];
+		free(g->cpu_positions);
+		free(g->cpu_vertices);
+		free(g->cpu_indices);
+		g->cpu_positions = NULL;
+		g->cpu_vertices = NULL;
+		g->cpu_indices = NULL;
+	}
+	// Registered models point at dropped ranges, loading them again imports them again
+	for (unsigned int i = 0; i < scene->n_models;) {
+		Model* m = &scene->models[i];
+		if (!rebuilt[m->geometry]) {
+			i++;
+			continue;
+		}
+		node_delete(&m->root);
+		free(m->path);
+		*m = scene->models[--scene->n_models];
+	}
+
+	for (unsigned int i = 0; i < scene->n_nodes; i++) node_delete(&scene->nodes[i]);
+	scene->n_nodes = 0;
+	for (unsigned int i = 0; i < nBatched; i++) *scene_add_node(scene) = batched[i];
+	free(batched);
+	plogf(LL_INFO, "Static batching: %u nodes with %u parts into %u batches, geometry pools %.2f MiB -> %.2f MiB in %.3fms\n",
+		nodesBefore, nEntries, nBatched, poolBefore / 1048576.0, poolAfter / 1048576.0, (plog_time() - start) * 1000.0);
+}
+
+// Copy one range from the CPU copy of g to the end of the pool. Indices stay relative to the part's
+// first vertex plus bias, which is where the range starts within a merged part
+static void static_pool_append(StaticPool* pool, const Geometry* g, const Part* p, unsigned int bias) {
+	if (pool->n_index + p->n_index > pool->index_capacity) {
+		pool->index_capacity = MAX(pool->n_index + p->n_index, pool->index_capacity * 2);
+		pool->indices = realloc(pool->indices, sizeof(unsigned int) * pool->index_capacity);
+	}
+	// Indices are relative to base_vertex, the highest one bounds the vertex range
+	unsigned int used = 0;
+	for (unsigned int k = 0; k < p->n_index; k++) {
+		unsigned int index = g->cpu_indices[p->base_index + k];
+		used = MAX(used, index + 1);
+		pool->indices[pool->n_index + k] = index + bias;
+	}
+	if (pool->n_vertex + used > pool->vertex_capacity) {
+		pool->vertex_capacity = MAX(pool->n_vertex + used, pool->vertex_capacity * 2);
+		pool->positions = realloc(pool->positions, sizeof(vec3) * pool->vertex_capacity);
+		pool->vertices = realloc(pool->vertices, sizeof(Vertex) * pool->vertex_capacity);
+	}
+	memcpy(pool->positions + pool->n_vertex, g->cpu_positions + p->base_vertex, sizeof(vec3) * used);
+	memcpy(pool->vertices + pool->n_vertex, g->cpu_vertices + p->base_vertex, sizeof(Vertex) * used);
+	pool->n_vertex += used;
+	pool->n_index += p->n_index;
+}
+
+static const char* transformModeNames[] = { "texture mat4", "affine 3x4", "quaternion" };
+static const size_t transformModeSizes[] = { sizeof(Transform), sizeof(vec4) * 3, sizeof(vec4) * 2 };
+
+// Pack the CPU transforms into the layout of transform_mode with one mapped write
+void scene_upload_transforms(Scene* scene) {
+	double start = plog_time();
+	if (scene->transform_mode == TRANSFORM_QUAT) {
+		vec4 packed[2];
+		for (unsigned int i = 0; i < scene->n_transforms; i++) {
+			if (!transform_pack_quat(&scene->transforms[i], packed)) {
+				plogf(LL_WARN, "Transform %u has shear or non-uniform scale, using affine transforms\n", i);
+				scene->transform_mode = TRANSFORM_AFFINE;
+				break;
+			}
+		}
+	}
+	if (scene->transform_mode != scene->transform_gpu_mode || scene->n_transforms > scene->transform_gpu_capacity) {
+		transform_release_gpu(scene);
+		scene->transform_gpu_mode = scene->transform_mode;
+		transform_reserve_gpu(scene, MAX(scene->n_transforms, scene->transform_capacity));
+	}
+	if (!scene->n_transforms) return;
+
+	size_t size = transformModeSizes[scene->transform_mode] * scene->n_transforms;
+	transform_upload_range(scene, 0, scene->n_transforms);
+	plogf(LL_INFO, "Uploaded %u transforms (%s, %.2f MiB) in %.3fms\n", scene->n_transforms,
+		transformModeNames[scene->transform_mode], size / 1048576.0, (plog_time() - start) * 1000.0);
+}
+
+// Pack transforms [first, first + count) into the mapped GPU range, GPU storage must already fit them
+static void transform_upload_range(Scene* scene, unsigned int first, unsigned int count) {
+	size_t stride = transformModeSizes[scene->transform_mode];
+	GLbitfield access = GL_MAP_WRITE_BIT | (first || count < scene->n_transforms ? GL_MAP_INVALIDATE_RANGE_BIT : GL_MAP_INVALIDATE_BUFFER_BIT);
+	void* map = glMapNamedBufferRange(scene->transform_buffer, stride * first, stride * count, access);
+	if (!map) {
+		plogf(LL_ERROR, "Mapping transform buffer failed\n");
+		return;
+	}
+	const Transform* transforms = scene->transforms + first;
+	if (scene->transform_mode == TRANSFORM_TEXTURE) {
+		memcpy(map, transforms, stride * count);
+	} else if (scene->transform_mode == TRANSFORM_AFFINE) {
+		vec4* rows = map;
+		for (unsigned int i = 0; i < count; i++) {
+			const float (*m)[4] = transforms[i].model;
+			for (unsigned int r = 0; r < 3; r++)
+				glm_vec4_copy((vec4){ m[0][r], m[1][r], m[2][r], m[3][r] }, rows[i * 3 + r]);
+		}
+	} else {
+		vec4* packed = map;
+		for (unsigned int i = 0; i < count; i++)
+			transform_pack_quat(&transforms[i], &packed[i * 2]);
+	}
+	glUnmapNamedBuffer(scene->transform_buffer);
+	glNamedBufferSubData(scene->instance_buffer, sizeof(InstanceData) * first, sizeof(InstanceData) * count, scene->instance_data + first);
+}
+
+void scene_reserve_instances(Scene* scene, InstanceSet* set, unsigned int capacity) {
+	if (capacity <= set->capacity) return;
+	set->transforms = realloc(set->transforms, sizeof(mat4) * capacity);
+	set->dense_handle = realloc(set->dense_handle, sizeof(unsigned int) * capacity);
+	set->handle_dense = realloc(set->handle_dense, sizeof(unsigned int) * capacity);
+	set->generations = realloc(set->generations, sizeof(unsigned int) * capacity);
+	set->capacity = capacity;
+	// The build reserved fewer slots, the transform range has to move
+	if (set->built) scene->instances_rebuild = true;
+}
+
+static void instance_mark_dirty(Scene* scene, InstanceSet* set, unsigned int dense) {
+	if (!set->built) return;
+	unsigned int slot = set->base_transform + dense;
+	if (scene->dirty_first == scene->dirty_end) {
+		scene->dirty_first = slot;
+		scene->dirty_end = slot + 1;
+	} else {
+		scene->dirty_first = MIN(scene->dirty_first, slot);
+		scene->dirty_end = MAX(scene->dirty_end, slot + 1);
+	}
+}
+
+// Write the world transform of dense slot into the scene arrays when the set is placed
+static void instance_write(Scene* scene, InstanceSet* set, unsigned int dense) {
+	if (!set->built || scene->instances_rebuild) return;
+	unsigned int slot = set->base_transform + dense;
+	transform_write_matrix(set->transform, set->transforms[dense], &scene->transforms[slot]);
+	scene->instance_data[slot] = (InstanceData) { set->material != MATERIAL_NONE ? set->material : set->part->material, set->tint };
+	if (scene->transform_mode == TRANSFORM_QUAT) {
+		vec4 packed[2];
+		if (!transform_pack_quat(&scene->transforms[slot], packed)) {
+			plogf(LL_WARN, "Instance transform has shear or non-uniform scale, using affine transforms\n");
+			scene->transform_mode = TRANSFORM_AFFINE;
+			scene->instances_rebuild = true;
+		}
+	}
+	instance_mark_dirty(scene, set, dense);
+}
+
+// Append to the dense array, O(1) unless the set outgrows its reserved slots
+InstanceHandle scene_instance_add(Scene* scene, InstanceSet* set, mat4 transform) {
+	if (set->n_instances == set->capacity)
+		scene_reserve_instances(scene, set, MAX(set->capacity * 2, 16));
+	unsigned int handle = set->free_handle;
+	if (handle != HANDLE_NONE) {
+		set->free_handle = set->handle_dense[handle];
+	} else {
+		handle = set->n_handles++;
+		set->generations[handle] = 0;
+	}
+	unsigned int dense = set->n_instances++;
+	set->handle_dense[handle] = dense;
+	set->dense_handle[dense] = handle;
+	glm_mat4_copy(transform, set->transforms[dense]);
+	instance_write(scene, set, dense);
+	set->command_dirty = true;
+	return (InstanceHandle) { handle, set->generations[handle] };
+}
+
+// Swap the last instance into the removed slot so the range stays dense
+bool scene_instance_remove(Scene* scene, InstanceSet* set, InstanceHandle handle) {
+	if (handle.slot >= set->n_handles || set->generations[handle.slot] != handle.generation) return false;
+	unsigned int dense = set->handle_dense[handle.slot];
+	unsigned int last = --set->n_instances;
+	if (dense != last) {
+		unsigned int moved = set->dense_handle[last];
+		glm_mat4_copy(set->transforms[last], set->transforms[dense]);
+		set->dense_handle[dense] = moved;
+		set->handle_dense[moved] = dense;
+		if (set->built && !scene->instances_rebuild) {
+			unsigned int base = set->base_transform;
+			scene->transforms[base + dense] = scene->transforms[base + last];
+			scene->instance_data[base + dense] = scene->instance_data[base + last];
+			instance_mark_dirty(scene, set, dense);
+		}
+	}
+	set->generations[handle.slot]++;
+	set->handle_dense[handle.slot] = set->free_handle;
+	set->free_handle = handle.slot;
+	set->command_dirty = true;
+	return true;
+}
+
+bool scene_instance_transform(Scene* scene, InstanceSet* set, InstanceHandle handle, mat4 transform) {
+	if (handle.slot >= set->n_handles || set->generations[handle.slot] != handle.generation) return false;
+	unsigned int dense = set->handle_dense[handle.slot];
+	glm_mat4_copy(transform, set->transforms[dense]);
+	instance_write(scene, set, dense);
+	return true;
+}
+
+// Once per frame: one ranged transform upload covering every edit and one write per changed command.
+// Returns true when the cache had to be rebuilt, transform storage may have moved
+bool scene_flush_instances(Scene* scene) {
+	if (scene->instances_rebuild) {
+		plogf(LL_INFO, "Instance set outgrew its reserved transforms, rebuilding cache\n");
+		scene_build_cache(scene);
+		return true;
+	}
+	if (scene->dirty_end > scene->dirty_first) {
+		transform_upload_range(scene, scene->dirty_first, scene->dirty_end - scene->dirty_first);
+		scene->revision++;
 	}
+	scene->dirty_first = scene->dirty_end = 0;
+	for (unsigned int i = 0; i < scene->n_instance_sets; i++) {
+		InstanceSet* set = scene->instance_sets[i];
+		if (!set->built || !set->command_dirty) continue;
+		CacheObject* cached = &scene->cache[set->cache_index];
+		glNamedBufferSubData(cached->indirect_buffer, sizeof(DrawIndirectCommand) * set->command_index + offsetof(DrawIndirectCommand, n_instance),
+			sizeof(unsigned int), &set->n_instances);
+		glNamedBufferSubData(scene->cull_buffer, sizeof(CullCommand) * (cached->command_base + set->command_index) + offsetof(CullCommand, count),
+			sizeof(unsigned int), &set->n_instances);
+		set->command_dirty = false;
+		scene->revision++;
+	}
+	return false;
 }
 
+// Same arithmetic as generateInstance and fetchInstanceAt so CPU passes see what the vertex shader draws
+void scene_generate_instance(const InstanceSet* set, unsigned int id, mat4 local) {
+	vec3 offset = { 0.0f, 0.0f, 0.0f };
+	float yaw = 0.0f, scale = 1.0f;
+	if (set->pattern == PATTERN_GRID) {
+		unsigned int columns = MAX((unsigned int)set->params[0], 1);
+		glm_vec3_copy((vec3){ (id % columns) * set->params[1], 0.0f, (id / columns) * set->params[2] }, offset);
+	} else if (set->pattern == PATTERN_RING) {
+		float angle = 6.28318530718f * id / set->n_instances;
+		glm_vec3_copy((vec3){ cosf(angle) * set->params[0], 0.0f, sinf(angle) * set->params[0] }, offset);
+		yaw = -angle + (hash_float(id) - 0.5f) * set->params[1];
+	} else if (set->pattern == PATTERN_SCATTER) {
+		uint32_t seed;
+		memcpy(&seed, &set->params[3], sizeof(seed));
+		seed += id * 4;
+		float r = set->params[0] * sqrtf(hash_float(seed));
+		float angle = 6.28318530718f * hash_float(seed + 1);
+		glm_vec3_copy((vec3){ cosf(angle) * r, 0.0f, sinf(angle) * r }, offset);
+		yaw = 6.28318530718f * hash_float(seed + 2);
+		scale = glm_lerp(set->params[1], set->params[2], hash_float(seed + 3));
+	}
+	float c = cosf(yaw) * scale, s = sinf(yaw) * scale;
+	glm_mat4_identity(local);
+	local[0][0] = c; local[0][2] = -s;
+	local[1][1] = scale;
+	local[2][0] = s; local[2][2] = c;
+	glm_vec3_copy(offset, local[3]);
+}
+
+// hashFloat in transform.glsl
+static float hash_float(uint32_t x) {
+	x ^= x >> 16;
+	x *= 0x7feb352du;
+	x ^= x >> 15;
+	x *= 0x846ca68bu;
+	x ^= x >> 16;
+	return (float)x / 4294967295.0f;
+}
+
+// Upload the per draw data of one cache object, then its instance set commands again so they can be
+// drawn without the node commands before them. Returns the next aligned offset
+static size_t scene_write_draws(Scene* scene, CacheObject* cached, const DrawData* draws, size_t offset) {
+	size_t alignment = MAX(scene->draw_alignment, 1);
+	cached->draw_offset = offset;
+	size_t size = sizeof(DrawData) * cached->n_commands;
+	glNamedBufferSubData(scene->draw_buffer, offset, size, draws);
+	offset = (offset + size + alignment - 1) / alignment * alignment;
+	cached->set_draw_offset = offset;
+	if (cached->n_static == cached->n_commands) return offset;
+	size = sizeof(DrawData) * (cached->n_commands - cached->n_static);
+	glNamedBufferSubData(scene->draw_buffer, offset, size, draws + cached->n_static);
+	return (offset + size + alignment - 1) / alignment * alignment;
+}
+
+// Opaque cache objects, masked ones follow with scene_render_masks and scene_render_masked
 void scene_render(Scene* scene) {
+	if (scene->vertex_pulling) {
+		scene_render_pulled(scene);
+		return;
+	}
+	for (unsigned int i = 0; i < scene->n_cache; i++) {
+		CacheObject* cached = &scene->cache[i];
+		if (cached->queue != QUEUE_OPAQUE) continue;
+		scene_depth_state(scene, cached->geometry);
+		scene_render_object(scene, cached, cached->geometry->vertex_array);
+	}
+	scene_depth_state(scene, NULL);
+}
+
+// Same commands through one empty vertex array, pull.vert reads the streams from SSBOs by gl_VertexID.
+// Indices still go through the element buffer so the post transform cache keeps working
+static void scene_render_pulled(Scene* scene) {
+	for (unsigned int i = 0; i < scene->n_cache; i++) {
+		CacheObject* cached = &scene->cache[i];
+		if (cached->queue != QUEUE_OPAQUE) continue;
+		scene_depth_state(scene, cached->geometry);
+		scene_render_pulled_object(scene, cached);
+	}
+	scene_depth_state(scene, NULL);
+}
+
+static void scene_render_pulled_object(Scene* scene, CacheObject* cached) {
+	Geometry* g = cached->geometry;
+	glBindVertexArray(scene->pull_array);
+	glBindBufferRange(GL_SHADER_STORAGE_BUFFER, SSBO_DRAW, scene->draw_buffer, cached->draw_offset, sizeof(DrawData) * cached->n_commands);
+	glVertexArrayElementBuffer(scene->pull_array, g->element_buffer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, SSBO_POSITION, g->position_buffer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, SSBO_ATTRIBUTE, g->vertex_buffer);
+	glBindBuffer(GL_DRAW_INDIRECT_BUFFER, cached->indirect_buffer);
+	glMultiDrawElementsIndirect(g->primitive, GL_UNSIGNED_INT, 0, cached->n_commands, 0);
+}
+
+static void scene_render_object(Scene* scene, CacheObject* cached, unsigned int vertexArray) {
+	glBindBufferRange(GL_SHADER_STORAGE_BUFFER, SSBO_DRAW, scene->draw_buffer, cached->draw_offset, sizeof(DrawData) * cached->n_commands);
+	glBindVertexArray(vertexArray);
+	glBindBuffer(GL_DRAW_INDIRECT_BUFFER, cached->indirect_buffer);
+	glMultiDrawElementsIndirect(cached->geometry->primitive, GL_UNSIGNED_INT, 0, cached->n_commands, 0);
+}
+
+// Masked cache objects under the normal depth test. With the masking program and color writes off this
+// lays their alpha tested depth, the discard only runs here and scene_render_masked shades what it kept
+void scene_render_masks(Scene* scene) {
+	for (unsigned int i = 0; i < scene->n_cache; i++) {
+		CacheObject* cached = &scene->cache[i];
+		if (cached->queue == QUEUE_MASKED) scene_render_object(scene, cached, cached->geometry->vertex_array);
+	}
+}
+
+// Masked cache objects over the depth laid by scene_render_masks, depthOnly draws through the position arrays
+void scene_render_masked(Scene* scene, bool depthOnly) {
+	glDepthFunc(GL_EQUAL);
+	glDepthMask(GL_FALSE);
+	for (unsigned int i = 0; i < scene->n_cache; i++) {
+		CacheObject* cached = &scene->cache[i];
+		if (cached->queue != QUEUE_MASKED) continue;
+		if (depthOnly) scene_render_object(scene, cached, cached->geometry->depth_array);
+		else if (scene->vertex_pulling) scene_render_pulled_object(scene, cached);
+		else scene_render_object(scene, cached, cached->geometry->vertex_array);
+	}
+	glDepthFunc(GL_LEQUAL);
+	glDepthMask(GL_TRUE);
+}
+
+// Visibility IDs get as many triangle bits as the largest command needs, the rest address instances
+static void scene_upload_visibility(Scene* scene, const unsigned int* table, unsigned int count, unsigned int maxTriangles) {
+	unsigned int shift = 1;
+	while (shift < 31 && (1u << shift) < maxTriangles) shift++;
+	bool fits = (unsigned long long)count << shift <= 0xFFFFFFFFULL && scene->n_cache <= 1u << (32 - VISIBILITY_COMMAND_BITS);
+	scene->visibility_shift = fits ? shift : 0;
+	scene->n_visibility = count;
+	if (!fits) {
+		plogf(LL_WARN, "Visibility IDs need %u instance and %u triangle bits, visibility buffer unavailable\n", count, shift);
+		return;
+	}
+	if (count > scene->visibility_capacity) {
+		scene->visibility_capacity = MAX(count, scene->visibility_capacity * 2);
+		scene->visibility_table = buffer_grow(scene->visibility_table, 0, sizeof(unsigned int) * scene->visibility_capacity);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, SSBO_VISIBILITY, scene->visibility_table);
+	}
+	if (count) glNamedBufferSubData(scene->visibility_table, 0, sizeof(unsigned int) * count, table);
+	plogf(LL_INFO, "Visibility table: %u instances, %u triangle bits\n", count, shift);
+}
+
+// Shade a visibility buffer once per cache object, every pass only keeps the pixels its geometry covered.
+// The cache index reaches resolve.vert as gl_BaseInstance, the program and targets must be bound
+void scene_resolve_visibility(Scene* scene) {
+	glBindVertexArray(scene->pull_array);
+	for (unsigned int i = 0; i < scene->n_cache; i++) {
+		CacheObject* cached = &scene->cache[i];
+		if (cached->queue == QUEUE_TRANSPARENT) continue;
+		Geometry* g = cached->geometry;
+		glBindBufferRange(GL_SHADER_STORAGE_BUFFER, SSBO_DRAW, scene->draw_buffer, cached->draw_offset, sizeof(DrawData) * cached->n_commands);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, SSBO_POSITION, g->position_buffer);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, SSBO_ATTRIBUTE, g->vertex_buffer);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, SSBO_INDEX, g->element_buffer);
+		glDrawArraysInstancedBaseInstance(GL_TRIANGLES, 0, 3, 1, i);
+	}
+	glBindVertexArray(0);
+}
+
+// Opaque commands through the position only vertex arrays, for depth only programs
+void scene_render_depth(Scene* scene) {
+	for (unsigned int i = 0; i < scene->n_cache; i++) {
+		CacheObject* cached = &scene->cache[i];
+		if (cached->queue == QUEUE_OPAQUE) scene_render_object(scene, cached, cached->geometry->depth_array);
+	}
+}
+
+static bool geometry_prepass(const Geometry* g) {
+	return g->prepass == PREPASS_ALWAYS || (g->prepass == PREPASS_AUTO && g->overdraw > PREPASS_OVERDRAW);
+}
+
+// Lay depth for the geometry that wants a prepass, expects a depth only program.
+// The following scene_render shades that geometry with GL_EQUAL and no depth writes
+void scene_render_prepass(Scene* scene) {
+	glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
 	for (unsigned int i = 0; i < scene->n_cache; i++) {
 		CacheObject* cached = &scene->cache[i];
-		glBindVertexArray(cached->geometry->vertex_array);
-		glBindBuffer(GL_DRAW_INDIRECT_BUFFER, cached->geometry->indirect_buffer);
-		glMultiDrawElementsIndirect(cached->geometry->primitive, GL_UNSIGNED_INT, 0, cached->n_commands, 0);
+		if (cached->queue != QUEUE_OPAQUE || !geometry_prepass(cached->geometry)) continue;
+		scene_render_object(scene, cached, cached->geometry->depth_array);
+		scene->prepass_done = true;
+	}
+	glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+}
+
+// Depth test for one geometry of the pass after a prepass, NULL restores the defaults and ends it
+static void scene_depth_state(Scene* scene, const Geometry* g) {
+	if (!scene->prepass_done) return;
+	bool equal = g && geometry_prepass(g);
+	glDepthFunc(equal ? GL_EQUAL : GL_LEQUAL);
+	glDepthMask(equal ? GL_FALSE : GL_TRUE);
+	if (!g) scene->prepass_done = false;
+}
+
+// Samples each opaque cache object passes in draw order against those still visible once the whole depth
+// buffer is laid, the ratio decides PREPASS_AUTO. Only issues the queries, scene_poll_overdraw applies the
+// results. Expects a depth only program, returns false while the previous measurement is still in flight
+bool scene_measure_overdraw(Scene* scene) {
+	if (scene->overdraw_pending) return false;
+	scene->n_overdraw = 0;
+	for (unsigned int i = 0; i < scene->n_cache; i++)
+		if (scene->cache[i].queue == QUEUE_OPAQUE) scene->overdraw_geometry[scene->n_overdraw++] = scene->cache[i].geometry;
+	if (!scene->n_overdraw) return true;
+	glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+	glClear(GL_DEPTH_BUFFER_BIT);
+	for (unsigned int pass = 0; pass < 2; pass++) {
+		glDepthFunc(pass ? GL_EQUAL : GL_LEQUAL);
+		for (unsigned int i = 0, q = 0; i < scene->n_cache; i++) {
+			CacheObject* cached = &scene->cache[i];
+			if (cached->queue != QUEUE_OPAQUE) continue;
+			glBeginQuery(GL_SAMPLES_PASSED, scene->overdraw_queries[pass][q++]);
+			scene_render_object(scene, cached, cached->geometry->depth_array);
+			glEndQuery(GL_SAMPLES_PASSED);
+		}
+	}
+	glDepthFunc(GL_LEQUAL);
+	glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+	glClear(GL_DEPTH_BUFFER_BIT);
+	scene->overdraw_pending = true;
+	return true;
+}
+
+// Apply the last measurement once the GPU has finished it, never waits
+void scene_poll_overdraw(Scene* scene) {
+	if (!scene->overdraw_pending) return;
+	// Queries finish in order, the last equal pass query is the last to become available
+	int available = 0;
+	glGetQueryObjectiv(scene->overdraw_queries[1][scene->n_overdraw - 1], GL_QUERY_RESULT_AVAILABLE, &available);
+	if (!available) return;
+	for (unsigned int i = 0; i < scene->n_overdraw; i++) {
+		Geometry* g = scene->overdraw_geometry[i];
+		unsigned int shaded = 0, visible = 0;
+		glGetQueryObjectuiv(scene->overdraw_queries[0][i], GL_QUERY_RESULT, &shaded);
+		glGetQueryObjectuiv(scene->overdraw_queries[1][i], GL_QUERY_RESULT, &visible);
+		g->overdraw = visible ? (float)shaded / visible : 0.0f;
+		plogf(LL_INFO, "Geometry %u: %u samples shaded, %u visible, overdraw %.2f, prepass %s\n",
+			(unsigned int)(g - scene->geometry), shaded, visible, g->overdraw, geometry_prepass(g) ? "on" : "off");
+	}
+	scene->overdraw_pending = false;
+}
+
+// Frustum cull every instance of every command into one region of the output, expects the cull program
+// and the region's CullView bound. Ordered views then place each command's survivors bucket by bucket
+// with orderProgram, which is left bound. The output is ready to draw on return
+void scene_cull(Scene* scene, const CullOutput* output, unsigned int region, unsigned int orderProgram) {
+	if (!scene->n_commands) return;
+	size_t size = sizeof(DrawIndirectCommand) * scene->n_commands;
+	// Survivors are counted into copies of the templates
+	for (unsigned int b = 0; b < output->buckets; b++)
+		glCopyNamedBufferSubData(scene->cull_template, output->commands, 0, size * (region * output->buckets + b), size);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, SSBO_CULL_COMMAND, output->commands);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, SSBO_CULL_INSTANCE, output->instances);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, SSBO_CULL_RANK, output->ranks);
+	unsigned int groups = (scene->n_cull_slots + CULL_THREADS - 1) / CULL_THREADS;
+	glDispatchCompute(MIN(groups, 65535), (groups + 65534) / 65535, 1);
+	if (output->buckets > 1) {
+		glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+		glUseProgram(orderProgram);
+		glDispatchCompute(MIN(groups, 65535), (groups + 65534) / 65535, 1);
+	}
+	glMemoryBarrier(GL_COMMAND_BARRIER_BIT | GL_SHADER_STORAGE_BARRIER_BIT);
+}
+
+// Draw the cache objects of one queue from a region written by scene_cull nearest bucket first, the program
+// reads the instance of each survivor from the output at gl_BaseInstance + gl_InstanceID. depthOnly opaque
+// draws go through the position arrays, masked ones always need their uvs for the alpha test
+void scene_render_culled(Scene* scene, const CullOutput* output, unsigned int region, enum RENDER_QUEUE queue, enum COMMAND_RANGE range, bool depthOnly) {
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, SSBO_CULL_INSTANCE, output->instances);
+	glBindBuffer(GL_DRAW_INDIRECT_BUFFER, output->commands);
+	for (unsigned int b = 0; b < output->buckets; b++) {
+		for (unsigned int i = 0; i < scene->n_cache; i++) {
+			CacheObject* cached = &scene->cache[i];
+			if (cached->queue != queue) continue;
+			unsigned int first = range == COMMANDS_SETS ? cached->n_static : 0;
+			unsigned int count = range == COMMANDS_NODES ? cached->n_static : cached->n_commands - first;
+			if (!count) continue;
+			size_t offset = sizeof(DrawIndirectCommand) * ((size_t)(region * output->buckets + b) * scene->n_commands + cached->command_base + first);
+			glBindBufferRange(GL_SHADER_STORAGE_BUFFER, SSBO_DRAW, scene->draw_buffer, first ? cached->set_draw_offset : cached->draw_offset, sizeof(DrawData) * count);
+			glBindVertexArray(depthOnly && queue == QUEUE_OPAQUE ? cached->geometry->depth_array : cached->geometry->vertex_array);
+			glMultiDrawElementsIndirect(cached->geometry->primitive, GL_UNSIGNED_INT, (const void*)offset, count, 0);
+		}
+	}
+}
+
+// Unordered cull of everything inside the view
+void cull_view_init(CullView* view, const Scene* scene, mat4 viewProjection, unsigned int region) {
+	*view = (CullView) { .region = region, .n_commands = scene->n_commands, .n_slots = scene->n_cull_slots, .buckets = 1 };
+	glm_mat4_copy(viewProjection, view->view_projection);
+	glm_frustum_planes(viewProjection, view->planes);
+}
+
+// Order by view depth from a camera, buckets are spaced logarithmically between its planes like the light clusters
+void cull_view_order(CullView* view, vec3 position, vec3 front, float zNear, float zFar, unsigned int buckets) {
+	glm_vec4(front, -glm_vec3_dot(front, position), view->depth_plane);
+	view->buckets = MAX(MIN(buckets, CULL_BUCKETS), 1);
+	view->bucket_scale = view->buckets / logf(zFar / zNear);
+	view->bucket_bias = -logf(zNear) * view->bucket_scale;
+}
+
+// Sized for the current cache, returns true when the buffers were recreated and earlier output is gone
+bool cull_output_reserve(CullOutput* output, const Scene* scene, unsigned int regions, unsigned int buckets) {
+	bool commands = scene->n_commands > output->command_capacity || regions != output->regions || buckets != output->buckets;
+	bool slots = scene->n_cull_slots > output->slot_capacity || regions != output->regions || (buckets > 1) != (output->ranks != 0);
+	output->regions = regions;
+	output->buckets = buckets;
+	if (commands) {
+		if (scene->n_commands > output->command_capacity) output->command_capacity = MAX(scene->n_commands, output->command_capacity * 2);
+		glDeleteBuffers(1, &output->commands);
+		glCreateBuffers(1, &output->commands);
+		glNamedBufferData(output->commands, sizeof(DrawIndirectCommand) * output->command_capacity * regions * buckets, NULL, GL_DYNAMIC_COPY);
 	}
+	if (slots) {
+		if (scene->n_cull_slots > output->slot_capacity) output->slot_capacity = MAX(scene->n_cull_slots, output->slot_capacity * 2);
+		size_t size = sizeof(unsigned int) * (size_t)MAX(output->slot_capacity, 1) * regions;
+		glDeleteBuffers(1, &output->instances);
+		glCreateBuffers(1, &output->instances);
+		glNamedBufferData(output->instances, size, NULL, GL_DYNAMIC_COPY);
+		glDeleteBuffers(1, &output->ranks);
+		output->ranks = 0;
+		if (buckets > 1) {
+			glCreateBuffers(1, &output->ranks);
+			glNamedBufferData(output->ranks, size, NULL, GL_DYNAMIC_COPY);
+		}
+	}
+	return commands || slots;
+}
+
+void cull_output_destroy(CullOutput* output) {
+	glDeleteBuffers(1, &output->commands);
+	glDeleteBuffers(1, &output->instances);
+	glDeleteBuffers(1, &output->ranks);
+	*output = (CullOutput) { 0 };
+}
+
+// Read back the mip levels requested by default.frag in the last completed frame
+// and stream in finer levels, the readback is only issued once the previous one landed
+void scene_stream_textures(Scene* scene) {
+	if (scene->feedback_fence) {
+		GLenum status = glClientWaitSync(scene->feedback_fence, 0, 0);
+		if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED) return;
+		glDeleteSync(scene->feedback_fence);
+		scene->feedback_fence = NULL;
+
+		// Materials inserted since the last upload have no slot yet
+		unsigned int n = MIN(scene->n_materials, scene->material_gpu_capacity);
+		// Copied out since streaming can re-upload materials and replace the readback buffer
+		unsigned int* feedback = malloc(sizeof(unsigned int) * MAX(n, 1));
+		glGetNamedBufferSubData(scene->feedback_readback, 0, sizeof(unsigned int) * n, feedback);
+		scene_process_feedback(scene, feedback, n);
+		free(feedback);
+	}
+
+	unsigned int clear = FEEDBACK_CLEAR;
+	glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+	glCopyNamedBufferSubData(scene->feedback_buffer, scene->feedback_readback, 0, 0, sizeof(unsigned int) * scene->material_gpu_capacity);
+	glClearNamedBufferData(scene->feedback_buffer, GL_R32UI, GL_RED_INTEGER, GL_UNSIGNED_INT, &clear);
+	scene->feedback_fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+}
+
+// Resident is what the texture storage actually holds, total what the full mip chains would take
+void scene_texture_memory(Scene* scene, size_t* resident, size_t* total) {
+	*resident = 0;
+	*total = 0;
+	for (unsigned int i = 0; i < scene->texture_capacity; i++) {
+		Texture* t = scene->textures[i];
+		if (!t) continue;
+		for (unsigned int level = 0; level < t->info.levels; level++) {
+			size_t size = texture_level_size(&t->info, level);
+			*total += size;
+			if (level >= t->resident) *resident += size;
+		}
+	}
+}
+
+static void scene_process_feedback(Scene* scene, const unsigned int* feedback, unsigned int count) {
+	// Textures nothing sampled this time only need their coarse levels
+	for (unsigned int i = 0; i < scene->texture_capacity; i++) {
+		Texture* t = scene->textures[i];
+		if (t && t->path) t->requested = t->coarse;
+	}
+	// Convert the per material uv derivative into a mip level for each of its textures
+	for (unsigned int i = 0; i < count; i++) {
+		if (feedback[i] == FEEDBACK_CLEAR) continue;
+		float lod = (float)feedback[i] / FEEDBACK_SCALE - FEEDBACK_BIAS;
+		Material* mat = &scene->materials[i];
+		Texture* textures[] = { mat->diffuse, mat->specular, mat->normal, mat->mask };
+		for (unsigned int j = 0; j < 4; j++) {
+			Texture* t = textures[j];
+			if (!t || !t->path) continue;
+			float level = floorf(lod + log2f(MAX(t->info.width, t->info.height)));
+			unsigned int requested = (unsigned int)MIN(MAX(level, 0.0f), (float)(t->info.levels - 1));
+			t->requested = MIN(t->requested, requested);
+		}
+	}
+
+	// Finer levels are decoded on a worker first and reallocated in once ready, levels that went
+	// unsampled for TEXTURE_EVICT_ROUNDS readbacks are reallocated out
+	unsigned int budget = TEXTURE_STREAM_BUDGET;
+	bool dirty = false;
+	for (unsigned int i = 0; i < scene->texture_capacity; i++) {
+		Texture* t = scene->textures[i];
+		if (!t || !t->path) continue;
+		if (t->requested < t->resident) {
+			t->idle = 0;
+			enum TEXTURE_DECODE_STATE state = texture_decode_poll(&t->decode);
+			if (state == DECODE_NONE) texture_decode_start(&t->decode, t->path, &t->info);
+			if (state != DECODE_READY || !budget) continue;
+		} else if (t->requested == t->resident) {
+			t->idle = 0;
+			continue;
+		} else if (++t->idle < TEXTURE_EVICT_ROUNDS || !budget) {
+			continue;
+		}
+		if (!scene_texture_reallocate(t, t->requested)) continue;
+		budget--;
+		dirty = true;
+	}
+
+	if (dirty) scene_upload_materials(scene);
+}
+
+// Swap the texture for one holding levels [first, levels), the old handle goes with it
+static bool scene_texture_reallocate(Texture* t, unsigned int first) {
+	unsigned int id = texture_reallocate(t->texture, &t->info, t->resident, first, &t->decode);
+	if (!id) return false;
+	plogf(LL_INFO, "%s texture %s, levels %u-%u resident\n", first < t->resident ? "Streamed" : "Evicted",
+		t->path, first, t->info.levels - 1);
+	if (t->handle) glMakeTextureHandleNonResidentARB(t->handle);
+	glDeleteTextures(1, &t->texture);
+	t->texture = id;
+	t->handle = 0;
+	t->resident = first;
+	t->idle = 0;
+	// Back to what was loaded, the decoded levels aren't worth holding on to
+	if (first == t->coarse) texture_decode_release(&t->decode);
+	return true;
+}
+
+// Write every material in one mapped upload, the buffer follows the pool's capacity
+static void scene_upload_materials(Scene* scene) {
+	double start = plog_time();
+	if (scene->material_gpu_capacity < scene->material_capacity) {
+		if (scene->material_buffer) glDeleteBuffers(1, &scene->material_buffer);
+		glCreateBuffers(1, &scene->material_buffer);
+		glNamedBufferData(scene->material_buffer, sizeof(MaterialData) * scene->material_capacity, NULL, GL_DYNAMIC_DRAW);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, SSBO_MATERIAL, scene->material_buffer);
+		feedback_reserve(scene, scene->material_capacity);
+		scene->material_gpu_capacity = scene->material_capacity;
+	}
+	if (!scene->n_materials) return;
+	MaterialData* data = glMapNamedBufferRange(scene->material_buffer, 0, sizeof(MaterialData) * scene->n_materials, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+	if (!data) {
+		plogf(LL_ERROR, "Mapping material buffer failed\n");
+		return;
+	}
+	for (unsigned int i = 0; i < scene->n_materials; i++) {
+		Material* mat = &scene->materials[i];
+		Texture* textures[] = { mat->diffuse, mat->specular, mat->normal, mat->mask };
+		uint64_t handles[4] = { 0 };
+		// Streaming replaces the texture and clears the handle, its new one is made resident here
+		for (unsigned int j = 0; j < 4; j++) {
+			Texture* t = textures[j];
+			if (!t || !t->texture) continue;
+			if (!t->handle) {
+				t->handle = glGetTextureHandleARB(t->texture);
+				glMakeTextureHandleResidentARB(t->handle);
+			}
+			handles[j] = t->handle;
+		}
+		data[i] = (MaterialData) {
+			.diffuse = handles[0],
+			.specular = handles[1],
+			.normal = handles[2],
+			.mask = handles[3],
+			.shininess = mat->shininess,
+			.opacity = 1.0f - mat->transparency
+		};
+	}
+	glUnmapNamedBuffer(scene->material_buffer);
+	plogf(LL_INFO, "Uploaded %u materials (%u bytes) in %.3fms\n",
+		scene->n_materials, scene->n_materials * (unsigned int)sizeof(MaterialData), (plog_time() - start) * 1000.0);
+}
+
+// One feedback slot per material, an in flight readback is dropped when the buffers are replaced
+static void feedback_reserve(Scene* scene, unsigned int capacity) {
+	if (scene->feedback_fence) {
+		glDeleteSync(scene->feedback_fence);
+		scene->feedback_fence = NULL;
+	}
+	if (scene->feedback_buffer) glDeleteBuffers(1, &scene->feedback_buffer);
+	if (scene->feedback_readback) glDeleteBuffers(1, &scene->feedback_readback);
+
+	unsigned int clear = FEEDBACK_CLEAR;
+	glCreateBuffers(1, &scene->feedback_buffer);
+	glNamedBufferData(scene->feedback_buffer, sizeof(unsigned int) * capacity, NULL, GL_DYNAMIC_COPY);
+	glClearNamedBufferData(scene->feedback_buffer, GL_R32UI, GL_RED_INTEGER, GL_UNSIGNED_INT, &clear);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, SSBO_FEEDBACK, scene->feedback_buffer);
+
+	glCreateBuffers(1, &scene->feedback_readback);
+	glNamedBufferData(scene->feedback_readback, sizeof(unsigned int) * capacity, NULL, GL_STREAM_READ);
 }
 
 Node* node_new(unsigned int nParts, unsigned int nChildren) {
@@ -297,9 +1598,31 @@ Node* node_new(unsigned int nParts, unsigned int nChildren) {
 	if (!node) return NULL;
 	node->n_parts = nParts;
 	node->n_children = nChildren;
+	node->material = MATERIAL_NONE;
+	node->tint = TINT_NONE;
 	return node;
 }
 
+// Deep copy, parts still point into the same Geometry
+Node* node_clone(const Node* node, Node* parent) {
+	Node* clone = node_new(node->n_parts, node->n_children);
+	if (!clone) return NULL;
+	clone->parent = parent;
+	clone->geometry = node->geometry;
+	clone->material = node->material;
+	clone->tint = node->tint;
+	memcpy(clone->transform, node->transform, sizeof(mat4));
+	memcpy(node_parts(clone), node_parts(node), sizeof(Part*) * node->n_parts);
+	for (unsigned int i = 0; i < node->n_children; i++) {
+		node_children(clone)[i] = node_clone(node_children(node)[i], clone);
+		if (!node_children(clone)[i]) {
+			node_delete(&clone);
+			return NULL;
+		}
+	}
+	return clone;
+}
+
 void node_delete(Node** node) {
 	if (!node || !*node) return;
 	for (unsigned int i = 0; i < (*node)->n_children; i++)
@@ -321,13 +1644,16 @@ void node_resize(Node** node, unsigned int nParts, unsigned int nChildren) {
 	*node = new;
 }
 
-static void scene_load_geometry(Scene* scene, unsigned int geometryIndex, const struct aiScene* aiScn, unsigned int materialOffset) {
-	if (geometryIndex > GEOMETRY_MAX) {
+// Convert and upload mesh by mesh through the fixed size staging buffer,
+// peak memory stays independent of the file size
+static void scene_load_geometry(Scene* scene, unsigned int geometryIndex, const struct aiScene* aiScn, const unsigned int* materialMap) {
+	if (geometryIndex >= GEOMETRY_MAX) {
 		plogf(LL_ERROR, "Geometry out of bounds\n");
 		return;
 	}
 	Geometry* g = &scene->geometry[geometryIndex];
 
+	// Upper bound, deduplicated meshes don't consume their reserved space
 	size_t nVertices = 0, nIndices = 0;
 	for (unsigned int i = 0; i < aiScn->mNumMeshes; i++) {
 		const struct aiMesh* aiMsh = aiScn->mMeshes[i];
@@ -335,157 +1661,411 @@ static void scene_load_geometry(Scene* scene, unsigned int geometryIndex, const
 		for (unsigned int j = 0; j < aiMsh->mNumFaces; j++)
 			nIndices += aiMsh->mFaces[j].mNumIndices;
 	}
-
-	Vertex* vertices = malloc(sizeof(Vertex) * nVertices);
-	unsigned int* indices = malloc(sizeof(unsigned int) * nIndices);
+	geometry_reserve(scene, g, g->n_vertices + nVertices, g->n_indices + nIndices);
 
 	size_t vIdx = 0, iIdx = 0;
+	size_t savedBytes = 0;
+	double convertTime = 0.0, tangentTime = 0.0;
 
-	for (unsigned int i = 0; i < aiScn->mNumMeshes; i++) {
+	unsigned int partOffset = g->n_parts;
+	unsigned int nMeshes = MIN(aiScn->mNumMeshes, PART_MAX - g->n_parts);
+	if (nMeshes < aiScn->mNumMeshes) plogf(LL_ERROR, "Part out of bounds\n");
+	bool* unique = calloc(nMeshes, sizeof(bool));
+	vec4** tangents = calloc(nMeshes, sizeof(vec4*));
+
+	// Assign ranges before converting anything so duplicates, also within this file, cost nothing
+	for (unsigned int i = 0; i < nMeshes; i++) {
 		Part* p = &g->parts[g->n_parts++];
-		if (g->n_parts > PART_MAX) {
-			plogf(LL_ERROR, "Part out of bounds\n");
-			free(vertices); free(indices);
-			return;
-		}
-		p->base_vertex = vIdx + g->n_vertices;
-		p->base_index = iIdx + g->n_indices;
+		p->base_vertex = g->n_vertices;
+		p->base_index = g->n_indices;
 
 		const struct aiMesh* aiMsh = aiScn->mMeshes[i];
 		
-		p->material = materialOffset + aiMsh->mMaterialIndex;
-
-		for (unsigned int j = 0; j < aiMsh->mNumVertices; j++) {
-			Vertex* v = &vertices[vIdx++];
-			glm_vec3_copy((vec3){	aiMsh->mVertices[j].x, aiMsh->mVertices[j].y,	aiMsh->mVertices[j].z	}, v->position);
-			glm_vec2_copy((vec2){ aiMsh->mTextureCoords[0][j].x, aiMsh->mTextureCoords[0][j].y }, v->texCoord);
-			glm_vec3_copy((vec3){ aiMsh->mNormals[j].x, aiMsh->mNormals[j].y, aiMsh->mNormals[j].z }, v->normal);
-			glm_vec3_copy((vec3){ aiMsh->mTangents[j].x, aiMsh->mTangents[j].y, aiMsh->mTangents[j].z }, v->tangent);
-			glm_vec3_copy((vec3){ aiMsh->mBitangents[j].x, aiMsh->mBitangents[j].y, aiMsh->mBitangents[j].z }, v->bitangent);
-		}
-		p->n_index = 0;
-		for (unsigned int j = 0; j < aiMsh->mNumFaces; j++) {
-			p->n_index += aiMsh->mFaces[j].mNumIndices;
-			for (unsigned int k = 0; k < aiMsh->mFaces[j].mNumIndices; k++)
-				indices[iIdx++] = aiMsh->mFaces[j].mIndices[k];
-		}
-	}
-
-	if (g->vertex_array) {
-		// Resize
-		plogf(LL_INFO, "Resizing existing Geometry buffers\n");
-		size_t newVertices = g->n_vertices + nVertices;
-		size_t newIndices = g->n_indices + nIndices;
-
-		unsigned int vertexBuffer = 0;
-		glCreateBuffers(1, &vertexBuffer);
-		glNamedBufferData(vertexBuffer, newVertices * sizeof(Vertex), NULL, GL_STATIC_DRAW);
-		glCopyNamedBufferSubData(g->vertex_buffer, vertexBuffer, 0, 0, sizeof(Vertex) * g->n_vertices);
-		glNamedBufferSubData(vertexBuffer, sizeof(Vertex) * g->n_vertices, sizeof(Vertex) * nVertices, vertices);
-		g->n_vertices = newVertices;
-		glDeleteBuffers(1, &g->vertex_buffer);
-		g->vertex_buffer = vertexBuffer;
-
-		unsigned int elementBuffer = 0;
-		glCreateBuffers(1, &elementBuffer);
-		glNamedBufferData(elementBuffer, newIndices * sizeof(unsigned int), NULL, GL_STATIC_DRAW);
-		glCopyNamedBufferSubData(g->element_buffer, elementBuffer, 0, 0, sizeof(unsigned int) * g->n_indices);
-		glNamedBufferSubData(elementBuffer, sizeof(unsigned int) * g->n_indices, sizeof(unsigned int) * nIndices, indices);
-		g->n_indices = newIndices;
-		glDeleteBuffers(1, &g->element_buffer);
-		g->element_buffer = elementBuffer;
-	} else {
+		p->material = materialMap[aiMsh->mMaterialIndex];
+		bounds_sphere((const vec3*)aiMsh->mVertices, aiMsh->mNumVertices, p->bounds);
+
+		// Indices are mesh local, identical streams can share one range of the pool
+		bool normalMapped = scene->materials[p->material].normal != NULL;
+		unsigned long long key = mesh_hash(aiMsh, normalMapped, &p->n_index);
+		MeshRange* range = geometry_find_mesh(scene, g, key, aiMsh, p->n_index);
+		if (range) {
+			p->base_vertex = range->base_vertex;
+			p->base_index = range->base_index;
+			savedBytes += (sizeof(vec3) + sizeof(Vertex)) * aiMsh->mNumVertices + sizeof(unsigned int) * p->n_index;
+			continue;
+		}
+
+		if (g->n_meshes < PART_MAX) {
+			g->meshes[g->n_meshes++] = (MeshRange) {
+				.key = key,
+				.source = aiMsh,
+				.n_vertex = aiMsh->mNumVertices,
+				.base_vertex = p->base_vertex,
+				.n_index = p->n_index,
+				.base_index = p->base_index
+			};
+		}
+		g->n_vertices += aiMsh->mNumVertices;
+		g->n_indices += p->n_index;
+		vIdx += aiMsh->mNumVertices;
+		iIdx += p->n_index;
+		unique[i] = true;
+	}
+
+	// Tangent frames are only built for normal mapped meshes, in batches to bound their memory
+	for (unsigned int first = 0, last = 0; first < nMeshes; first = last) {
+		size_t batchVertices = 0;
+		for (; last < nMeshes && (last == first || batchVertices + aiScn->mMeshes[last]->mNumVertices <= TANGENT_BATCH_VERTICES); last++) {
+			const Part* p = &g->parts[partOffset + last];
+			if (!unique[last] || !scene->materials[p->material].normal) continue;
+			tangents[last] = malloc(sizeof(vec4) * aiScn->mMeshes[last]->mNumVertices);
+			batchVertices += aiScn->mMeshes[last]->mNumVertices;
+		}
+
+		double start = plog_time();
+		if (scene->assimp_tangents) {
+			for (unsigned int i = first; i < last; i++)
+				if (tangents[i]) mesh_tangents_from_assimp(aiScn->mMeshes[i], tangents[i]);
+		} else {
+			mesh_generate_tangents((const struct aiMesh* const*)&aiScn->mMeshes[first], &tangents[first], last - first);
+		}
+		tangentTime += plog_time() - start;
+
+		start = plog_time();
+		for (unsigned int i = first; i < last; i++) {
+			if (unique[i]) geometry_upload_mesh(scene, g, &g->parts[partOffset + i], aiScn->mMeshes[i], tangents[i]);
+			free(tangents[i]);
+		}
+		convertTime += plog_time() - start;
+	}
+	free(unique);
+	free(tangents);
+	// The import is released after this, later hits are checked against the pool
+	for (unsigned int i = 0; i < g->n_meshes; i++) g->meshes[i].source = NULL;
+
+	plogf(LL_INFO, "Tangent frames (%s) in %.3fms\n", scene->assimp_tangents ? "assimp" : "generated", tangentTime * 1000.0);
+	plogf(LL_INFO, "Mesh deduplication saved %zu bytes\n", savedBytes);
+	size_t convertBytes = (sizeof(vec3) + sizeof(Vertex)) * vIdx + sizeof(unsigned int) * iIdx;
+	plogf(LL_INFO, "Converted %zu bytes in %.3fms (%.1f MB/s)\n",
+		convertBytes, convertTime * 1000.0, convertTime > 0.0 ? convertBytes / convertTime / 1e6 : 0.0);
+
+	plogf(LL_INFO, "Created geometry[%u] { vao:%u, vbo:%u, ebo:%u }; %zu vertices, %zu indices\n",
+		geometryIndex, g->vertex_array, g->vertex_buffer, g->element_buffer, vIdx, iIdx);
+}
+
+// Convert straight into the mapped destination range, the range lies past every
+// committed mesh so no in flight draw reads it and the mapping can be unsynchronized
+static void geometry_upload_mesh(Scene* scene, Geometry* g, const Part* p, const struct aiMesh* aiMsh, const vec4* tangents) {
+	if (!aiMsh->mNumVertices || !p->n_index) return;
+	// Static batching reads the pool back later, convert into the CPU copy and upload from there
+	if (scene->static_batch && g->cpu_positions && g->cpu_vertices && g->cpu_indices) {
+		mesh_convert_positions(g->cpu_positions + p->base_vertex, aiMsh, 0, aiMsh->mNumVertices);
+		mesh_convert_vertices(g->cpu_vertices + p->base_vertex, aiMsh, tangents, 0, aiMsh->mNumVertices);
+		mesh_convert_indices(g->cpu_indices + p->base_index, aiMsh, 0, aiMsh->mNumFaces);
+		glNamedBufferSubData(g->position_buffer, sizeof(vec3) * p->base_vertex, sizeof(vec3) * aiMsh->mNumVertices, g->cpu_positions + p->base_vertex);
+		glNamedBufferSubData(g->vertex_buffer, sizeof(Vertex) * p->base_vertex, sizeof(Vertex) * aiMsh->mNumVertices, g->cpu_vertices + p->base_vertex);
+		glNamedBufferSubData(g->element_buffer, sizeof(unsigned int) * p->base_index, sizeof(unsigned int) * p->n_index, g->cpu_indices + p->base_index);
+		return;
+	}
+	const GLbitfield access = GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT | GL_MAP_UNSYNCHRONIZED_BIT;
+	vec3* positionMap = glMapNamedBufferRange(g->position_buffer, sizeof(vec3) * p->base_vertex, sizeof(vec3) * aiMsh->mNumVertices, access);
+	Vertex* vertexMap = glMapNamedBufferRange(g->vertex_buffer, sizeof(Vertex) * p->base_vertex, sizeof(Vertex) * aiMsh->mNumVertices, access);
+	unsigned int* indexMap = glMapNamedBufferRange(g->element_buffer, sizeof(unsigned int) * p->base_index, sizeof(unsigned int) * p->n_index, access);
+	if (positionMap && vertexMap && indexMap) {
+		mesh_convert_positions(positionMap, aiMsh, 0, aiMsh->mNumVertices);
+		mesh_convert_vertices(vertexMap, aiMsh, tangents, 0, aiMsh->mNumVertices);
+		mesh_convert_indices(indexMap, aiMsh, 0, aiMsh->mNumFaces);
+		glUnmapNamedBuffer(g->position_buffer);
+		glUnmapNamedBuffer(g->vertex_buffer);
+		glUnmapNamedBuffer(g->element_buffer);
+		return;
+	}
+	if (positionMap) glUnmapNamedBuffer(g->position_buffer);
+	if (vertexMap) glUnmapNamedBuffer(g->vertex_buffer);
+	if (indexMap) glUnmapNamedBuffer(g->element_buffer);
+
+	// Mapping failed, go through the staging buffer
+	plogf(LL_WARN, "Mapping geometry buffers failed, uploading through staging buffer\n");
+	const unsigned int vertexChunk = GEOMETRY_STAGING_SIZE / sizeof(Vertex);
+	const unsigned int indexChunk = GEOMETRY_STAGING_SIZE / sizeof(unsigned int);
+	for (unsigned int i = 0; i < aiMsh->mNumVertices; i += vertexChunk) {
+		unsigned int nStaged = MIN(vertexChunk, aiMsh->mNumVertices - i);
+		mesh_convert_positions(scene->staging, aiMsh, i, nStaged);
+		glNamedBufferSubData(g->position_buffer, sizeof(vec3) * (p->base_vertex + i), sizeof(vec3) * nStaged, scene->staging);
+		mesh_convert_vertices(scene->staging, aiMsh, tangents, i, nStaged);
+		glNamedBufferSubData(g->vertex_buffer, sizeof(Vertex) * (p->base_vertex + i), sizeof(Vertex) * nStaged, scene->staging);
+	}
+	unsigned int nIndex = 0, firstFace = 0, nStaged = 0;
+	for (unsigned int i = 0; i <= aiMsh->mNumFaces; i++) {
+		// Flush when the next face doesn't fit and after the last face
+		if (i == aiMsh->mNumFaces || nStaged + aiMsh->mFaces[i].mNumIndices > indexChunk) {
+			mesh_convert_indices(scene->staging, aiMsh, firstFace, i - firstFace);
+			glNamedBufferSubData(g->element_buffer, sizeof(unsigned int) * (p->base_index + nIndex), sizeof(unsigned int) * nStaged, scene->staging);
+			nIndex += nStaged;
+			nStaged = 0;
+			firstFace = i;
+		}
+		if (i < aiMsh->mNumFaces) nStaged += aiMsh->mFaces[i].mNumIndices;
+	}
+}
+
+// Replace buffer with a larger one keeping the first used bytes
+static unsigned int buffer_grow(unsigned int buffer, size_t used, size_t capacity) {
+	unsigned int grown = 0;
+	glCreateBuffers(1, &grown);
+	glNamedBufferData(grown, capacity, NULL, GL_STATIC_DRAW);
+	if (buffer) {
+		glCopyNamedBufferSubData(buffer, grown, 0, 0, used);
+		glDeleteBuffers(1, &buffer);
+	}
+	return grown;
+}
+
+// Grow the pool buffers geometrically so repeated loads don't copy the whole pool each time
+static void geometry_reserve(Scene* scene, Geometry* g, size_t nVertices, size_t nIndices) {
+	if (!g->vertex_array) {
 		plogf(LL_INFO, "Creating new Geometry buffers\n");
 		glCreateVertexArrays(1, &g->vertex_array);
-		glCreateBuffers(1, &g->vertex_buffer);
-		glNamedBufferData(g->vertex_buffer, nVertices * sizeof(Vertex), vertices, GL_STATIC_DRAW);
-		g->n_vertices = nVertices;
-		glCreateBuffers(1, &g->element_buffer);
-		glNamedBufferData(g->element_buffer, nIndices * sizeof(unsigned int), indices, GL_STATIC_DRAW);
-		g->n_indices = nIndices;
-		
+		glCreateVertexArrays(1, &g->depth_array);
 		scene->n_geometry++;
 		g->primitive = GL_TRIANGLES;
 
-		glEnableVertexArrayAttrib(g->vertex_array, ATTR_POSITION);
-		glVertexArrayAttribBinding(g->vertex_array, ATTR_POSITION, 0);
-		glVertexArrayAttribFormat(g->vertex_array, ATTR_POSITION, 3, GL_FLOAT, GL_FALSE, offsetof(Vertex, position));
+		// Positions are a separate tightly packed stream so depth only passes fetch nothing else
+		unsigned int arrays[] = { g->vertex_array, g->depth_array };
+		for (unsigned int i = 0; i < 2; i++) {
+			glEnableVertexArrayAttrib(arrays[i], ATTR_POSITION);
+			glVertexArrayAttribBinding(arrays[i], ATTR_POSITION, BINDING_POSITION);
+			glVertexArrayAttribFormat(arrays[i], ATTR_POSITION, 3, GL_FLOAT, GL_FALSE, 0);
+		}
 		
 		glEnableVertexArrayAttrib(g->vertex_array, ATTR_TEXCOORD);
-		glVertexArrayAttribBinding(g->vertex_array, ATTR_TEXCOORD, 0);
+		glVertexArrayAttribBinding(g->vertex_array, ATTR_TEXCOORD, BINDING_ATTRIBUTES);
 		glVertexArrayAttribFormat(g->vertex_array, ATTR_TEXCOORD, 2, GL_FLOAT, GL_FALSE, offsetof(Vertex, texCoord));
 		
 		glEnableVertexArrayAttrib(g->vertex_array, ATTR_NORMAL);
-		glVertexArrayAttribBinding(g->vertex_array, ATTR_NORMAL, 0);
+		glVertexArrayAttribBinding(g->vertex_array, ATTR_NORMAL, BINDING_ATTRIBUTES);
 		glVertexArrayAttribFormat(g->vertex_array, ATTR_NORMAL, 3, GL_FLOAT, GL_FALSE, offsetof(Vertex, normal));
 		
 		glEnableVertexArrayAttrib(g->vertex_array, ATTR_TANGENT);
-		glVertexArrayAttribBinding(g->vertex_array, ATTR_TANGENT, 0);
-		glVertexArrayAttribFormat(g->vertex_array, ATTR_TANGENT, 3, GL_FLOAT, GL_FALSE, offsetof(Vertex, tangent));
-		
-		glEnableVertexArrayAttrib(g->vertex_array, ATTR_BITANGENT);
-		glVertexArrayAttribBinding(g->vertex_array, ATTR_BITANGENT, 0);
-		glVertexArrayAttribFormat(g->vertex_array, ATTR_BITANGENT, 3, GL_FLOAT, GL_FALSE, offsetof(Vertex, bitangent));
+		glVertexArrayAttribBinding(g->vertex_array, ATTR_TANGENT, BINDING_ATTRIBUTES);
+		glVertexArrayAttribFormat(g->vertex_array, ATTR_TANGENT, 4, GL_FLOAT, GL_FALSE, offsetof(Vertex, tangent));
+	}
 
-		glEnableVertexArrayAttrib(g->vertex_array, ATTR_ASSIGN);
-		glVertexArrayAttribBinding(g->vertex_array, ATTR_ASSIGN, 1);
-		glVertexArrayAttribIFormat(g->vertex_array, ATTR_ASSIGN, 2, GL_INT, 0);
-		glVertexArrayVertexBuffer(g->vertex_array, 1, scene->assign_buffer, 0, sizeof(ivec2));
-		glVertexArrayBindingDivisor(g->vertex_array, 1, 1);
+	if (nVertices > g->vertex_capacity) {
+		size_t capacity = MAX(nVertices, g->vertex_capacity * 2);
+		plogf(LL_INFO, "Resizing vertex buffers to %zu vertices\n", capacity);
+		g->position_buffer = buffer_grow(g->position_buffer, sizeof(vec3) * g->n_vertices, sizeof(vec3) * capacity);
+		g->vertex_buffer = buffer_grow(g->vertex_buffer, sizeof(Vertex) * g->n_vertices, sizeof(Vertex) * capacity);
+		g->vertex_capacity = capacity;
+		if (scene->static_batch) {
+			g->cpu_positions = realloc(g->cpu_positions, sizeof(vec3) * capacity);
+			g->cpu_vertices = realloc(g->cpu_vertices, sizeof(Vertex) * capacity);
+		}
+		glVertexArrayVertexBuffer(g->vertex_array, BINDING_POSITION, g->position_buffer, 0, sizeof(vec3));
+		glVertexArrayVertexBuffer(g->vertex_array, BINDING_ATTRIBUTES, g->vertex_buffer, 0, sizeof(Vertex));
+		glVertexArrayVertexBuffer(g->depth_array, BINDING_POSITION, g->position_buffer, 0, sizeof(vec3));
 	}
 
-	glVertexArrayVertexBuffer(g->vertex_array, 0, g->vertex_buffer, 0, sizeof(Vertex));
-	glVertexArrayElementBuffer(g->vertex_array, g->element_buffer);
+	if (nIndices > g->index_capacity) {
+		size_t capacity = MAX(nIndices, g->index_capacity * 2);
+		plogf(LL_INFO, "Resizing element buffer to %zu indices\n", capacity);
+		g->element_buffer = buffer_grow(g->element_buffer, sizeof(unsigned int) * g->n_indices, sizeof(unsigned int) * capacity);
+		g->index_capacity = capacity;
+		if (scene->static_batch) g->cpu_indices = realloc(g->cpu_indices, sizeof(unsigned int) * capacity);
+		glVertexArrayElementBuffer(g->vertex_array, g->element_buffer);
+		glVertexArrayElementBuffer(g->depth_array, g->element_buffer);
+	}
+}
 
-	plogf(LL_INFO, "Created geometry[%u] { vao:%u, vbo:%u, ebo:%u }; %lu vertices, %lu indices\n",
-		geometryIndex, g->vertex_array, g->vertex_buffer, g->element_buffer, vIdx, iIdx);
+static MeshRange* geometry_find_mesh(Scene* scene, Geometry* g, unsigned long long key, const struct aiMesh* aiMsh, unsigned int nIndex) {
+	for (unsigned int i = 0; i < g->n_meshes; i++) {
+		MeshRange* range = &g->meshes[i];
+		if (range->key != key || range->n_vertex != aiMsh->mNumVertices || range->n_index != nIndex) continue;
+		// Ranges of this file aren't uploaded yet, their source is still around to compare with
+		if (range->source ? mesh_equal(range->source, aiMsh) : geometry_mesh_equal(scene, g, range, aiMsh)) return range;
+		plogf(LL_WARN, "Mesh hash collision, keeping a copy of its own\n");
+	}
+	return NULL;
+}
+
+// Converted streams against the pooled range read back through the two halves of the staging buffer.
+// Tangents follow from what is compared and the key covers whether they were generated
+static bool geometry_mesh_equal(Scene* scene, const Geometry* g, const MeshRange* range, const struct aiMesh* aiMsh) {
+	unsigned char* converted = scene->staging;
+	unsigned char* pooled = converted + GEOMETRY_STAGING_SIZE / 2;
+	const unsigned int vertexChunk = GEOMETRY_STAGING_SIZE / 2 / sizeof(Vertex);
+	const unsigned int indexChunk = GEOMETRY_STAGING_SIZE / 2 / sizeof(unsigned int);
+	for (unsigned int i = 0; i < aiMsh->mNumVertices; i += vertexChunk) {
+		unsigned int n = MIN(vertexChunk, aiMsh->mNumVertices - i);
+		mesh_convert_positions((vec3*)converted, aiMsh, i, n);
+		glGetNamedBufferSubData(g->position_buffer, sizeof(vec3) * (range->base_vertex + i), sizeof(vec3) * n, pooled);
+		if (memcmp(converted, pooled, sizeof(vec3) * n)) return false;
+		mesh_convert_vertices((Vertex*)converted, aiMsh, NULL, i, n);
+		glGetNamedBufferSubData(g->vertex_buffer, sizeof(Vertex) * (range->base_vertex + i), sizeof(Vertex) * n, pooled);
+		for (unsigned int j = 0; j < n; j++)
+			if (memcmp(converted + sizeof(Vertex) * j, pooled + sizeof(Vertex) * j, offsetof(Vertex, tangent))) return false;
+	}
+	unsigned int nIndex = 0, firstFace = 0, nStaged = 0;
+	for (unsigned int i = 0; i <= aiMsh->mNumFaces; i++) {
+		if (i == aiMsh->mNumFaces || nStaged + aiMsh->mFaces[i].mNumIndices > indexChunk) {
+			mesh_convert_indices((unsigned int*)converted, aiMsh, firstFace, i - firstFace);
+			glGetNamedBufferSubData(g->element_buffer, sizeof(unsigned int) * (range->base_index + nIndex), sizeof(unsigned int) * nStaged, pooled);
+			if (memcmp(converted, pooled, sizeof(unsigned int) * nStaged)) return false;
+			nIndex += nStaged;
+			nStaged = 0;
+			firstFace = i;
+		}
+		if (i < aiMsh->mNumFaces) nStaged += aiMsh->mFaces[i].mNumIndices;
+	}
+	return true;
 }
 
-static void scene_load_materials(Scene* scene, const char* path, const struct aiScene* aiScn) {
+static void scene_load_materials(Scene* scene, const char* path, const struct aiScene* aiScn, unsigned int* materialMap) {
 	for (unsigned int i = 0; i < aiScn->mNumMaterials; i++) {
-		Material* mat = &scene->materials[scene->n_materials++];
+		Material mat = { 0 };
 		const struct aiMaterial* aiMat = aiScn->mMaterials[i];
 		if (aiGetMaterialTextureCount(aiMat, aiTextureType_DIFFUSE)) {
-			scene_load_texture(scene, &mat->diffuse, path, aiMat, aiTextureType_DIFFUSE);
+			scene_load_texture(scene, &mat.diffuse, path, aiMat, aiTextureType_DIFFUSE);
 		}
 		if (aiGetMaterialTextureCount(aiMat, aiTextureType_SPECULAR)) {
-			scene_load_texture(scene, &mat->specular, path, aiMat, aiTextureType_SPECULAR);
+			scene_load_texture(scene, &mat.specular, path, aiMat, aiTextureType_SPECULAR);
 		}
 		if (aiGetMaterialTextureCount(aiMat, aiTextureType_HEIGHT)) {
-			scene_load_texture(scene, &mat->normal, path, aiMat, aiTextureType_HEIGHT);
+			scene_load_texture(scene, &mat.normal, path, aiMat, aiTextureType_HEIGHT);
+		}
+		// map_d in MTL files
+		if (aiGetMaterialTextureCount(aiMat, aiTextureType_OPACITY)) {
+			scene_load_texture(scene, &mat.mask, path, aiMat, aiTextureType_OPACITY);
 		}
 		ai_real shininess = 32.0f;
-		mat->shininess = shininess;
-		plogf(LL_INFO, "Created material[%u] { %u, %u, %u }\n", i, 
-			mat->diffuse ? mat->diffuse->texture : 0,
-			mat->specular ? mat->specular->texture : 0,
-			mat->normal ? mat->normal->texture : 0
+		mat.shininess = shininess;
+		// d in MTL files, anything below fully opaque goes to the transparent queue
+		ai_real opacity = 1.0f;
+		aiGetMaterialFloatArray(aiMat, AI_MATKEY_OPACITY, &opacity, NULL);
+		mat.transparency = glm_clamp(1.0f - (float)opacity, 0.0f, 1.0f);
+		materialMap[i] = scene_insert_material(scene, &mat);
+		plogf(LL_INFO, "Material[%u] -> [%u] { %u, %u, %u, %u } opacity %.2f\n", i, materialMap[i],
+			mat.diffuse ? mat.diffuse->texture : 0,
+			mat.specular ? mat.specular->texture : 0,
+			mat.normal ? mat.normal->texture : 0,
+			mat.mask ? mat.mask->texture : 0,
+			1.0f - mat.transparency
 		);
 	}
 }
 
+// Materials are equal when they share the same (content deduplicated) textures and parameters. Found through
+// the hash table, the fields are only compared to confirm a hit
+unsigned int scene_insert_material(Scene* scene, const Material* material) {
+	scene->material_lookups++;
+	unsigned long long hash = material_hash(material);
+	unsigned int slot = hash % scene->material_table_capacity;
+	for (; scene->material_table[slot]; slot = (slot + 1) % scene->material_table_capacity) {
+		unsigned int i = scene->material_table[slot] - 1;
+		Material* m = &scene->materials[i];
+		if (m->diffuse == material->diffuse && m->specular == material->specular &&
+			m->normal == material->normal && m->mask == material->mask && m->shininess == material->shininess &&
+			m->transparency == material->transparency) {
+			scene->material_hits++;
+			return i;
+		}
+	}
+	if (scene->n_materials == scene->material_capacity) {
+		scene->material_capacity *= 2;
+		scene->materials = realloc(scene->materials, sizeof(Material) * scene->material_capacity);
+	}
+	if ((scene->n_materials + 1) * 4 > scene->material_table_capacity * 3 && !scene_grow_material_table(scene)) {
+		plogf(LL_ERROR, "Material table allocation failed, material %u won't be shared\n", scene->n_materials);
+	} else {
+		// The table may have grown, probe again
+		slot = hash % scene->material_table_capacity;
+		while (scene->material_table[slot]) slot = (slot + 1) % scene->material_table_capacity;
+		scene->material_table[slot] = scene->n_materials + 1;
+	}
+	scene->materials[scene->n_materials] = *material;
+	return scene->n_materials++;
+}
+
+// Fields hashed one by one, the struct padding is left out
+static unsigned long long material_hash(const Material* m) {
+	unsigned long long hash = HASH_SEED;
+	hash = hash_bytes(&m->diffuse, sizeof(m->diffuse), hash);
+	hash = hash_bytes(&m->specular, sizeof(m->specular), hash);
+	hash = hash_bytes(&m->normal, sizeof(m->normal), hash);
+	hash = hash_bytes(&m->mask, sizeof(m->mask), hash);
+	hash = hash_bytes(&m->shininess, sizeof(m->shininess), hash);
+	return hash_bytes(&m->transparency, sizeof(m->transparency), hash);
+}
+
+// Double the table and rehash every material, the materials array itself doesn't move
+static bool scene_grow_material_table(Scene* scene) {
+	unsigned int capacity = scene->material_table_capacity * 2;
+	unsigned int* table = calloc(capacity, sizeof(unsigned int));
+	if (!table) return false;
+	for (unsigned int i = 0; i < scene->material_table_capacity; i++) {
+		unsigned int entry = scene->material_table[i];
+		if (!entry) continue;
+		unsigned int slot = material_hash(&scene->materials[entry - 1]) % capacity;
+		while (table[slot]) slot = (slot + 1) % capacity;
+		table[slot] = entry;
+	}
+	free(scene->material_table);
+	scene->material_table = table;
+	scene->material_table_capacity = capacity;
+	return true;
+}
+
 Texture* scene_find_texture(Scene* scene, unsigned long long key) {
-	unsigned long long index = key % TEXTURE_MAX;
-	for (unsigned long long i = 0; i < TEXTURE_MAX; i++) {
-		Texture* texture = &scene->textures[(index + i) % TEXTURE_MAX];
+	unsigned int capacity = scene->texture_capacity;
+	for (unsigned int i = 0; i < capacity; i++) {
+		Texture* texture = scene->textures[(key + i) % capacity];
+		if (!texture) return NULL;
 		if (texture->key == key) return texture;
-		if (texture->key == 0) return NULL;
 	}
 	return NULL;
 }
 
+// Takes ownership of the GL texture, which is deleted if it can't be stored
 Texture* scene_insert_texture(Scene* scene, unsigned long long key, unsigned int texture) {
-	unsigned long long index = key % TEXTURE_MAX;
-	for (unsigned long long i = 0; i < TEXTURE_MAX; i++) {
-		Texture* cached = &scene->textures[(index + i) % TEXTURE_MAX];
-		if (cached->key == key) return cached;
-		if (cached->key == 0) {
-			cached->key = key;
-			cached->texture = texture;
-			return cached;
-		} 
+	Texture* cached = scene_find_texture(scene, key);
+	if (cached) return cached;
+	if ((scene->n_textures + 1) * 4 > scene->texture_capacity * 3 && !scene_grow_textures(scene)) {
+		plogf(LL_ERROR, "Texture table allocation failed, dropping texture %llu\n", key);
+		glDeleteTextures(1, &texture);
+		return NULL;
 	}
-	return NULL;
+	cached = calloc(1, sizeof(Texture));
+	if (!cached) {
+		plogf(LL_ERROR, "Texture allocation failed, dropping texture %llu\n", key);
+		glDeleteTextures(1, &texture);
+		return NULL;
+	}
+	cached->key = key;
+	cached->texture = texture;
+	unsigned int capacity = scene->texture_capacity;
+	unsigned int slot = key % capacity;
+	while (scene->textures[slot]) slot = (slot + 1) % capacity;
+	scene->textures[slot] = cached;
+	scene->n_textures++;
+	return cached;
+}
+
+// Double the table and reinsert every texture, the Texture records themselves don't move
+static bool scene_grow_textures(Scene* scene) {
+	unsigned int capacity = scene->texture_capacity * 2;
+	Texture** textures = calloc(capacity, sizeof(Texture*));
+	if (!textures) return false;
+	for (unsigned int i = 0; i < scene->texture_capacity; i++) {
+		Texture* t = scene->textures[i];
+		if (!t) continue;
+		unsigned int slot = t->key % capacity;
+		while (textures[slot]) slot = (slot + 1) % capacity;
+		textures[slot] = t;
+	}
+	free(scene->textures);
+	scene->textures = textures;
+	scene->texture_capacity = capacity;
+	return true;
 }
 
 static void scene_load_texture(Scene* scene, Texture** texture, const char* path, const struct aiMaterial* aiMat, enum aiTextureType type) {
@@ -498,18 +2078,47 @@ static void scene_load_texture(Scene* scene, Texture** texture, const char* path
 	char* dirMark = strrchr(buffer, '/');
 	strcpy(dirMark + 1, name.data);
 
-	unsigned long long key = strhash(buffer);
+	// Identity is the source file content so copies under different names share one texture
+	unsigned long long key = 0;
+	if (!hash_file(buffer, &key)) {
+		plogf(LL_ERROR, "Failed to read material texture: %s\n", buffer);
+		return;
+	}
+	scene->texture_lookups++;
 	Texture* cached = scene_find_texture(scene, key);
 	if (cached) {
+		scene->texture_hits++;
 		*texture = cached;
 		return;
 	}
 	unsigned int id = 0;
-	if (!load_texture(&id, buffer, true, GL_REPEAT, GL_REPEAT, GL_LINEAR_MIPMAP_LINEAR, GL_LINEAR)) {
+	TextureInfo info = { 0 };
+	unsigned int resident = 0;
+	if (!load_texture_streamed(&id, &info, &resident, buffer, TEXTURE_STREAM_COARSE, GL_REPEAT, GL_REPEAT, GL_LINEAR_MIPMAP_LINEAR, GL_LINEAR)) {
 		plogf(LL_ERROR, "Failed to load material texture: %s\n", buffer);
+		if (id) glDeleteTextures(1, &id);
+		return;
 	}
 	*texture = scene_insert_texture(scene, key, id);
-	plogf(LL_INFO, "Loaded texture: %s : %llu\n", buffer, key);
+	if (*texture) {
+		(*texture)->path = strdup(buffer);
+		(*texture)->info = info;
+		(*texture)->resident = (*texture)->coarse = (*texture)->requested = resident;
+	}
+	plogf(LL_INFO, "Loaded texture: %s : %llu, %u/%u levels resident\n", buffer, key, info.levels - resident, info.levels);
+}
+
+Texture* scene_load_texture_color(Scene* scene, unsigned char color[3]) {
+	unsigned long long key = hash_bytes(color, 3, HASH_SEED);
+	scene->texture_lookups++;
+	Texture* cached = scene_find_texture(scene, key);
+	if (cached) {
+		scene->texture_hits++;
+		return cached;
+	}
+	unsigned int id = 0;
+	load_texture_color(&id, color);
+	return scene_insert_texture(scene, key, id);
 }
 
 static void scene_load_node(Scene* scene, Node** node, const struct aiScene* aiScn, const struct aiNode* aiNd, Node* parent, unsigned int geometryIdx, unsigned int partOffset) {
@@ -547,6 +2156,25 @@ static void scene_load_node(Scene* scene, Node** node, const struct aiScene* aiS
 	}
 }
 
+// Sphere around the box of the positions, looser than a minimal sphere but one pass
+static void bounds_sphere(const vec3* positions, unsigned int count, vec4 dest) {
+	vec3 box[2] = { { FLT_MAX, FLT_MAX, FLT_MAX }, { -FLT_MAX, -FLT_MAX, -FLT_MAX } };
+	for (unsigned int i = 0; i < count; i++) {
+		glm_vec3_minv(box[0], (float*)positions[i], box[0]);
+		glm_vec3_maxv(box[1], (float*)positions[i], box[1]);
+	}
+	if (!count) {
+		glm_vec4_zero(dest);
+		return;
+	}
+	vec3 center;
+	glm_vec3_center(box[0], box[1], center);
+	float radius = 0.0f;
+	for (unsigned int i = 0; i < count; i++)
+		radius = fmaxf(radius, glm_vec3_distance2(center, (float*)positions[i]));
+	glm_vec4(center, sqrtf(radius), dest);
+}
+
 static void node_world_transform(Node* node, mat4 dest) {
 	glm_mat4_copy(node->transform, dest);
 	Node* parent = node->parent;
@@ -555,3 +2183,167 @@ static void node_world_transform(Node* node, mat4 dest) {
 		parent = parent->parent;
 	}
 }
+
+// World matrix plus its inverse transpose so the vertex shader doesn't invert per vertex
+static void transform_write(Node* node, Transform* t) {
+	mat4 world;
+	node_world_transform(node, world);
+	mat4 identity = GLM_MAT4_IDENTITY_INIT;
+	transform_write_matrix(identity, world, t);
+}
+
+// Transparent when transparency > 0, masked when it has a mask, otherwise opaque
+static enum RENDER_QUEUE material_queue(const Scene* scene, unsigned int material) {
+	if (material >= scene->n_materials) return QUEUE_OPAQUE;
+	const Material* m = &scene->materials[material];
+	if (m->transparency > 0.0f) return QUEUE_TRANSPARENT;
+	return m->mask ? QUEUE_MASKED : QUEUE_OPAQUE;
+}
+
+// Closest material override and tint up the hierarchy
+static InstanceData node_instance(Node* node, Part* part) {
+	InstanceData instance = { MATERIAL_NONE, TINT_NONE };
+	for (Node* n = node; n; n = n->parent) {
+		if (instance.material == MATERIAL_NONE) instance.material = n->material;
+		if (instance.tint == TINT_NONE) instance.tint = n->tint;
+	}
+	if (instance.material == MATERIAL_NONE) instance.material = part->material;
+	return instance;
+}
+
+static void transform_write_matrix(mat4 parent, mat4 local, Transform* t) {
+	glm_mat4_mul(parent, local, t->model);
+	mat3 normal;
+	glm_mat4_pick3(t->model, normal);
+	glm_mat3_inv(normal, normal);
+	glm_mat3_transpose(normal);
+	for (unsigned int i = 0; i < 3; i++) {
+		glm_vec3_copy(normal[i], t->normal[i]);
+		t->normal[i][3] = 0.0f;
+	}
+}
+
+// Storage for count transforms in transform_gpu_mode, the texture path needs a new
+// texture and handle since bindless textures can't be rebound to a new buffer
+static void transform_reserve_gpu(Scene* scene, unsigned int count) {
+	scene->transform_gpu_capacity = count;
+	scene->transform_buffer = buffer_grow(0, 0, transformModeSizes[scene->transform_gpu_mode] * count);
+	scene->instance_buffer = buffer_grow(0, 0, sizeof(InstanceData) * count);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, SSBO_INSTANCE, scene->instance_buffer);
+	if (scene->transform_gpu_mode == TRANSFORM_TEXTURE) {
+		glCreateTextures(GL_TEXTURE_BUFFER, 1, &scene->transform_texture);
+		glTextureBuffer(scene->transform_texture, GL_RGBA32F, scene->transform_buffer);
+		scene->transform_handle = glGetTextureHandleARB(scene->transform_texture);
+		glMakeTextureHandleResidentARB(scene->transform_handle);
+	} else {
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, SSBO_TRANSFORM, scene->transform_buffer);
+	}
+}
+
+static void transform_release_gpu(Scene* scene) {
+	if (scene->transform_handle) {
+		glMakeTextureHandleNonResidentARB(scene->transform_handle);
+		scene->transform_handle = 0;
+	}
+	if (scene->transform_texture) {
+		glDeleteTextures(1, &scene->transform_texture);
+		scene->transform_texture = 0;
+	}
+	if (scene->transform_buffer) {
+		glDeleteBuffers(1, &scene->transform_buffer);
+		scene->transform_buffer = 0;
+	}
+	if (scene->instance_buffer) {
+		glDeleteBuffers(1, &scene->instance_buffer);
+		scene->instance_buffer = 0;
+	}
+	scene->transform_gpu_capacity = 0;
+}
+
+// Rotation quaternion, translation and signed uniform scale, false if the matrix isn't a similarity transform
+static bool transform_pack_quat(const Transform* t, vec4 dst[2]) {
+	const float epsilon = 1e-4f;
+	vec3 c[3];
+	for (unsigned int i = 0; i < 3; i++) glm_vec3_copy((float*)t->model[i], c[i]);
+	float s2 = glm_vec3_norm2(c[0]);
+	if (s2 <= 0.0f) return false;
+	if (fabsf(glm_vec3_norm2(c[1]) - s2) > epsilon * s2 || fabsf(glm_vec3_norm2(c[2]) - s2) > epsilon * s2) return false;
+	if (fabsf(glm_vec3_dot(c[0], c[1])) > epsilon * s2 || fabsf(glm_vec3_dot(c[1], c[2])) > epsilon * s2 || fabsf(glm_vec3_dot(c[2], c[0])) > epsilon * s2) return false;
+	vec3 cross;
+	glm_vec3_cross(c[0], c[1], cross);
+	float scale = sqrtf(s2) * (glm_vec3_dot(cross, c[2]) < 0.0f ? -1.0f : 1.0f);
+	mat4 rotation = GLM_MAT4_IDENTITY_INIT;
+	for (unsigned int i = 0; i < 3; i++) glm_vec3_scale(c[i], 1.0f / scale, rotation[i]);
+	glm_mat4_quat(rotation, dst[0]);
+	glm_vec4_copy((vec4){ t->model[3][0], t->model[3][1], t->model[3][2], scale }, dst[1]);
+	return true;
+}
+
+static unsigned int node_count(const Node* node) {
+	unsigned int count = 1;
+	for (unsigned int i = 0; i < node->n_children; i++)
+		count += node_count(node_children(node)[i]);
+	return count;
+}
+
+// One child per distinct transform relative to the root holding every part with that transform,
+// or a single node when every part shares one. Nodes without parts disappear
+static Node* node_flatten(Node* root) {
+	typedef struct { mat4 transform; unsigned int n_parts; Part** parts; } Group;
+	Group* groups = NULL;
+	unsigned int nGroups = 0;
+	Node* queue[128];
+	mat4 transforms[128];
+	unsigned int nQueue = 1;
+	queue[0] = root;
+	glm_mat4_identity(transforms[0]);
+	while (nQueue) {
+		nQueue--;
+		Node* n = queue[nQueue];
+		mat4 transform;
+		glm_mat4_copy(transforms[nQueue], transform);
+		if (n->n_parts) {
+			Group* group = NULL;
+			for (unsigned int i = 0; i < nGroups && !group; i++)
+				if (!memcmp(groups[i].transform, transform, sizeof(mat4))) group = &groups[i];
+			if (!group) {
+				groups = realloc(groups, sizeof(Group) * (nGroups + 1));
+				group = &groups[nGroups++];
+				*group = (Group) { .n_parts = 0, .parts = NULL };
+				glm_mat4_copy(transform, group->transform);
+			}
+			group->parts = realloc(group->parts, sizeof(Part*) * (group->n_parts + n->n_parts));
+			memcpy(group->parts + group->n_parts, node_parts(n), sizeof(Part*) * n->n_parts);
+			group->n_parts += n->n_parts;
+		}
+		for (unsigned int i = 0; i < n->n_children; i++) {
+			glm_mat4_mul(transform, node_children(n)[i]->transform, transforms[nQueue]);
+			queue[nQueue++] = node_children(n)[i];
+		}
+	}
+
+	Node* flat;
+	mat4 identity = GLM_MAT4_IDENTITY_INIT;
+	if (nGroups == 1 && !memcmp(groups[0].transform, identity, sizeof(mat4))) {
+		flat = node_new(groups[0].n_parts, 0);
+		memcpy(node_parts(flat), groups[0].parts, sizeof(Part*) * groups[0].n_parts);
+	} else {
+		flat = node_new(0, nGroups);
+		for (unsigned int i = 0; i < nGroups; i++) {
+			Node* child = node_new(groups[i].n_parts, 0);
+			child->parent = flat;
+			child->geometry = root->geometry;
+			glm_mat4_copy(groups[i].transform, child->transform);
+			memcpy(node_parts(child), groups[i].parts, sizeof(Part*) * groups[i].n_parts);
+			node_children(flat)[i] = child;
+		}
+	}
+	flat->geometry = root->geometry;
+	flat->material = root->material;
+	flat->tint = root->tint;
+	glm_mat4_copy(root->transform, flat->transform);
+	for (unsigned int i = 0; i < nGroups; i++) free(groups[i].parts);
+	free(groups);
+	node_delete(&root);
+	return flat;
+}
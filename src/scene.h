@@ -3,30 +3,100 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include <cglm/cglm.h>
+#include <glad/glad.h>
+#include "texture.h"
+#include "material.h"
 
 
 #define GEOMETRY_MAX 8
+// A cache object per geometry and render queue
+#define CACHE_MAX (GEOMETRY_MAX * 3)
+// Initial material pool, grows on demand
 #define MATERIAL_MAX 8
 #define TRANSFORM_MAX 512
 #define NODE_MAX TRANSFORM_MAX
 #define PART_MAX TRANSFORM_MAX
+// Initial texture table slots, grows on demand
 #define TEXTURE_MAX 8
+#define MODEL_MAX 16
+
+// Mesh conversion goes through this many bytes regardless of file size
+#define GEOMETRY_STAGING_SIZE (4 << 20)
+// Vertices whose tangent frames are held at once during a load
+#define TANGENT_BATCH_VERTICES (1 << 20)
+
+// Node and InstanceSet defaults, use the part's material and no tint
+#define MATERIAL_NONE 0xFFFFFFFF
+#define TINT_NONE 0xFFFFFFFF
+#define HANDLE_NONE 0xFFFFFFFF
+
+#define HASH_SEED 14695981039346656037ULL
+
+// Shaded over visible samples above which PREPASS_AUTO geometry gets a depth prepass
+#define PREPASS_OVERDRAW 1.5f
+
+// Largest mip (in texels) uploaded at load, finer levels are streamed on demand
+#define TEXTURE_STREAM_COARSE 64
+// Textures reallocated per feedback readback
+#define TEXTURE_STREAM_BUDGET 2
+// Readbacks a texture must stay coarser than its storage before the unused levels are dropped
+#define TEXTURE_EVICT_ROUNDS 120
+
+// Feedback values are log2(uv derivative) in fixed point, biased to stay positive
+#define FEEDBACK_BIAS 32
+#define FEEDBACK_SCALE 16
+#define FEEDBACK_CLEAR 0xFFFFFFFF
+
+enum SSBO_BINDING {
+	SSBO_FEEDBACK,
+	SSBO_POSITION,
+	SSBO_ATTRIBUTE,
+	SSBO_DRAW,
+	SSBO_TRANSFORM,
+	SSBO_GENERATOR,
+	SSBO_INSTANCE,
+	SSBO_MATERIAL,
+	SSBO_LIGHT,
+	SSBO_CLUSTER,
+	SSBO_INDEX,
+	SSBO_VISIBILITY,
+	SSBO_CULL,
+	SSBO_CULL_COMMAND,
+	SSBO_CULL_INSTANCE,
+	SSBO_CULL_RANK,
+	// Sorted instance ids of the transparent queue, read by TRANSFORM_SORTED draws
+	SSBO_SORTED,
+};
+
+// Uniform binding of the CullView read by cull.comp and the culled draws, after those main.c owns
+#define UBO_CULL 4
+// Matches cull.comp and cull_order.comp
+#define CULL_THREADS 64
+// Most depth buckets of an ordered cull, the bucket takes the top 4 bits of a rank
+#define CULL_BUCKETS 16
+
+// Visibility IDs are instance << visibility_shift | triangle, table entries are cache << 24 | command
+#define VISIBILITY_COMMAND_BITS 24
 
 enum ATTR_LOCATION {
-	ATTR_ASSIGN,
 	ATTR_POSITION,
 	ATTR_TEXCOORD,
 	ATTR_NORMAL,
 	ATTR_TANGENT,
-	ATTR_BITANGENT,
 };
 
+enum VERTEX_BINDING {
+	BINDING_POSITION,
+	BINDING_ATTRIBUTES,
+};
+
+// Shading attributes, positions live in their own vec3 stream
 typedef struct {
-	vec3 position;
 	vec2 texCoord;
 	vec3 normal;
 	vec3 tangent;
-	vec3 bitangent;
+	// Bitangent sign, read as tangent.w, the bitangent is rebuilt in default.vert
+	float sign;
 } Vertex;
 
 typedef struct {
@@ -34,24 +104,59 @@ typedef struct {
 	unsigned int base_index;
 	unsigned int base_vertex;
 	unsigned int material;
+	// Bounding sphere of the referenced vertices, center and radius
+	vec4 bounds;
 } Part;
 
+// Unique vertex/index stream in a geometry pool, keyed by a hash of its content
+typedef struct {
+	unsigned long long key;
+	// Mesh it was converted from while its file is being loaded, NULL once the import is gone
+	const struct aiMesh* source;
+	unsigned int n_vertex;
+	unsigned int base_vertex;
+	unsigned int n_index;
+	unsigned int base_index;
+} MeshRange;
+
+enum PREPASS_MODE {
+	PREPASS_AUTO,
+	PREPASS_NEVER,
+	PREPASS_ALWAYS,
+};
+
 typedef struct {
 	unsigned int primitive;
 	unsigned int vertex_array;
+	unsigned int depth_array;
+	unsigned int position_buffer;
 	unsigned int vertex_buffer;
 	unsigned int element_buffer;
-	unsigned int indirect_buffer;
 	unsigned int n_vertices;
 	unsigned int n_indices;
+	unsigned int vertex_capacity;
+	unsigned int index_capacity;
 	unsigned int n_parts;
 	Part parts[PART_MAX];
+	unsigned int n_meshes;
+	MeshRange meshes[PART_MAX];
+	// Pool contents on the CPU while scene->static_batch, scene_batch_static reads them instead of the buffers
+	vec3* cpu_positions;
+	Vertex* cpu_vertices;
+	unsigned int* cpu_indices;
+	// PREPASS_AUTO follows the overdraw measured by scene_measure_overdraw
+	enum PREPASS_MODE prepass;
+	float overdraw;
 } Geometry;
 
 typedef struct Node {
 	struct Node* parent;
 	mat4 transform;
 	Geometry* geometry;
+	// Overrides the material of every part below this node unless MATERIAL_NONE
+	unsigned int material;
+	// RGBA8 multiplied into the diffuse color
+	unsigned int tint;
 	unsigned int n_parts;
 	unsigned int n_children;
 	void* data;
@@ -61,15 +166,61 @@ typedef struct {
 	unsigned long long key;
 	unsigned int texture;
 	uint64_t handle;
+	char* path;
+	TextureInfo info;
+	// Storage holds full chain levels [resident, levels), coarse is where it started at load
+	unsigned int resident;
+	unsigned int coarse;
+	// Finest level sampled in the last readback and readbacks since it was finer than resident
+	unsigned int requested;
+	unsigned int idle;
+	TextureDecode decode;
 } Texture;
 
+// Imported file, repeated loads clone the node tree and share its Parts. key hashes the rest,
+// which is kept to rule out collisions
+typedef struct {
+	unsigned long long key;
+	char* path;
+	unsigned int flags;
+	unsigned int geometry;
+	bool flatten;
+	Node* root;
+} Model;
+
 typedef struct {
 	Texture* diffuse;
 	Texture* specular;
 	Texture* normal;
+	// Opacity map, alpha tested at MATERIAL_MASK_CUTOFF. Masked instances go to their own cache objects
+	Texture* mask;
 	float shininess;
+	// 1 - opacity, above 0 the material is blended in the transparent queue
+	float transparency;
 } Material;
 
+// Material as seen by the shaders, layout shared with default.frag through material.h
+typedef struct {
+	MATERIAL_FIELDS(MATERIAL_FIELD_C)
+} MaterialData;
+_Static_assert(sizeof(MaterialData) == 40, "MaterialData must match the std430 layout");
+
+// Instance transform storage, matches transform.glsl
+enum TRANSFORM_MODE {
+	// mat4 + normal matrix (112 bytes) in an RGBA32F texture buffer
+	TRANSFORM_TEXTURE,
+	// 3x4 row-major affine (48 bytes) in an SSBO
+	TRANSFORM_AFFINE,
+	// Quaternion, translation and uniform scale (32 bytes) in an SSBO
+	TRANSFORM_QUAT,
+};
+
+// Texture buffer record per instance, the normal matrix columns are padded to vec4 texels
+typedef struct {
+	mat4 model;
+	vec4 normal[3];
+} Transform;
+
 typedef struct {
 	uint n_index;
 	uint n_instance;
@@ -78,50 +229,322 @@ typedef struct {
 	uint base_instance;
 } DrawIndirectCommand;
 
+// Cache objects of a geometry are split by the queue of their materials, drawn in this order
+enum RENDER_QUEUE {
+	QUEUE_OPAQUE,
+	QUEUE_MASKED,
+	// Blended after the skybox in the order of transparent_sort
+	QUEUE_TRANSPARENT,
+};
+
+// Commands of one geometry in one render queue
 typedef struct {
 	Geometry* geometry;
+	enum RENDER_QUEUE queue;
+	unsigned int indirect_buffer;
 	unsigned int n_commands;
+	// Commands [0, n_static) draw nodes, the rest are instance sets
+	unsigned int n_static;
+	// Index of this object's first command among the commands of every cache object
+	unsigned int command_base;
+	// Byte offset of this object's per draw materials in draw_buffer, indexed by gl_DrawID
+	unsigned int draw_offset;
+	// Same for the instance set commands alone
+	unsigned int set_draw_offset;
 } CacheObject;
 
+// Commands of each cache object drawn by scene_render_culled
+enum COMMAND_RANGE {
+	COMMANDS_ALL,
+	// Nodes, they only move when the cache is rebuilt
+	COMMANDS_NODES,
+	// Instance sets, edited between rebuilds
+	COMMANDS_SETS,
+};
+
+// How an InstanceSet places its instances, matches transform.glsl
+enum INSTANCE_PATTERN {
+	// Explicit transforms, one per instance
+	PATTERN_LIST,
+	// params: columns, spacing x, spacing z
+	PATTERN_GRID,
+	// params: radius, yaw jitter
+	PATTERN_RING,
+	// params: radius, min scale, max scale, seed
+	PATTERN_SCATTER,
+};
+
+// One part drawn N times by a single command, procedural patterns are evaluated
+// in the vertex shader from gl_InstanceID so only the set transform is stored
+typedef struct {
+	Geometry* geometry;
+	Part* part;
+	unsigned int n_instances;
+	enum INSTANCE_PATTERN pattern;
+	vec4 params;
+	mat4 transform;
+	unsigned int material;
+	unsigned int tint;
+	// PATTERN_LIST only, relative to transform, dense in [0, n_instances)
+	mat4* transforms;
+	// PATTERN_LIST only, transform slots reserved at build so adds don't need a rebuild
+	unsigned int capacity;
+	// Stable handles, dense_handle[dense] is a handle slot and handle_dense[slot] the dense index
+	// or the next free slot when the slot is unused
+	unsigned int* dense_handle;
+	unsigned int* handle_dense;
+	unsigned int* generations;
+	unsigned int free_handle;
+	unsigned int n_handles;
+	// Where the set landed in the last build
+	bool built;
+	bool command_dirty;
+	unsigned int base_transform;
+	unsigned int cache_index;
+	unsigned int command_index;
+} InstanceSet;
+
+// Stays valid across swap-removes of other instances, generation catches stale handles
+typedef struct {
+	unsigned int slot;
+	unsigned int generation;
+} InstanceHandle;
+
+// GPU record of a procedural InstanceSet
+typedef struct {
+	vec4 params;
+	unsigned int pattern;
+	unsigned int count;
+	unsigned int pad[2];
+} InstanceGenerator;
+
+// Per command data indexed by gl_DrawID, generator is 1 + index into the generator buffer or 0.
+// visibility is the command's first instance in the visibility ID space, the rest mirrors the
+// indirect command so the visibility resolve can refetch triangles without it
+typedef struct {
+	unsigned int generator;
+	unsigned int visibility;
+	unsigned int base_index;
+	int base_vertex;
+	unsigned int base_instance;
+} DrawData;
+
+// Per command record of cull.comp, instances of the command own slots [first, first + slots) of a cull output
+typedef struct {
+	vec4 bounds;
+	DrawData draw;
+	unsigned int first;
+	unsigned int count;
+	unsigned int slots;
+} CullCommand;
+_Static_assert(sizeof(CullCommand) == 48, "CullCommand must match the std430 layout");
+
+// View culled against by scene_cull, CullView UBO in cull.glsl
+typedef struct {
+	mat4 view_projection;
+	vec4 planes[6];
+	// View depth of p is dot(xyz, p) + w, ordered culls bucket it by log(depth) * bucket_scale + bucket_bias
+	vec4 depth_plane;
+	// Output region, its commands and instance slots start at region * n_commands * buckets and region * n_slots
+	unsigned int region;
+	unsigned int n_commands;
+	unsigned int n_slots;
+	// 1 keeps the survivors of each command in one unordered run
+	unsigned int buckets;
+	float bucket_scale;
+	float bucket_bias;
+	unsigned int pad[2];
+} CullView;
+
+// Buffers written by scene_cull, each region holds n_commands * buckets indirect commands, bucket major,
+// and one instance per slot
+typedef struct {
+	unsigned int commands;
+	unsigned int instances;
+	// Bucket and rank of each slot between the two passes of an ordered cull
+	unsigned int ranks;
+	unsigned int regions;
+	unsigned int buckets;
+	unsigned int command_capacity;
+	unsigned int slot_capacity;
+} CullOutput;
+
+// Per instance data beside each Transform, the material is resolved at build time
+typedef struct {
+	unsigned int material;
+	unsigned int tint;
+} InstanceData;
+
+// Command of a transparent cache object, kept on the CPU so transparent_sort can order its instances
+typedef struct {
+	Geometry* geometry;
+	// Instance sets change their count without a rebuild, count is read from them
+	InstanceSet* set;
+	unsigned int count;
+	vec4 bounds;
+	DrawData draw;
+	DrawIndirectCommand command;
+} TransparentCommand;
+
 typedef struct {
 	Part* part;
 	Node* node;
+	InstanceSet* set;
+	Geometry* geometry;
+	InstanceData instance;
+	enum RENDER_QUEUE queue;
 } CachePart;
 
 typedef struct {
-	unsigned int assign_buffer;
+	unsigned int draw_buffer;
+	unsigned int draw_capacity;
+	int draw_alignment;
+	// Attributeless vertex array for vertex pulling, only the element buffer is swapped per geometry
+	unsigned int pull_array;
+	bool vertex_pulling;
 
 	unsigned int n_materials;
+	unsigned int material_capacity;
 	Material* materials;
+	// Open addressed by material_hash, 1 + index into materials or 0 when free, kept under 3/4 full
+	unsigned int* material_table;
+	unsigned int material_table_capacity;
+	// Sized for material_capacity, rewritten as a whole by scene_upload_materials
 	unsigned int material_buffer;
+	unsigned int material_gpu_capacity;
 
+	// Open addressed by key, kept under 3/4 full. Textures are allocated one by one so materials
+	// keep their pointers when the table grows
 	unsigned int n_textures;
-	Texture* textures;
+	unsigned int texture_capacity;
+	Texture** textures;
 
+	unsigned int texture_lookups, texture_hits;
+	unsigned int material_lookups, material_hits;
+
+	unsigned int feedback_buffer;
+	unsigned int feedback_readback;
+	GLsync feedback_fence;
+
+	// CPU copy of the instance transforms, packed per transform_mode on upload
+	unsigned int n_transforms;
+	unsigned int transform_capacity;
+	Transform* transforms;
+	InstanceData* instance_data;
+	enum TRANSFORM_MODE transform_mode;
+	// GPU storage, holds transform_gpu_capacity records in transform_gpu_mode layout
+	enum TRANSFORM_MODE transform_gpu_mode;
+	unsigned int transform_gpu_capacity;
 	unsigned int transform_buffer;
 	unsigned int transform_texture;
 	uint64_t transform_handle;
+	unsigned int instance_buffer;
 
 	unsigned int n_geometry;
 	Geometry* geometry;
 
+	unsigned int n_models;
+	Model* models;
+
 	unsigned int n_nodes;
+	unsigned int node_capacity;
 	Node** nodes;
 
+	unsigned int n_instance_sets;
+	InstanceSet** instance_sets;
+	unsigned int generator_buffer;
+	unsigned int generator_capacity;
+	// Transform slots changed by instance edits since the last flush, [first, end)
+	unsigned int dirty_first, dirty_end;
+	// An instance set outgrew its reserved slots
+	bool instances_rebuild;
+
+	// Cache object and command of every visibility ID instance, rebuilt with the cache
+	unsigned int visibility_table;
+	unsigned int visibility_capacity;
+	unsigned int n_visibility;
+	// Triangle bits of a visibility ID, 0 when the scene doesn't fit in 32 bits
+	unsigned int visibility_shift;
+
+	// Every command of the cache in order for culling, cull_template holds the indirect commands with no
+	// instances and base_instance at their first slot
+	unsigned int cull_buffer;
+	unsigned int cull_template;
+	unsigned int cull_capacity;
+	unsigned int n_commands;
+	unsigned int n_cull_slots;
+	// Bumped whenever the cache or instance transforms change, cached passes compare against it
+	unsigned int revision;
+	// Bumped only when the cache is rebuilt, what COMMANDS_NODES draws is unchanged until then
+	unsigned int static_revision;
+
+	// Set by scene_render_prepass, the next scene_render tests prepassed geometry with GL_EQUAL
+	bool prepass_done;
+	// Samples passed per measured geometry, depth test pass then equal pass. Results are collected
+	// by scene_poll_overdraw once available, a new measurement waits until then
+	unsigned int overdraw_queries[2][CACHE_MAX];
+	Geometry* overdraw_geometry[CACHE_MAX];
+	unsigned int n_overdraw;
+	bool overdraw_pending;
+
 	unsigned int n_cache;
 	CacheObject* cache;
+	// Commands of the transparent cache objects in cache order
+	unsigned int n_transparent;
+	unsigned int transparent_capacity;
+	TransparentCommand* transparent;
+
+	void* staging;
+	// Import tangents through aiProcess_CalcTangentSpace instead of mesh_generate_tangents
+	bool assimp_tangents;
+	// Bake imported hierarchies into one level of nodes per distinct transform
+	bool static_flatten;
+	// Loads keep CPU copies of the pools until scene_batch_static consumes them
+	bool static_batch;
 } Scene;
 
 void scene_init(Scene* scene);
 void scene_destroy(Scene* scene);
 void scene_load(Scene* scene, const char* path, unsigned int geometryIdx,mat4 initialTransform, bool flipUVs);
+Model* scene_find_model(Scene* scene, const Model* identity);
 void scene_build_cache(Scene* scene);
+void scene_upload_transforms(Scene* scene);
+Node** scene_add_node(Scene* scene);
+InstanceSet* scene_add_instances(Scene* scene, Geometry* g, Part* part, enum INSTANCE_PATTERN pattern, unsigned int count);
+Part* scene_load_part(Scene* scene, const char* path, unsigned int geometryIdx);
+void scene_batch_static(Scene* scene);
+void scene_reserve_instances(Scene* scene, InstanceSet* set, unsigned int capacity);
+InstanceHandle scene_instance_add(Scene* scene, InstanceSet* set, mat4 transform);
+bool scene_instance_remove(Scene* scene, InstanceSet* set, InstanceHandle handle);
+bool scene_instance_transform(Scene* scene, InstanceSet* set, InstanceHandle handle, mat4 transform);
+bool scene_flush_instances(Scene* scene);
+// Transform of instance id of a procedural set relative to the set transform, as the vertex shader builds it
+void scene_generate_instance(const InstanceSet* set, unsigned int id, mat4 local);
 void scene_render(Scene* scene);
+void scene_render_depth(Scene* scene);
+void scene_resolve_visibility(Scene* scene);
+void scene_render_prepass(Scene* scene);
+bool scene_measure_overdraw(Scene* scene);
+void scene_poll_overdraw(Scene* scene);
+void scene_render_masks(Scene* scene);
+void scene_render_masked(Scene* scene, bool depthOnly);
+void scene_cull(Scene* scene, const CullOutput* output, unsigned int region, unsigned int orderProgram);
+void scene_render_culled(Scene* scene, const CullOutput* output, unsigned int region, enum RENDER_QUEUE queue, enum COMMAND_RANGE range, bool depthOnly);
+void cull_view_init(CullView* view, const Scene* scene, mat4 viewProjection, unsigned int region);
+void cull_view_order(CullView* view, vec3 position, vec3 front, float zNear, float zFar, unsigned int buckets);
+bool cull_output_reserve(CullOutput* output, const Scene* scene, unsigned int regions, unsigned int buckets);
+void cull_output_destroy(CullOutput* output);
+void scene_stream_textures(Scene* scene);
+void scene_texture_memory(Scene* scene, size_t* resident, size_t* total);
 Texture* scene_find_texture(Scene* scene, unsigned long long key);
 Texture* scene_insert_texture(Scene* scene, unsigned long long key, unsigned int texture);
+Texture* scene_load_texture_color(Scene* scene, unsigned char color[3]);
+unsigned int scene_insert_material(Scene* scene, const Material* material);
 unsigned long long strhash(const char* str);
+unsigned long long hash_bytes(const void* data, size_t size, unsigned long long hash);
 
 Node* node_new(unsigned int nParts, unsigned int nChildren);
+Node* node_clone(const Node* node, Node* parent);
 void node_delete(Node** node);
 void node_resize(Node** node, unsigned int nParts, unsigned int nChildren);
 
@@ -3,9 +3,14 @@
 #include <stdbool.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include "log.h"
 
+#define INCLUDE_DEPTH_MAX 4
+
 static char* read_file_contents(const char* path);
+static char* resolve_includes(const char* path, unsigned int depth);
+static char* insert_defines(char* source, const char* defines);
 static bool verify(GLuint id, GLenum status, void (*get_iv)(GLuint, GLenum, GLint*), void (*get_log)(GLuint, GLsizei, GLsizei*, GLchar*));
 static unsigned int compile_shader(const char* source, GLenum shader, GLenum status, void (*get_iv)(GLuint, GLenum, GLint*), void (*get_log)(GLuint, GLsizei, GLsizei*, GLchar*));
 
@@ -17,8 +22,9 @@ void create_shader(unsigned int* id, unsigned int count, ...) {
 	va_start(ptr, count);
 	for (unsigned int i = 0; i < count; i++) {
 		ShaderArgs args = va_arg(ptr, ShaderArgs);
-		char* source = read_file_contents(args.path);
+		char* source = resolve_includes(args.path, 0);
 		if (!source) plogf(LL_ERROR, "Cannot load shader: %s\n", args.path);
+		else if (args.defines) source = insert_defines(source, args.defines);
 		shaders[i] = compile_shader(source, args.shader, GL_COMPILE_STATUS, glGetShaderiv, glGetShaderInfoLog);
 		if (!shaders[i]) plogf(LL_ERROR, "Shader:%u compilation failed\n", args.shader);
 		free(source);
@@ -49,6 +55,50 @@ static char* read_file_contents(const char* path) {
 	return buffer;
 }
 
+// Replace lines of the form #include "file" with the file's contents, paths are relative to the including file
+static char* resolve_includes(const char* path, unsigned int depth) {
+	char* source = read_file_contents(path);
+	if (!source || depth >= INCLUDE_DEPTH_MAX) return source;
+	char* directive;
+	while ((directive = strstr(source, "#include \""))) {
+		char* name = directive + strlen("#include \"");
+		char* end = strchr(name, '"');
+		if (!end) break;
+		const char* slash = strrchr(path, '/');
+		int dirLength = slash ? (int)(slash - path + 1) : 0;
+		char includePath[256];
+		snprintf(includePath, sizeof(includePath), "%.*s%.*s", dirLength, path, (int)(end - name), name);
+		char* included = resolve_includes(includePath, depth + 1);
+		if (!included) {
+			plogf(LL_ERROR, "Cannot load shader include: %s\n", includePath);
+			included = calloc(1, 1);
+		}
+		size_t before = directive - source, includedLength = strlen(included), after = strlen(end + 1);
+		char* expanded = malloc(before + includedLength + after + 1);
+		memcpy(expanded, source, before);
+		memcpy(expanded + before, included, includedLength);
+		memcpy(expanded + before + includedLength, end + 1, after + 1);
+		free(included);
+		free(source);
+		source = expanded;
+	}
+	return source;
+}
+
+// #version has to stay first, the defines go on the line after it
+static char* insert_defines(char* source, const char* defines) {
+	char* version = strstr(source, "#version");
+	char* line = version ? strchr(version, '\n') : NULL;
+	size_t before = line ? (size_t)(line + 1 - source) : 0, length = strlen(defines), after = strlen(source + before);
+	char* expanded = malloc(before + length + 1 + after + 1);
+	memcpy(expanded, source, before);
+	memcpy(expanded + before, defines, length);
+	expanded[before + length] = '\n';
+	memcpy(expanded + before + length + 1, source + before, after + 1);
+	free(source);
+	return expanded;
+}
+
 static bool verify(GLuint id, GLenum status, void (*get_iv)(GLuint, GLenum, GLint*), void (*get_log)(GLuint, GLsizei, GLsizei*, GLchar*)) {
 	int success;
 	char infoLog[2048];
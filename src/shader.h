@@ -5,6 +5,8 @@
 typedef struct {
 	unsigned int shader;
 	const char* path;
+	// Optional lines inserted after #version, lets one file build several variants
+	const char* defines;
 } ShaderArgs;
 
 void create_shader(unsigned int* id, unsigned int count, ...);
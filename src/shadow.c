@@ -0,0 +1,195 @@
+#include "shadow.h"
+
+#include <string.h>
+#include <glad/glad.h>
+#include "log.h"
+
+static void shadow_fit(ShadowMap* s, unsigned int cascade, const Scene* scene, vec3 center, float radius);
+static void shadow_draw(Scene* scene, const CullOutput* output, unsigned int cascade, enum COMMAND_RANGE range, unsigned int depthProgram, unsigned int maskProgram);
+
+void shadow_init(ShadowMap* s) {
+	memset(s, 0, sizeof(ShadowMap));
+	s->cache = true;
+
+	glCreateTextures(GL_TEXTURE_2D_ARRAY, 1, &s->map);
+	glTextureStorage3D(s->map, 1, GL_DEPTH_COMPONENT32F, SHADOW_SIZE, SHADOW_SIZE, SHADOW_CASCADES);
+	glCreateTextures(GL_TEXTURE_2D_ARRAY, 1, &s->static_map);
+	glTextureStorage3D(s->static_map, 1, GL_DEPTH_COMPONENT32F, SHADOW_SIZE, SHADOW_SIZE, SHADOW_CASCADES);
+	glTextureParameteri(s->map, GL_TEXTURE_COMPARE_MODE, GL_COMPARE_REF_TO_TEXTURE);
+	glTextureParameteri(s->map, GL_TEXTURE_COMPARE_FUNC, GL_LEQUAL);
+	glTextureParameteri(s->map, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glTextureParameteri(s->map, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTextureParameteri(s->map, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTextureParameteri(s->map, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glBindTextureUnit(SHADOW_UNIT, s->map);
+
+	glCreateFramebuffers(SHADOW_CASCADES, s->framebuffers);
+	glCreateFramebuffers(SHADOW_CASCADES, s->static_framebuffers);
+	for (unsigned int i = 0; i < SHADOW_CASCADES; i++) {
+		unsigned int framebuffers[2] = { s->framebuffers[i], s->static_framebuffers[i] };
+		unsigned int maps[2] = { s->map, s->static_map };
+		for (unsigned int j = 0; j < 2; j++) {
+			glNamedFramebufferTextureLayer(framebuffers[j], GL_DEPTH_ATTACHMENT, maps[j], 0, i);
+			glNamedFramebufferDrawBuffer(framebuffers[j], GL_NONE);
+			glNamedFramebufferReadBuffer(framebuffers[j], GL_NONE);
+			if (glCheckNamedFramebufferStatus(framebuffers[j], GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+				plogf(LL_ERROR, "Shadow framebuffer %u incomplete\n", i);
+		}
+		gpu_timer_init(&s->timers[i]);
+	}
+
+	// No cascades until the first update, everything is lit
+	glCreateBuffers(1, &s->params_buffer);
+	glNamedBufferData(s->params_buffer, sizeof(ShadowParams), &s->params, GL_DYNAMIC_DRAW);
+
+	int alignment = 1;
+	glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &alignment);
+	alignment = alignment > 0 ? alignment : 1;
+	s->view_stride = (sizeof(CullView) + alignment - 1) / alignment * alignment;
+	glCreateBuffers(1, &s->view_buffer);
+	glNamedBufferData(s->view_buffer, s->view_stride * SHADOW_CASCADES, NULL, GL_DYNAMIC_DRAW);
+
+	plogf(LL_INFO, "Shadow map: %u cascades of %ux%u, %.2f MiB with the static layers\n", SHADOW_CASCADES, SHADOW_SIZE, SHADOW_SIZE,
+		(double)SHADOW_SIZE * SHADOW_SIZE * 4 * SHADOW_CASCADES * 2 / 1048576.0);
+}
+
+void shadow_destroy(ShadowMap* s) {
+	glDeleteTextures(1, &s->map);
+	glDeleteTextures(1, &s->static_map);
+	glDeleteFramebuffers(SHADOW_CASCADES, s->framebuffers);
+	glDeleteFramebuffers(SHADOW_CASCADES, s->static_framebuffers);
+	glDeleteBuffers(1, &s->params_buffer);
+	glDeleteBuffers(1, &s->view_buffer);
+	cull_output_destroy(&s->output);
+	for (unsigned int i = 0; i < SHADOW_CASCADES; i++) gpu_timer_destroy(&s->timers[i]);
+}
+
+void shadow_update(ShadowMap* s, Scene* scene, const Camera* camera, const vec3 direction, unsigned int cullProgram, unsigned int depthProgram, unsigned int maskProgram) {
+	if (!scene->n_commands) return;
+	// Outputs moved, every cascade has to be redrawn
+	if (cull_output_reserve(&s->output, scene, SHADOW_CASCADES, 1)) memset(s->valid, 0, sizeof(s->valid));
+	vec3 light;
+	glm_vec3_normalize_to((float*)direction, light);
+	if (glm_vec3_dot(light, s->direction) < 0.9999f) {
+		glm_vec3_copy(light, s->direction);
+		memset(s->valid, 0, sizeof(s->valid));
+	}
+
+	// Slices of the view between practical split distances, each bounded by a sphere so the
+	// cascade size doesn't change as the camera turns
+	const unsigned int intervals[SHADOW_CASCADES] = SHADOW_INTERVALS;
+	float zNear = camera->z_near, zFar = fminf(camera->z_far, SHADOW_DISTANCE);
+	float tanHalf = tanf(camera->fov * 0.5f), aspect = camera->vp_width / camera->vp_height;
+	vec3 up;
+	glm_vec3_cross((float*)camera->right, (float*)camera->front, up);
+	bool update[SHADOW_CASCADES] = { false }, redraw[SHADOW_CASCADES] = { false };
+	unsigned int nUpdates = 0;
+	for (unsigned int i = 0; i < SHADOW_CASCADES; i++) {
+		float split[2];
+		for (unsigned int j = 0; j < 2; j++) {
+			float t = (float)(i + j) / SHADOW_CASCADES;
+			split[j] = SHADOW_SPLIT_LAMBDA * zNear * powf(zFar / zNear, t) + (1.0f - SHADOW_SPLIT_LAMBDA) * (zNear + (zFar - zNear) * t);
+		}
+		vec3 corners[8], center = { 0.0f, 0.0f, 0.0f };
+		for (unsigned int c = 0; c < 8; c++) {
+			float d = split[c >> 2];
+			glm_vec3_copy((float*)camera->position, corners[c]);
+			glm_vec3_muladds((float*)camera->front, d, corners[c]);
+			glm_vec3_muladds((float*)camera->right, (c & 1 ? d : -d) * tanHalf * aspect, corners[c]);
+			glm_vec3_muladds(up, (c & 2 ? d : -d) * tanHalf, corners[c]);
+			glm_vec3_muladds(corners[c], 1.0f / 8.0f, center);
+		}
+		float radius = 0.0f;
+		for (unsigned int c = 0; c < 8; c++) radius = fmaxf(radius, glm_vec3_distance(center, corners[c]));
+		// Snap away float noise so an unchanged slice keeps the same size
+		radius = ceilf(radius * 16.0f) / 16.0f;
+
+		// Instance set edits only redraw the sets over the static layer, the cascade keeps its fit
+		bool refit = !s->cache || !s->valid[i] || s->static_revision[i] != scene->static_revision ||
+			glm_vec3_distance(center, s->covered[i]) + radius > s->covered[i][3];
+		bool stale = refit || s->revision[i] != scene->revision;
+		bool due = !s->cache || !s->valid[i] || s->frame % intervals[i] == 0;
+		if (!stale || !due) continue;
+		if (refit) shadow_fit(s, i, scene, center, s->cache ? radius * (1.0f + SHADOW_MARGIN) : radius);
+		s->revision[i] = scene->revision;
+		redraw[i] = refit;
+		update[i] = true;
+		nUpdates++;
+	}
+	s->frame++;
+	if (!nUpdates) return;
+
+	glEnable(GL_DEPTH_CLAMP);
+	glEnable(GL_POLYGON_OFFSET_FILL);
+	glPolygonOffset(2.0f, 4.0f);
+	glViewport(0, 0, SHADOW_SIZE, SHADOW_SIZE);
+	for (unsigned int i = 0; i < SHADOW_CASCADES; i++) {
+		if (!update[i]) continue;
+		gpu_timer_begin(&s->timers[i]);
+		glBindBufferRange(GL_UNIFORM_BUFFER, UBO_CULL, s->view_buffer, s->view_stride * i, sizeof(CullView));
+		glUseProgram(cullProgram);
+		scene_cull(scene, &s->output, i, 0);
+		if (!s->cache) {
+			glBindFramebuffer(GL_FRAMEBUFFER, s->framebuffers[i]);
+			glClear(GL_DEPTH_BUFFER_BIT);
+			shadow_draw(scene, &s->output, i, COMMANDS_ALL, depthProgram, maskProgram);
+			// The static layer was skipped, it is redrawn once caching is back on
+			s->valid[i] = false;
+		} else {
+			if (redraw[i]) {
+				glBindFramebuffer(GL_FRAMEBUFFER, s->static_framebuffers[i]);
+				glClear(GL_DEPTH_BUFFER_BIT);
+				shadow_draw(scene, &s->output, i, COMMANDS_NODES, depthProgram, maskProgram);
+			}
+			glCopyImageSubData(s->static_map, GL_TEXTURE_2D_ARRAY, 0, 0, 0, i, s->map, GL_TEXTURE_2D_ARRAY, 0, 0, 0, i, SHADOW_SIZE, SHADOW_SIZE, 1);
+			glBindFramebuffer(GL_FRAMEBUFFER, s->framebuffers[i]);
+			shadow_draw(scene, &s->output, i, COMMANDS_SETS, depthProgram, maskProgram);
+		}
+		gpu_timer_end(&s->timers[i]);
+		s->updates[i]++;
+	}
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	glViewport(0, 0, camera->vp_width, camera->vp_height);
+	glDisable(GL_POLYGON_OFFSET_FILL);
+	glDisable(GL_DEPTH_CLAMP);
+
+	s->params.n_cascades = SHADOW_CASCADES;
+	glNamedBufferSubData(s->params_buffer, 0, sizeof(ShadowParams), &s->params);
+}
+
+// Orthographic box around the sphere in light space, snapped to whole texels so a moving
+// camera doesn't make the cascade edges crawl
+static void shadow_fit(ShadowMap* s, unsigned int cascade, const Scene* scene, vec3 center, float radius) {
+	vec3 up = { 0.0f, 1.0f, 0.0f };
+	if (fabsf(s->direction[1]) > 0.99f) glm_vec3_copy((vec3){ 1.0f, 0.0f, 0.0f }, up);
+	mat4 view, projection;
+	glm_look((vec3){ 0.0f, 0.0f, 0.0f }, s->direction, up, view);
+	vec3 c;
+	glm_mat4_mulv3(view, center, 1.0f, c);
+	float texel = 2.0f * radius / SHADOW_SIZE;
+	c[0] = floorf(c[0] / texel) * texel;
+	c[1] = floorf(c[1] / texel) * texel;
+	glm_ortho(c[0] - radius, c[0] + radius, c[1] - radius, c[1] + radius, -c[2] - radius - SHADOW_CASTER_DISTANCE, -c[2] + radius, projection);
+
+	CullView* v = &s->views[cascade];
+	mat4 viewProjection;
+	glm_mat4_mul(projection, view, viewProjection);
+	cull_view_init(v, scene, viewProjection, cascade);
+	glNamedBufferSubData(s->view_buffer, s->view_stride * cascade, sizeof(CullView), v);
+
+	glm_mat4_copy(v->view_projection, s->params.cascades[cascade].view_projection);
+	s->params.cascades[cascade].texel = texel;
+	// The snap moves the box by up to a texel per axis
+	glm_vec4(center, radius - 2.0f * texel, s->covered[cascade]);
+	s->static_revision[cascade] = scene->static_revision;
+	s->valid[cascade] = true;
+}
+
+// Casters of one command range into the bound layer. Cutouts cast the shape their mask leaves,
+// transparent objects cast no shadow
+static void shadow_draw(Scene* scene, const CullOutput* output, unsigned int cascade, enum COMMAND_RANGE range, unsigned int depthProgram, unsigned int maskProgram) {
+	glUseProgram(depthProgram);
+	scene_render_culled(scene, output, cascade, QUEUE_OPAQUE, range, true);
+	glUseProgram(maskProgram);
+	scene_render_culled(scene, output, cascade, QUEUE_MASKED, range, true);
+}
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <cglm/cglm.h>
+#include "camera.h"
+#include "profile.h"
+#include "scene.h"
+
+#define SHADOW_CASCADES 4
+#define SHADOW_SIZE 2048
+// Texture unit the shadow map stays bound to, matches shadow.glsl
+#define SHADOW_UNIT 8
+// View distance covered by the cascades, splits blend uniform and logarithmic spacing by SHADOW_SPLIT_LAMBDA
+#define SHADOW_DISTANCE 60.0f
+#define SHADOW_SPLIT_LAMBDA 0.75f
+// A cascade covers this much more than its slice, it is reused until the slice leaves that margin
+#define SHADOW_MARGIN 0.25f
+// Casters this far toward the light from a cascade still land in it
+#define SHADOW_CASTER_DISTANCE 50.0f
+// Frames between updates of each cascade once it is stale, far cascades lag behind
+#define SHADOW_INTERVALS { 1, 1, 2, 4 }
+
+// Cascade in the Shadows UBO of shadow.glsl
+typedef struct {
+	mat4 view_projection;
+	float texel;
+	float pad[3];
+} ShadowCascade;
+
+typedef struct {
+	ShadowCascade cascades[SHADOW_CASCADES];
+	unsigned int n_cascades;
+	unsigned int pad[3];
+} ShadowParams;
+
+typedef struct {
+	// D32F array, one layer per cascade
+	unsigned int map;
+	unsigned int framebuffers[SHADOW_CASCADES];
+	// Node casters alone, copied into map before the instance sets are drawn over them
+	unsigned int static_map;
+	unsigned int static_framebuffers[SHADOW_CASCADES];
+	ShadowParams params;
+	unsigned int params_buffer;
+	// One CullView per cascade at view_stride, bound as a range for its cull and draw
+	CullView views[SHADOW_CASCADES];
+	unsigned int view_buffer;
+	int view_stride;
+	// One region per cascade
+	CullOutput output;
+
+	// What each cascade was last drawn with: the sphere it covers, the light and the scene revisions
+	vec4 covered[SHADOW_CASCADES];
+	unsigned int revision[SHADOW_CASCADES];
+	unsigned int static_revision[SHADOW_CASCADES];
+	bool valid[SHADOW_CASCADES];
+	vec3 direction;
+	unsigned int frame;
+	// Off redraws every cascade every frame
+	bool cache;
+
+	GpuTimer timers[SHADOW_CASCADES];
+	unsigned int updates[SHADOW_CASCADES];
+} ShadowMap;
+
+void shadow_init(ShadowMap* s);
+void shadow_destroy(ShadowMap* s);
+// Fit the cascades to the camera slices and redraw the stale ones: culled by cullProgram, drawn with depthProgram
+// and masked casters alpha tested by maskProgram
+void shadow_update(ShadowMap* s, Scene* scene, const Camera* camera, const vec3 direction, unsigned int cullProgram, unsigned int depthProgram, unsigned int maskProgram);
@@ -3,8 +3,19 @@
 #include "stb_image.h"
 #include <glad/glad.h>
 #include <math.h>
+#include <stdlib.h>
+#include <string.h>
 #include "log.h"
 
+#define MIN(a, b) (((a) < (b)) ? (a) : (b))
+#define MAX(a, b) (((a) > (b)) ? (a) : (b))
+
+static void texture_format(int nrComponents, GLenum* fmt, GLenum* ifmt);
+static unsigned char* decode_levels(const char* path, const TextureInfo* info, size_t* offsets);
+static unsigned int texture_storage(const TextureInfo* info, unsigned int first);
+static void upload_levels(unsigned int id, const TextureInfo* info, unsigned int first, unsigned int begin, unsigned int end, const unsigned char* data, const size_t* offsets);
+static void downsample(const unsigned char* src, int width, int height, int components, unsigned char* dst);
+
 bool load_texture(unsigned int* id, const char* path, bool mipmap, int wrapS, int wrapT, int minFilter, int magFilter) {
 	int width, height, nrComponents;
 	unsigned char* data = stbi_load(path, &width, &height, &nrComponents, 0);
@@ -14,16 +25,7 @@ bool load_texture(unsigned int* id, const char* path, bool mipmap, int wrapS, in
 	}
 
 	GLenum fmt = 0, ifmt = 0;
-	if (nrComponents == 1) {
-		fmt = GL_RED;
-		ifmt = GL_R8;
-	}	else if (nrComponents == 3) {
-		fmt = GL_RGB;
-		ifmt = GL_RGB8;
-	}	else if (nrComponents == 4) {
-		fmt = GL_RGBA;
-		ifmt = GL_RGBA8;
-	}	
+	texture_format(nrComponents, &fmt, &ifmt);
 
 	glCreateTextures(GL_TEXTURE_2D, 1, id);
 	glTextureParameteri(*id, GL_TEXTURE_WRAP_S, wrapS);
@@ -43,4 +45,163 @@ void load_texture_color(unsigned int* id, unsigned char color[3]) {
 	glCreateTextures(GL_TEXTURE_2D, 1, id);
 	glTextureStorage2D(*id, 1, GL_RGB8, 1, 1);
 	glTextureSubImage2D(*id, 0, 0, 0, 1, 1, GL_RGB, GL_UNSIGNED_BYTE, color);
-}
\ No newline at end of file
+}
+
+// Decode the source and keep only the levels no larger than coarseSize, finer levels get storage
+// once texture_reallocate streams them in
+bool load_texture_streamed(unsigned int* id, TextureInfo* info, unsigned int* first, const char* path, unsigned int coarseSize, int wrapS, int wrapT, int minFilter, int magFilter) {
+	if (!stbi_info(path, &info->width, &info->height, &info->components)) {
+		plogf(LL_ERROR, "Failed to load texture: %s\n", path);
+		return false;
+	}
+	info->levels = MIN(1 + floor(log2(fmax(info->width, info->height))), TEXTURE_LEVEL_MAX);
+	*info = (TextureInfo) { info->width, info->height, info->components, info->levels, wrapS, wrapT, minFilter, magFilter };
+
+	size_t offsets[TEXTURE_LEVEL_MAX];
+	unsigned char* data = decode_levels(path, info, offsets);
+	if (!data) return false;
+	*first = 0;
+	while (*first < info->levels - 1 && (unsigned int)MAX(info->width >> *first, info->height >> *first) > coarseSize)
+		(*first)++;
+	*id = texture_storage(info, *first);
+	upload_levels(*id, info, *first, *first, info->levels, data, offsets);
+	free(data);
+	return true;
+}
+
+unsigned int texture_reallocate(unsigned int id, const TextureInfo* info, unsigned int oldFirst, unsigned int newFirst, const TextureDecode* decode) {
+	if (newFirst < oldFirst && atomic_load(&decode->state) != DECODE_READY) return 0;
+	unsigned int next = texture_storage(info, newFirst);
+	for (unsigned int level = MAX(oldFirst, newFirst); level < info->levels; level++) {
+		int width = MAX(info->width >> level, 1), height = MAX(info->height >> level, 1);
+		glCopyImageSubData(id, GL_TEXTURE_2D, level - oldFirst, 0, 0, 0, next, GL_TEXTURE_2D, level - newFirst, 0, 0, 0, width, height, 1);
+	}
+	if (newFirst < oldFirst) upload_levels(next, info, newFirst, newFirst, oldFirst, decode->data, decode->offsets);
+	return next;
+}
+
+static void* decode_worker(void* arg) {
+	TextureDecode* d = arg;
+	d->data = decode_levels(d->path, &d->info, d->offsets);
+	atomic_store(&d->state, d->data ? DECODE_READY : DECODE_FAILED);
+	return NULL;
+}
+
+void texture_decode_start(TextureDecode* d, const char* path, const TextureInfo* info) {
+	if (atomic_load(&d->state) != DECODE_NONE) return;
+	d->path = path;
+	d->info = *info;
+	d->data = NULL;
+	d->joined = false;
+	atomic_store(&d->state, DECODE_PENDING);
+	if (pthread_create(&d->thread, NULL, decode_worker, d)) {
+		plogf(LL_ERROR, "Failed to start decoding texture: %s\n", path);
+		d->joined = true;
+		atomic_store(&d->state, DECODE_FAILED);
+	}
+}
+
+enum TEXTURE_DECODE_STATE texture_decode_poll(TextureDecode* d) {
+	enum TEXTURE_DECODE_STATE state = atomic_load(&d->state);
+	if ((state == DECODE_READY || state == DECODE_FAILED) && !d->joined) {
+		pthread_join(d->thread, NULL);
+		d->joined = true;
+	}
+	return state;
+}
+
+void texture_decode_release(TextureDecode* d) {
+	if (atomic_load(&d->state) != DECODE_NONE && !d->joined) pthread_join(d->thread, NULL);
+	free(d->data);
+	d->data = NULL;
+	d->joined = false;
+	atomic_store(&d->state, DECODE_NONE);
+}
+
+// Every level of the source in one allocation, downsampled from the previous level
+static unsigned char* decode_levels(const char* path, const TextureInfo* info, size_t* offsets) {
+	int width, height, nrComponents;
+	unsigned char* image = stbi_load(path, &width, &height, &nrComponents, info->components);
+	if (!image || width != info->width || height != info->height) {
+		plogf(LL_ERROR, "Failed to load texture: %s\n", path);
+		stbi_image_free(image);
+		return NULL;
+	}
+	size_t size = 0;
+	for (unsigned int level = 0; level < info->levels; level++) {
+		offsets[level] = size;
+		size += texture_level_size(info, level);
+	}
+	unsigned char* data = malloc(size);
+	if (!data) {
+		plogf(LL_ERROR, "Failed to allocate texture levels: %s\n", path);
+		stbi_image_free(image);
+		return NULL;
+	}
+	memcpy(data, image, texture_level_size(info, 0));
+	stbi_image_free(image);
+	for (unsigned int level = 1; level < info->levels; level++)
+		downsample(data + offsets[level - 1], MAX(width >> (level - 1), 1), MAX(height >> (level - 1), 1), info->components, data + offsets[level]);
+	return data;
+}
+
+// Immutable storage for full chain levels [first, levels), sampled as levels [0, levels - first)
+static unsigned int texture_storage(const TextureInfo* info, unsigned int first) {
+	GLenum fmt = 0, ifmt = 0;
+	texture_format(info->components, &fmt, &ifmt);
+	unsigned int id = 0;
+	glCreateTextures(GL_TEXTURE_2D, 1, &id);
+	glTextureParameteri(id, GL_TEXTURE_WRAP_S, info->wrap_s);
+	glTextureParameteri(id, GL_TEXTURE_WRAP_T, info->wrap_t);
+	glTextureParameteri(id, GL_TEXTURE_MIN_FILTER, info->min_filter);
+	glTextureParameteri(id, GL_TEXTURE_MAG_FILTER, info->mag_filter);
+	glTextureStorage2D(id, info->levels - first, ifmt, MAX(info->width >> first, 1), MAX(info->height >> first, 1));
+	return id;
+}
+
+// Upload full chain levels [begin, end) into a texture whose storage starts at full chain level first
+static void upload_levels(unsigned int id, const TextureInfo* info, unsigned int first, unsigned int begin, unsigned int end, const unsigned char* data, const size_t* offsets) {
+	GLenum fmt = 0, ifmt = 0;
+	texture_format(info->components, &fmt, &ifmt);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	for (unsigned int level = begin; level < end; level++)
+		glTextureSubImage2D(id, level - first, 0, 0, MAX(info->width >> level, 1), MAX(info->height >> level, 1), fmt, GL_UNSIGNED_BYTE, data + offsets[level]);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+}
+
+size_t texture_level_size(const TextureInfo* info, unsigned int level) {
+	if (level >= info->levels) return 0;
+	return (size_t)MAX(info->width >> level, 1) * MAX(info->height >> level, 1) * info->components;
+}
+
+static void texture_format(int nrComponents, GLenum* fmt, GLenum* ifmt) {
+	if (nrComponents == 1) {
+		*fmt = GL_RED;
+		*ifmt = GL_R8;
+	}	else if (nrComponents == 3) {
+		*fmt = GL_RGB;
+		*ifmt = GL_RGB8;
+	}	else if (nrComponents == 4) {
+		*fmt = GL_RGBA;
+		*ifmt = GL_RGBA8;
+	}
+}
+
+// 2x2 box filter, odd edges clamp to the last row/column
+static void downsample(const unsigned char* src, int width, int height, int components, unsigned char* dst) {
+	int w = MAX(width / 2, 1), h = MAX(height / 2, 1);
+	for (int y = 0; y < h; y++) {
+		int y0 = MIN(2 * y, height - 1), y1 = MIN(2 * y + 1, height - 1);
+		for (int x = 0; x < w; x++) {
+			int x0 = MIN(2 * x, width - 1), x1 = MIN(2 * x + 1, width - 1);
+			for (int c = 0; c < components; c++) {
+				unsigned int sum =
+					src[((size_t)y0 * width + x0) * components + c] +
+					src[((size_t)y0 * width + x1) * components + c] +
+					src[((size_t)y1 * width + x0) * components + c] +
+					src[((size_t)y1 * width + x1) * components + c];
+				dst[((size_t)y * w + x) * components + c] = (sum + 2) / 4;
+			}
+		}
+	}
+}
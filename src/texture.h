@@ -1,5 +1,47 @@
 #pragma once
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stddef.h>
+
+// Mip levels of the largest texture accepted, 32768 texels across
+#define TEXTURE_LEVEL_MAX 16
+
+typedef struct {
+	int width, height, components;
+	unsigned int levels;
+	int wrap_s, wrap_t, min_filter, mag_filter;
+} TextureInfo;
+
+enum TEXTURE_DECODE_STATE {
+	DECODE_NONE,
+	DECODE_PENDING,
+	DECODE_READY,
+	DECODE_FAILED,
+};
+
+// Full mip chain of a streamed texture's source image, decoded on a worker thread and kept so later
+// reallocations upload from memory. Levels are packed finest first at offsets
+typedef struct {
+	const char* path;
+	TextureInfo info;
+	unsigned char* data;
+	size_t offsets[TEXTURE_LEVEL_MAX];
+	pthread_t thread;
+	atomic_int state;
+	bool joined;
+} TextureDecode;
 
 bool load_texture(unsigned int* id, const char* path, bool mipmap, int wrapS, int wrapT, int minFilter, int magFilter);
-void load_texture_color(unsigned int* id, unsigned char color[3]);
\ No newline at end of file
+void load_texture_color(unsigned int* id, unsigned char color[3]);
+// Storage only for the levels no larger than coarseSize, *first is the full chain level it starts at
+bool load_texture_streamed(unsigned int* id, TextureInfo* info, unsigned int* first, const char* path, unsigned int coarseSize, int wrapS, int wrapT, int minFilter, int magFilter);
+// New texture holding full chain levels [newFirst, levels) of one holding [oldFirst, levels). Levels both
+// hold are copied on the GPU, finer ones come from a ready decode. Returns 0 on failure
+unsigned int texture_reallocate(unsigned int id, const TextureInfo* info, unsigned int oldFirst, unsigned int newFirst, const TextureDecode* decode);
+void texture_decode_start(TextureDecode* d, const char* path, const TextureInfo* info);
+// Current state, a finished worker is joined on the first poll that sees it
+enum TEXTURE_DECODE_STATE texture_decode_poll(TextureDecode* d);
+// Waits for a running worker and frees the levels, the decode can be started again afterwards
+void texture_decode_release(TextureDecode* d);
+size_t texture_level_size(const TextureInfo* info, unsigned int level);
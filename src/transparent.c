@@ -0,0 +1,283 @@
+#include "transparent.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <glad/glad.h>
+#include "job.h"
+#include "log.h"
+
+#define MIN(a, b) (((a) < (b)) ? (a) : (b))
+#define MAX(a, b) (((a) > (b)) ? (a) : (b))
+
+typedef struct {
+	TransparentQueue* q;
+	const Scene* scene;
+	vec3 position;
+	vec3 front;
+} TransparentKeys;
+
+typedef struct {
+	TransparentQueue* q;
+	const uint64_t* src;
+	uint64_t* dst;
+	unsigned int shift;
+} TransparentRadix;
+
+static void transparent_reserve(TransparentQueue* q, unsigned int count);
+static unsigned int transparent_command(const TransparentQueue* q, unsigned int nCommands, unsigned int entry);
+static void transparent_keys(void* ctx, unsigned int chunk);
+static bool transparent_insertion(uint64_t* entries, unsigned int count, size_t budget);
+static void transparent_radix(TransparentQueue* q);
+static void transparent_histogram(void* ctx, unsigned int chunk);
+static void transparent_scatter(void* ctx, unsigned int chunk);
+static void transparent_emit(TransparentQueue* q, const Scene* scene);
+
+void transparent_init(TransparentQueue* q) {
+	memset(q, 0, sizeof(TransparentQueue));
+	glGetIntegerv(GL_SHADER_STORAGE_BUFFER_OFFSET_ALIGNMENT, &q->draw_alignment);
+	q->draw_alignment = MAX(q->draw_alignment, 1);
+	glCreateBuffers(1, &q->command_buffer);
+	glCreateBuffers(1, &q->draw_buffer);
+	glCreateBuffers(1, &q->instance_buffer);
+}
+
+void transparent_destroy(TransparentQueue* q) {
+	glDeleteBuffers(1, &q->command_buffer);
+	glDeleteBuffers(1, &q->draw_buffer);
+	glDeleteBuffers(1, &q->instance_buffer);
+	free(q->entries);
+	free(q->scratch);
+	free(q->first);
+	free(q->commands);
+	free(q->instances);
+	free(q->batches);
+	free(q->draws);
+	free(q->histograms);
+	memset(q, 0, sizeof(TransparentQueue));
+}
+
+// Keys are recomputed for every instance each frame. Last frame's order is kept when the instance count
+// didn't change, the new keys are then nearly sorted already and an insertion pass finishes them unless
+// too much moved, otherwise the keys are radix sorted from scratch
+void transparent_sort(TransparentQueue* q, const Scene* scene, const Camera* camera) {
+	double start = plog_time();
+	unsigned int nCommands = scene->n_transparent, count = 0;
+	if (nCommands + 1 > q->first_capacity) {
+		q->first_capacity = MAX(nCommands + 1, q->first_capacity * 2);
+		q->first = realloc(q->first, sizeof(unsigned int) * q->first_capacity);
+	}
+	for (unsigned int i = 0; i < nCommands; i++) {
+		const TransparentCommand* c = &scene->transparent[i];
+		q->first[i] = count;
+		count += c->set ? c->set->n_instances : c->count;
+	}
+	q->first[nCommands] = count;
+	if (count != q->n_entries) q->ordered = false;
+	transparent_reserve(q, count);
+	q->n_entries = count;
+	q->n_commands = q->n_batches = 0;
+	if (!count) return;
+
+	TransparentKeys keys = { .q = q, .scene = scene };
+	glm_vec3_copy((float*)camera->position, keys.position);
+	glm_vec3_copy((float*)camera->front, keys.front);
+	job_parallel_for((count + TRANSPARENT_CHUNK - 1) / TRANSPARENT_CHUNK, transparent_keys, &keys);
+
+	if (q->ordered && transparent_insertion(q->entries, count, (size_t)count * TRANSPARENT_COHERENT_MOVES)) {
+		q->coherent_sorts++;
+	} else {
+		transparent_radix(q);
+		q->full_sorts++;
+	}
+	q->ordered = true;
+	q->sort_time += plog_time() - start;
+
+	transparent_emit(q, scene);
+}
+
+void transparent_render(const TransparentQueue* q) {
+	if (!q->n_batches) return;
+	glEnable(GL_BLEND);
+	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+	glDepthMask(GL_FALSE);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, SSBO_SORTED, q->instance_buffer);
+	glBindBuffer(GL_DRAW_INDIRECT_BUFFER, q->command_buffer);
+	for (unsigned int i = 0; i < q->n_batches; i++) {
+		const TransparentBatch* b = &q->batches[i];
+		glBindBufferRange(GL_SHADER_STORAGE_BUFFER, SSBO_DRAW, q->draw_buffer, b->draw_offset, sizeof(DrawData) * b->count);
+		glBindVertexArray(b->geometry->vertex_array);
+		glMultiDrawElementsIndirect(b->geometry->primitive, GL_UNSIGNED_INT, (const void*)(sizeof(DrawIndirectCommand) * b->first), b->count, 0);
+	}
+	glDepthMask(GL_TRUE);
+	glDisable(GL_BLEND);
+}
+
+// Commands and batches never outnumber the entries, so everything but the draws is sized by the entry count
+static void transparent_reserve(TransparentQueue* q, unsigned int count) {
+	if (count > q->capacity) {
+		q->capacity = MAX(count, q->capacity * 2);
+		// Grown arrays lose the order, the old contents aren't copied over
+		free(q->entries);
+		free(q->scratch);
+		free(q->commands);
+		free(q->instances);
+		free(q->batches);
+		q->entries = malloc(sizeof(uint64_t) * q->capacity);
+		q->scratch = malloc(sizeof(uint64_t) * q->capacity);
+		q->commands = malloc(sizeof(DrawIndirectCommand) * q->capacity);
+		q->instances = malloc(sizeof(unsigned int) * q->capacity);
+		q->batches = malloc(sizeof(TransparentBatch) * q->capacity);
+		q->ordered = false;
+	}
+	unsigned int nChunks = (count + TRANSPARENT_CHUNK - 1) / TRANSPARENT_CHUNK;
+	if (nChunks * TRANSPARENT_RADIX > q->histogram_capacity) {
+		q->histogram_capacity = nChunks * TRANSPARENT_RADIX;
+		q->histograms = realloc(q->histograms, sizeof(unsigned int) * q->histogram_capacity);
+	}
+}
+
+// Command owning an entry, the last one whose first entry isn't past it
+static unsigned int transparent_command(const TransparentQueue* q, unsigned int nCommands, unsigned int entry) {
+	unsigned int low = 0, high = nCommands;
+	while (high - low > 1) {
+		unsigned int mid = (low + high) / 2;
+		if (q->first[mid] <= entry) low = mid;
+		else high = mid;
+	}
+	return low;
+}
+
+// Key of each entry from the view depth of its bounds center, flipped so the farthest sorts first.
+// Procedural sets only store their set transform, each instance is generated here from its pattern
+static void transparent_keys(void* ctx, unsigned int chunk) {
+	TransparentKeys* k = ctx;
+	TransparentQueue* q = k->q;
+	unsigned int begin = chunk * TRANSPARENT_CHUNK, end = MIN(begin + TRANSPARENT_CHUNK, q->n_entries);
+	for (unsigned int i = begin; i < end; i++) {
+		unsigned int entry = q->ordered ? (unsigned int)q->entries[i] : i;
+		unsigned int c = transparent_command(q, k->scene->n_transparent, entry);
+		const TransparentCommand* command = &k->scene->transparent[c];
+		unsigned int transform = command->draw.base_instance + (command->draw.generator ? 0 : entry - q->first[c]);
+		vec3 center;
+		glm_vec3_copy((float*)command->bounds, center);
+		if (command->draw.generator) {
+			mat4 local;
+			scene_generate_instance(command->set, entry - q->first[c], local);
+			glm_mat4_mulv3(local, center, 1.0f, center);
+		}
+		glm_mat4_mulv3(k->scene->transforms[transform].model, center, 1.0f, center);
+		glm_vec3_sub(center, k->position, center);
+		float depth = glm_vec3_dot(center, k->front);
+		// Float bits made to order like unsigned integers, then inverted
+		uint32_t bits;
+		memcpy(&bits, &depth, sizeof(bits));
+		bits ^= bits >> 31 ? 0xFFFFFFFFu : 0x80000000u;
+		q->entries[i] = (uint64_t)~bits << 32 | entry;
+	}
+}
+
+// Stable on the key so equal depths keep last frame's order, false once the moves run out. The entries
+// are still a permutation then and the radix sort takes over from there
+static bool transparent_insertion(uint64_t* entries, unsigned int count, size_t budget) {
+	size_t moves = 0;
+	for (unsigned int i = 1; i < count; i++) {
+		uint64_t e = entries[i];
+		unsigned int j = i;
+		while (j > 0 && entries[j - 1] >> 32 > e >> 32) {
+			entries[j] = entries[j - 1];
+			j--;
+			if (++moves > budget) {
+				entries[j] = e;
+				return false;
+			}
+		}
+		entries[j] = e;
+	}
+	return true;
+}
+
+// LSD radix sort of the keys, every pass counts digits per chunk in parallel, turns the counts into
+// per chunk offsets and scatters in parallel. Passes where every key has the same digit are skipped
+static void transparent_radix(TransparentQueue* q) {
+	unsigned int nChunks = (q->n_entries + TRANSPARENT_CHUNK - 1) / TRANSPARENT_CHUNK;
+	TransparentRadix radix = { .q = q, .src = q->entries, .dst = q->scratch };
+	for (unsigned int shift = 32; shift < 64; shift += TRANSPARENT_RADIX_BITS) {
+		radix.shift = shift;
+		job_parallel_for(nChunks, transparent_histogram, &radix);
+		unsigned int offset = 0;
+		bool skip = false;
+		for (unsigned int d = 0; d < TRANSPARENT_RADIX && !skip; d++) {
+			unsigned int total = 0;
+			for (unsigned int c = 0; c < nChunks; c++) {
+				unsigned int n = q->histograms[c * TRANSPARENT_RADIX + d];
+				q->histograms[c * TRANSPARENT_RADIX + d] = offset + total;
+				total += n;
+			}
+			skip = total == q->n_entries;
+			offset += total;
+		}
+		if (skip) continue;
+		job_parallel_for(nChunks, transparent_scatter, &radix);
+		uint64_t* swap = radix.dst;
+		radix.dst = (uint64_t*)radix.src;
+		radix.src = swap;
+	}
+	if (radix.src != q->entries) memcpy(q->entries, radix.src, sizeof(uint64_t) * q->n_entries);
+}
+
+static void transparent_histogram(void* ctx, unsigned int chunk) {
+	TransparentRadix* r = ctx;
+	unsigned int* counts = &r->q->histograms[chunk * TRANSPARENT_RADIX];
+	memset(counts, 0, sizeof(unsigned int) * TRANSPARENT_RADIX);
+	unsigned int begin = chunk * TRANSPARENT_CHUNK, end = MIN(begin + TRANSPARENT_CHUNK, r->q->n_entries);
+	for (unsigned int i = begin; i < end; i++)
+		counts[r->src[i] >> r->shift & (TRANSPARENT_RADIX - 1)]++;
+}
+
+static void transparent_scatter(void* ctx, unsigned int chunk) {
+	TransparentRadix* r = ctx;
+	unsigned int* offsets = &r->q->histograms[chunk * TRANSPARENT_RADIX];
+	unsigned int begin = chunk * TRANSPARENT_CHUNK, end = MIN(begin + TRANSPARENT_CHUNK, r->q->n_entries);
+	for (unsigned int i = begin; i < end; i++)
+		r->dst[offsets[r->src[i] >> r->shift & (TRANSPARENT_RADIX - 1)]++] = r->src[i];
+}
+
+// Consecutive entries of one command share an indirect command, consecutive commands of one geometry
+// a batch. The sorted ids are the instance within the command, fetchInstanceAt resolves them like culled ones
+static void transparent_emit(TransparentQueue* q, const Scene* scene) {
+	unsigned int current = UINT32_MAX;
+	TransparentBatch* batch = NULL;
+	q->draw_size = 0;
+	for (unsigned int i = 0; i < q->n_entries; i++) {
+		unsigned int entry = (unsigned int)q->entries[i];
+		unsigned int c = transparent_command(q, scene->n_transparent, entry);
+		const TransparentCommand* command = &scene->transparent[c];
+		q->instances[i] = entry - q->first[c];
+		if (c == current) {
+			q->commands[q->n_commands - 1].n_instance++;
+			continue;
+		}
+		current = c;
+		// Room for the padding of a new batch and one more DrawData
+		if (q->draw_size + q->draw_alignment + sizeof(DrawData) > q->draw_capacity) {
+			q->draw_capacity = MAX(q->draw_size + q->draw_alignment + sizeof(DrawData), q->draw_capacity * 2);
+			q->draws = realloc(q->draws, q->draw_capacity);
+		}
+		if (!batch || batch->geometry != command->geometry) {
+			q->draw_size = (q->draw_size + q->draw_alignment - 1) / q->draw_alignment * q->draw_alignment;
+			batch = &q->batches[q->n_batches++];
+			*batch = (TransparentBatch) { .geometry = command->geometry, .first = q->n_commands, .draw_offset = (unsigned int)q->draw_size };
+		}
+		q->commands[q->n_commands] = command->command;
+		q->commands[q->n_commands].n_instance = 1;
+		q->commands[q->n_commands].base_instance = i;
+		q->n_commands++;
+		memcpy(q->draws + q->draw_size, &command->draw, sizeof(DrawData));
+		q->draw_size += sizeof(DrawData);
+		batch->count++;
+	}
+	// Rewritten every frame, the previous storage is orphaned rather than waited on
+	glNamedBufferData(q->command_buffer, sizeof(DrawIndirectCommand) * q->n_commands, q->commands, GL_STREAM_DRAW);
+	glNamedBufferData(q->draw_buffer, q->draw_size, q->draws, GL_STREAM_DRAW);
+	glNamedBufferData(q->instance_buffer, sizeof(unsigned int) * q->n_entries, q->instances, GL_STREAM_DRAW);
+}
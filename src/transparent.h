@@ -0,0 +1,65 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "camera.h"
+#include "scene.h"
+
+// Entries per job of the key and radix passes
+#define TRANSPARENT_CHUNK 8192
+// Insertion moves allowed per entry before a coherent sort gives up and radix sorts
+#define TRANSPARENT_COHERENT_MOVES 8
+// Radix digits of the 32 bit depth key
+#define TRANSPARENT_RADIX_BITS 8
+#define TRANSPARENT_RADIX (1 << TRANSPARENT_RADIX_BITS)
+
+// Runs of sorted instances sharing a geometry, one multi draw each with their DrawData from draw_offset
+typedef struct {
+	Geometry* geometry;
+	unsigned int first;
+	unsigned int count;
+	unsigned int draw_offset;
+} TransparentBatch;
+
+typedef struct {
+	// Depth key in the high word, entry in the low word, farthest first. Entries index the instances of
+	// every transparent command back to back, first holds where each command's entries start
+	uint64_t* entries;
+	uint64_t* scratch;
+	unsigned int n_entries;
+	unsigned int capacity;
+	unsigned int* first;
+	unsigned int first_capacity;
+	// entries holds last frame's order, worth keeping if it changed little
+	bool ordered;
+
+	// Draws of the last sort, a new command whenever the next entry belongs to another command
+	DrawIndirectCommand* commands;
+	unsigned int* instances;
+	unsigned int n_commands;
+	TransparentBatch* batches;
+	unsigned int n_batches;
+	// DrawData of every batch from its aligned draw_offset, laid out as uploaded
+	unsigned char* draws;
+	size_t draw_size;
+	size_t draw_capacity;
+	int draw_alignment;
+	unsigned int command_buffer;
+	unsigned int draw_buffer;
+	unsigned int instance_buffer;
+	// Per chunk digit counts of a radix pass
+	unsigned int* histograms;
+	unsigned int histogram_capacity;
+
+	// Seconds spent in transparent_sort since the counters were last reset
+	double sort_time;
+	unsigned int coherent_sorts;
+	unsigned int full_sorts;
+} TransparentQueue;
+
+void transparent_init(TransparentQueue* q);
+void transparent_destroy(TransparentQueue* q);
+// Order every transparent instance back to front from the camera and upload the draws
+void transparent_sort(TransparentQueue* q, const Scene* scene, const Camera* camera);
+// Blend the sorted draws over the bound target, expects a TRANSFORM_SORTED program
+void transparent_render(const TransparentQueue* q);